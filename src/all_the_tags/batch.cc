@@ -0,0 +1,37 @@
+#include "all_the_tags/batch.h"
+
+size_t QueryBatch::add(const QueryClause *clause) {
+  roots.push_back(add_node(clause));
+  return roots.size() - 1;
+}
+
+int QueryBatch::add_node(const QueryClause *clause) {
+  // clauses with the same key match the same entities, so they can
+  // share a result
+  std::string key = clause_key(clause);
+  auto iter = node_by_key.find(key);
+  if(iter != node_by_key.end()) {
+    return iter->second;
+  }
+
+  Node node = {Node_Leaf, -1, -1, nullptr};
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    node.type = (bin->type == QueryClauseAnd) ? Node_And : Node_Or;
+    node.l = add_node(bin->l);
+    node.r = add_node(bin->r);
+  }
+  else if(auto not_clause = dynamic_cast<const QueryClauseNot*>(clause)) {
+    node.type = Node_Not;
+    node.l = add_node(not_clause->c);
+  }
+  else {
+    node.leaf = clause;
+  }
+
+  int index = nodes.size();
+  nodes.push_back(node);
+  stamps.push_back(0);
+  results.push_back(false);
+  node_by_key[key] = index;
+  return index;
+}
@@ -0,0 +1,107 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+
+#include "all_the_tags/query.h"
+
+// a set of queries evaluated together in a single pass over the entities
+// (see `Context::query(const QueryBatch*, ...)`). clauses that are the same
+// in more than one query (or more than once in a query), e.g. two queries
+// that both test for a tag, are only evaluated once per entity
+struct QueryBatch {
+  // adds a query to the batch, returning its index. the clause isn't
+  // owned, and has to outlive the batch
+  size_t add(const QueryClause *clause);
+
+  // number of queries in the batch
+  size_t size() const {
+    return roots.size();
+  }
+
+  // number of distinct clauses across all of the queries
+  size_t num_shared() const {
+    return nodes.size();
+  }
+
+  // evaluates every query against an entity's tags, calling 'match' with
+  // the index of each query that matches. not thread safe, as results for
+  // the entity are remembered on the batch
+  template<class UnaryFunction>
+  void eval(const Tag::tagging_map& tags, UnaryFunction match) const {
+    if(++generation == 0) {
+      // wrapped around, so old stamps could look current
+      std::fill(stamps.begin(), stamps.end(), 0);
+      generation = 1;
+    }
+
+    for(size_t i = 0; i < roots.size(); i++) {
+      if(eval_node(roots[i], tags)) {
+        match(i);
+      }
+    }
+  }
+
+  QueryBatch() : generation(0) {}
+  QueryBatch(const QueryBatch&) = delete;
+
+private:
+  enum NodeType {
+    Node_And,
+    Node_Or,
+    Node_Not,
+    Node_Leaf
+  };
+
+  struct Node {
+    NodeType type;
+    int l, r;                 // operand node indexes (r unused for not)
+    const QueryClause *leaf;  // for leaves, the clause to test
+  };
+
+  // every distinct clause, its operands before it
+  std::vector<Node> nodes;
+  std::unordered_map<std::string, int> node_by_key;
+
+  // the node each query starts at
+  std::vector<int> roots;
+
+  // a node's result for the current entity is in 'results' if its
+  // stamp is the current generation
+  mutable std::vector<uint32_t> stamps;
+  mutable std::vector<bool> results;
+  mutable uint32_t generation;
+
+  int add_node(const QueryClause *clause);
+
+  bool eval_node(int i, const Tag::tagging_map& tags) const {
+    if(stamps[i] == generation) {
+      return results[i];
+    }
+
+    const Node& node = nodes[i];
+    bool result;
+    switch(node.type) {
+      case Node_And:
+        result = eval_node(node.l, tags) && eval_node(node.r, tags);
+        break;
+      case Node_Or:
+        result = eval_node(node.l, tags) || eval_node(node.r, tags);
+        break;
+      case Node_Not:
+        result = !eval_node(node.l, tags);
+        break;
+      default:
+        result = node.leaf->matches_set(tags);
+    }
+
+    stamps[i] = generation;
+    results[i] = result;
+    return result;
+  }
+};
+
+#endif /* __BATCH_H__ */
@@ -0,0 +1,80 @@
+#include "all_the_tags/context.h"
+#include "all_the_tags/tag.h"
+
+// a metanode's closure set holds the entities a literal over one of its
+// tags matches: those with a tag in any metanode implying it. it's kept
+// alongside the ancestors it was found from, so it's as current as they
+// are, and goes stale with them when reachability changes
+
+void Context::set_closure_sets(bool keep, size_t min_ancestors) {
+  closure_sets_ = keep;
+  closure_min_ancestors_ = min_ancestors;
+  plan_version_++;
+
+  for(auto node : closure_nodes_) {
+    delete node->closure;
+    node->closure = nullptr;
+  }
+  closure_nodes_.clear();
+}
+
+const Tag::entity_set *Context::closure_set(SCCMetaNode *node) {
+  assert(node);
+  if(!closure_sets_ || recalc_metagraph) return nullptr;
+  if(node->closure && node->closure_version == reach_version_) {
+    return node->closure;
+  }
+
+  const auto& kept = ancestors(node);
+  if(kept.size() < closure_min_ancestors_) {
+    if(node->closure) {
+      delete node->closure;
+      node->closure = nullptr;
+      closure_nodes_.erase(node);
+    }
+    return nullptr;
+  }
+
+  if(node->closure) node->closure->clear();
+  else              node->closure = new Tag::entity_set();
+  for(auto ancestor : kept) {
+    for(auto tag : ancestor->tags) {
+      node->closure->insert(tag->entities.begin(), tag->entities.end());
+    }
+  }
+  node->closure_version = reach_version_;
+  closure_nodes_.insert(node);
+  return node->closure;
+}
+
+void Context::closure_tagging_changed_impl(Tag *entity, Tag *tag) {
+  // kept up to date while dirty too, against the metagraph as of the last
+  // make_clean: plans from then are still run, and visit the sets
+  auto tag_node = tag->meta_node();
+  if(!tag_node) return;
+
+  const bool has_tag = entity->tags.count(tag);
+  for(auto node : closure_nodes_) {
+    // stale sets are found again before they're used
+    if(node->closure_version != reach_version_) continue;
+
+    const auto& kept = ancestors(node);
+    if(!kept.count(tag_node)) continue;
+
+    if(has_tag) {
+      node->closure->insert(entity);
+      continue;
+    }
+
+    // the entity may still match through another of its tags
+    bool matches = false;
+    for(auto other : entity->tags) {
+      auto other_node = other.first->meta_node();
+      if(other_node && kept.count(other_node)) {
+        matches = true;
+        break;
+      }
+    }
+    if(!matches) node->closure->erase(entity);
+  }
+}
@@ -1,6 +1,7 @@
 #include <queue>
 #include <stack>
 #include <functional>
+#include <algorithm>
 
 #include "all_the_tags/context.h"
 #include "all_the_tags/tag.h"
@@ -9,7 +10,24 @@ struct Tag;
 
 static bool debug = false;
 
+// space left between the orders of metanodes (see `SCCMetaNode::order`),
+// so a metanode split in two can keep its place
+static const int64_t ORDER_GAP = 1 << 16;
+
 Context::~Context() {
+  if(rebuild_) {
+    rebuild_->thread.join();
+    for(auto node : rebuild_->components) {
+      delete node;
+    }
+    delete rebuild_;
+  }
+  delete snapshots_;
+  if(owns_rebuild_pool_) delete rebuild_pool_;
+  delete stats_;
+  for(auto&& iter : standing_queries_) {
+    delete iter.second;
+  }
   for(auto node : meta_nodes) {
     delete node;
   }
@@ -18,25 +36,16 @@ Context::~Context() {
   }
 }
 
-bool path_between(SCCMetaNode *from, SCCMetaNode *to) {
-  // do a DFS between 'from' and 'to'
-
-  std::function<bool(SCCMetaNode*)> check = [&](SCCMetaNode *node) {
-    if(node == to) return true;
-    for(auto child : node->children) {
-      if(check(child)) return true;
-    }
-    return false;
-  };
-
-  return check(from);
-}
-
 void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
+  implications_version_++;
+
   // if the metagraph is already stale, then don't do
   // an incremental update of the metagraph
   if(this->recalc_metagraph) return;
 
+  metagraph_version_++;
+  plan_version_++;
+
   SCCMetaNode
     *tag_mn    = tag->meta_node(),
     *target_mn = target->meta_node();
@@ -45,12 +54,17 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
     // tag now implies target
 
     if(!tag_mn || !target_mn) {
+      reach_changed();
       if(!tag_mn) {
         tag_mn = new SCCMetaNode();
         tag->set_meta_node(tag_mn);
         tag_mn->tags.insert(tag);
         meta_nodes.insert(tag_mn);
 
+        // before everything, so before target
+        order_low_ -= ORDER_GAP;
+        tag_mn->order = order_low_;
+
         if(debug) {
           std::cerr << "source tag " << tag->id << " gets new metanode" << std::endl;
         }
@@ -61,6 +75,9 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
         target_mn->tags.insert(target);
         meta_nodes.insert(target_mn);
 
+        order_high_ += ORDER_GAP;
+        target_mn->order = order_high_;
+
         if(debug) {
           std::cerr << "target tag " << target->id << " gets new metanode" << std::endl;
         }
@@ -81,30 +98,31 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
       assert(tag->meta_node());
       assert(target->meta_node());
     }
+    else if(tag_mn == target_mn) {
+      // an implication within a cycle doesn't change the metagraph
+      return;
+    }
+    else if(reach_index_valid_ ? reaches_indexed(tag_mn, target_mn) :
+            reduce_metagraph_ && reaches_searched(tag_mn, target_mn)) {
+      // tag_mn already implies target_mn, so nothing reaches anything new.
+      // a reduced metagraph doesn't need the edge
+      if(!reduce_metagraph_) tag_mn->add_child(target_mn);
+    }
     else {
       // both tag and target already have a metanode
       // check if target has a path to tag
       // if it does, collapse the two into a single metanode
       assert(target_mn && tag_mn);
+      const bool in_order = tag_mn->order < target_mn->order;
 
       // all of the SCCs that would be in the cycle to tag_mn
-      // (and thus need to be collapsed into a single metanode)
+      // (and thus need to be collapsed into a single metanode), found
+      // while moving target_mn after tag_mn in the topological order
       std::unordered_set<SCCMetaNode*> in_scc;
-      std::function<void(SCCMetaNode*)> recurse = [&](SCCMetaNode* node) {
-        assert(node);
-
-        // TODO: make this more performant (shouldn't need a path_between call
-        // for every check )
-        if(path_between(node, tag_mn)) {
-          in_scc.insert(node);
-          for(auto child : node->children) {
-            recurse(child);
-          }
-        }
-      };
-      recurse(target_mn);
+      const int64_t scc_order = order_for_edge(tag_mn, target_mn, in_scc);
 
       if(in_scc.size()) {
+        reach_changed();
         auto tmp_in_scc = in_scc;
 
         // incoming/outgoing edges that aren't in the SCC set being collapsed
@@ -146,6 +164,7 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
 
         auto new_scc_node = new SCCMetaNode();
         assert(new_scc_node);
+        new_scc_node->order = scc_order;
 
         // transfer all tags into 'new_scc_node'
         for(auto scc : in_scc) {
@@ -170,6 +189,7 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
           scc->remove_from_graph();
           sink_meta_nodes.erase(scc);
           meta_nodes.erase(scc);
+          closure_nodes_.erase(scc);
           delete scc;
         }
 
@@ -187,6 +207,7 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
         if(new_scc_node->children.size() == 0) {
           sink_meta_nodes.insert(new_scc_node);
         }
+        if(reduce_metagraph_) reduce_after_collapse(new_scc_node);
       }
       else {
         // no path between the two, won't create a cycle
@@ -196,6 +217,11 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
         }
         tag_mn->add_child(target_mn);
         sink_meta_nodes.erase(tag_mn);
+
+        // unless the order changed, the labels can be kept up to date
+        if(in_order) reach_edge_added(tag_mn, target_mn);
+        else         reach_changed();
+        if(reduce_metagraph_) reduce_after_edge(tag_mn, target_mn);
       }
     }
   }
@@ -205,195 +231,656 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
     // a <-> b, a -> c, b -> c
     // so {a, b} -> {c}
     // how to fix up the graph if `b -> c` is unimplied?
-    // old algo would have severed the link between the
-    // metanodes
-    this->recalc_metagraph = true;
+    // the metanode edge has to stay, as `a -> c` still supports it. only
+    // the metanodes of the removed edge are looked at
+    remove_imply_edge(tag, target);
   }
 }
 
-void Context::make_clean() {
-  if(!this->recalc_metagraph) return;
+// Pearce and Kelly's dynamic topological sort. before adding the edge
+// 'from' -> 'to', the only metanodes that can be out of order are those
+// between 'to' and 'from' in the current order: the ones 'to' reaches, and
+// the ones that reach 'from'. they're given each other's orders so that
+// the first come before the second. if the two overlap the edge closes a
+// cycle, and the overlap is added to 'cycle' to be collapsed. returns the
+// order for the collapsed metanode. the reachability labels don't help
+// here: knowing that 'to' reaches 'from' isn't enough to reorder or
+// collapse, which need both sets in full, and the searches for them only
+// visit the metanodes between the two in the order already
+int64_t Context::order_for_edge(SCCMetaNode *from, SCCMetaNode *to, std::unordered_set<SCCMetaNode*>& cycle) {
+  if(from->order < to->order) {
+    // already in order
+    return 0;
+  }
 
-  this->recalc_metagraph = false;
+  const int64_t lower = to->order, upper = from->order;
+  std::unordered_set<SCCMetaNode*> reached, reaching;
+  std::vector<SCCMetaNode*> work;
 
-  // clear metanode for all tags
-  for(auto id_tag : id_to_tag) {
-    id_tag.second->clear_meta_node();
+  reached.insert(to);
+  work.push_back(to);
+  while(work.size()) {
+    auto node = work.back();
+    work.pop_back();
+    for(auto child : node->children) {
+      if(child->order <= upper && reached.insert(child).second) {
+        work.push_back(child);
+      }
+    }
   }
 
-  auto get_new_scc = [&]() {
-    if(meta_nodes.empty()) {
-      return new SCCMetaNode();
+  reaching.insert(from);
+  work.push_back(from);
+  while(work.size()) {
+    auto node = work.back();
+    work.pop_back();
+    for(auto parent : node->parents) {
+      if(parent->order >= lower && reaching.insert(parent).second) {
+        work.push_back(parent);
+      }
+    }
+  }
+
+  if(debug) {
+    std::cerr << "reordering " << reached.size() << " + " << reaching.size() << " metanodes" << std::endl;
+  }
+
+  // the metanodes in both are on a path from 'to' to 'from'
+  std::vector<int64_t> orders;
+  std::vector<SCCMetaNode*> before, after;
+  for(auto node : reaching) {
+    orders.push_back(node->order);
+    if(reached.count(node)) {
+      cycle.insert(node);
     }
     else {
-      auto ret = *(meta_nodes.begin());
-      const auto _erased = meta_nodes.erase(ret);
-      assert(_erased == 1);
-      ret->children.clear();
-      ret->parents.clear();
-      ret->tags.clear();
-      return ret;
+      before.push_back(node);
     }
-  };
-
-  // holds the new DAG of metanodes
+  }
+  for(auto node : reached) {
+    if(!reaching.count(node)) {
+      orders.push_back(node->order);
+      after.push_back(node);
+    }
+  }
 
-  // run Tarjan's SCC algorithm
-  struct TarjanWrapper {
-    Tag *tag;
-    int index;
-    int low_link;
-    bool on_stack;
+  auto by_order = [](const SCCMetaNode *a, const SCCMetaNode *b) { return a->order < b->order; };
+  std::sort(orders.begin(), orders.end());
+  std::sort(before.begin(), before.end(), by_order);
+  std::sort(after.begin(), after.end(), by_order);
 
-    TarjanWrapper(Tag *t) :
-      tag(t), index(-1), low_link(-1), on_stack(false) {}
-  };
+  // the ones before only move down, and the ones after only move up, so
+  // they stay in order with the metanodes outside of the two sets
+  size_t i = 0;
+  for(auto node : before) {
+    node->order = orders[i++];
+  }
+  const int64_t cycle_order = orders[i];
+  i = orders.size() - after.size();
+  for(auto node : after) {
+    node->order = orders[i++];
+  }
+  return cycle_order;
+}
 
-  int index = 0;
-  std::vector<TarjanWrapper> tarjan_nodes; // bookkeping area for the tarjan nodes
-  std::unordered_map<Tag*, TarjanWrapper*> tag_to_tarjan; // maps tag -> its tarjan node in the vector
-  std::stack<TarjanWrapper*> tarjan_stack; // stack required by the algo
-  std::stack<SCCMetaNode*> metanode_stack; // stack of metanodes generated by Tarjan's algo (in topological descending order)
+// give every metanode a new order, spread out by ORDER_GAP
+void Context::renumber_meta_nodes() {
+  std::unordered_map<SCCMetaNode*, size_t> num_parents;
+  std::vector<SCCMetaNode*> ready;
+  for(auto node : meta_nodes) {
+    num_parents[node] = node->parents.size();
+    if(node->parents.empty()) ready.push_back(node);
+  }
 
-  tarjan_nodes.reserve(id_to_tag.size());
-  for(auto tag_id : id_to_tag) {
-    // if the tag isn't part of the implication graph, don't
-    // run SCC algo on it
-    auto tag = tag_id.second;
-    if(tag->implies.empty() && tag->implied_by.empty()) { continue; }
+  int64_t order = 0;
+  while(ready.size()) {
+    auto node = ready.back();
+    ready.pop_back();
+    node->order = order;
+    order += ORDER_GAP;
 
-    if(debug) {
-      std::cerr << "tarjan: " << tag->id << " will be in the metagraph" << std::endl;
+    for(auto child : node->children) {
+      if(--num_parents[child] == 0) ready.push_back(child);
     }
-
-    tarjan_nodes.push_back(TarjanWrapper(tag));
-    auto iter = tarjan_nodes.end(); // iterator to the last element in the vector
-    iter--;
-    tag_to_tarjan.insert(std::make_pair(tag, &(*iter)));
   }
 
-  std::function<void(TarjanWrapper*)> strongconnect = [&](TarjanWrapper *v) {
-    v->index    = index;
-    v->low_link = index;
-    index++;
+  order_low_ = 0;
+  order_high_ = order;
+}
 
-    tarjan_stack.push(v);
-    v->on_stack = true;
+void Context::remove_imply_edge(Tag *tag, Tag *target) {
+  SCCMetaNode
+    *tag_mn    = tag->meta_node(),
+    *target_mn = target->meta_node();
+  assert(tag_mn && target_mn);
 
-    if(debug) {
-      std::cerr <<
-        "tag " << v->tag->id <<
-        " implies " << v->tag->implies.size() <<
-        " others" << std::endl;
+  if(tag_mn == target_mn) {
+    // the edge was part of a cycle, which may be broken now
+    split_meta_node(tag_mn);
+  }
+  else {
+    // keep the metanode edge if another tag in 'tag_mn' still implies one
+    // in 'target_mn'
+    bool supported = false;
+    for(auto t : tag_mn->tags) {
+      for(auto implied : t->implies) {
+        if(implied->meta_node() == target_mn) {
+          supported = true;
+          break;
+        }
+      }
+      if(supported) break;
     }
-    for(auto implied : v->tag->implies) {
-      auto mapped = tag_to_tarjan.find(implied);
-      assert(mapped != tag_to_tarjan.end());
-      TarjanWrapper* w = (*mapped).second;
 
+    if(!supported && !tag_mn->children.count(target_mn)) {
+      // reduced away, so something else gets tag_mn to target_mn
+      assert(reduce_metagraph_);
+    }
+    else if(!supported) {
       if(debug) {
-        std::cerr << "(-> " << w->tag->id << ")" << std::endl;
+        std::cerr << "removing SCC edge ";
+        tag_mn->print_tag_set(std::cerr) << " -> ";
+        target_mn->print_tag_set(std::cerr) << std::endl;
+      }
+      const auto _removed = tag_mn->remove_child(target_mn);
+      assert(_removed);
+      if(tag_mn->children.empty()) {
+        sink_meta_nodes.insert(tag_mn);
       }
 
-      if(w->index == -1) {
-        // successor w not visited, recurse on it
-        strongconnect(w);
-        v->low_link = std::min(v->low_link, w->low_link);
+      // the labels still hold without an edge off the spanning forest, and
+      // if tag_mn still reaches target_mn, so does everything else
+      if(reach_index_valid_ && target_mn->tree_parent == tag_mn) {
+        reach_index_valid_ = false;
       }
-      else if(w->on_stack) {
-        // successor w is in stack S and hence in the current SCC
-        v->low_link = std::min(v->low_link, w->index);
+      if(reduce_metagraph_) restore_reduced_edges({tag_mn});
+      if(!reach_index_valid_) {
+        reach_changed();
+      }
+      else if(!reaches_indexed(tag_mn, target_mn)) {
+        reach_version_++;
       }
     }
+  }
 
-    // if v is a root node, pop the stack and generate an SCC
-    if(v->low_link == v->index) {
-      // start a new SCC
-      auto component = get_new_scc();
-      assert(component);
+  // tags without any implications left aren't in the metagraph, same as
+  // after make_clean
+  drop_isolated_meta_node(tag);
+  drop_isolated_meta_node(target);
+}
+
+void Context::split_meta_node(SCCMetaNode *node) {
+  // run Tarjan's SCC algorithm over just the tags in 'node', following only
+  // the implications between them. never happens while a rebuild is
+  // using the finder, as the context is dirty until it's published
+  assert(!rebuild_);
+  auto& scc = scc_finder_;
+  scc.clear();
+  for(auto t : node->tags) {
+    t->scc_index = scc.tags.size();
+    scc.tags.push_back(t);
+  }
+  for(auto t : scc.tags) {
+    scc.edge_begin.push_back(scc.edges.size());
+    for(auto implied : t->implies) {
+      if(implied->meta_node() == node) scc.edges.push_back(implied->scc_index);
+    }
+  }
+  scc.run();
 
-      while(true) {
-        auto w = tarjan_stack.top();
-        tarjan_stack.pop();
+  if(scc.num_components() == 1) {
+    // still strongly connected
+    return;
+  }
+  reach_changed();
 
-        component->tags.insert(w->tag);
-        w->tag->set_meta_node(component);
-        w->on_stack = false;
+  if(debug) {
+    std::cerr << "splitting ";
+    node->print_tag_set(std::cerr) << " into " << scc.num_components() << " metanodes" << std::endl;
+  }
 
-        if(w == v) break;
-      }
-      metanode_stack.push(component);
+  // 'node' keeps the first component, and the rest get new metanodes. all
+  // of their edges are worked out again from the tags
+  const int64_t node_order = node->order;
+  node->remove_from_graph();
+  sink_meta_nodes.erase(node);
+  node->tags.clear();
+
+  std::vector<SCCMetaNode*> split;
+  for(size_t c = 0; c < scc.num_components(); c++) {
+    auto mn = split.empty() ? node : new SCCMetaNode();
+    for(auto i = scc.component_begin[c]; i < scc.component_begin[c + 1]; i++) {
+      auto t = scc.tags[scc.component_tags[i]];
+      t->set_meta_node(mn);
+      mn->tags.insert(t);
     }
-  };
+    meta_nodes.insert(mn);
+    split.push_back(mn);
+  }
+  const std::unordered_set<SCCMetaNode*> in_split(split.begin(), split.end());
 
-  {
-    auto b = tarjan_nodes.begin();
-    auto e = tarjan_nodes.end();
-    while(b != e) {
-      auto tarjan_node = &(*b);
-      if(tarjan_node->index == -1) {
-        strongconnect(tarjan_node);
+  for(auto mn : split) {
+    for(auto t : mn->tags) {
+      for(auto implied : t->implies) {
+        auto imn = implied->meta_node();
+        if(imn != mn) mn->add_child(imn);
+      }
+      // edges from within the split were added from their source's side
+      for(auto implier : t->implied_by) {
+        auto pmn = implier->meta_node();
+        if(pmn != mn && !in_split.count(pmn)) {
+          pmn->add_child(mn);
+        }
       }
-      b++;
     }
   }
 
-  // destroy the remaining metanodes in the old set
-  for(auto node : meta_nodes) {
-    delete node;
+  for(auto mn : split) {
+    if(mn->children.empty()) {
+      sink_meta_nodes.insert(mn);
+    }
   }
-  meta_nodes.clear();
 
-  if(debug) {
-    std::cerr << "tarjan: " << metanode_stack.size() << " metanodes total" << std::endl;
+  // the components go between the metanodes around them in the order.
+  // Tarjan's algorithm found them children first
+  int64_t lower = node_order, upper = node_order;
+  bool have_lower = false, have_upper = false;
+  for(auto mn : split) {
+    for(auto parent : mn->parents) {
+      if(in_split.count(parent)) continue;
+      lower = have_lower ? std::max(lower, parent->order) : parent->order;
+      have_lower = true;
+    }
+    for(auto child : mn->children) {
+      if(in_split.count(child)) continue;
+      upper = have_upper ? std::min(upper, child->order) : child->order;
+      have_upper = true;
+    }
   }
 
-  // set up links between metanodes in the graph
-  while(metanode_stack.size()) {
-    auto top = metanode_stack.top();
-    metanode_stack.pop();
-    meta_nodes.insert(top);
+  const int64_t slots = split.size() + 1;
+  if(!have_lower) lower = upper - slots * ORDER_GAP;
+  if(!have_upper) upper = lower + slots * ORDER_GAP;
 
-    if(debug) {
-      std::cerr << "tarjan: linking ";
-      top->print_tag_set(std::cerr) << std::endl;
+  if(upper - lower < slots) {
+    // no room left between them
+    renumber_meta_nodes();
+  }
+  else {
+    const int64_t step = (upper - lower) / slots;
+    for(size_t i = 0; i < split.size(); i++) {
+      split[split.size() - 1 - i]->order = lower + step * (i + 1);
     }
+  }
 
-    // top is a source SCC - set up links to successor metanodes
-    for(auto tag : top->tags) {
-      for(auto implied : tag->implies) {
+  // the edges were all added back from the tags, and what went through
+  // 'node' may not any more
+  if(reduce_metagraph_) restore_reduced_edges(split);
+}
 
-        if(debug) {
-          std::cerr << "tarjan: checking edge " << tag->id << " -> " << implied->id << std::endl;
-        }
+void Context::drop_isolated_meta_node(Tag *tag) {
+  auto node = tag->meta_node();
+  if(!node || !tag->implies.empty() || !tag->implied_by.empty()) {
+    return;
+  }
 
-        auto imn = implied->meta_node();
-        assert(imn);
-        if(imn != top) {
-          auto ret = top->add_child(imn);
-          if(debug && ret) {
-            std::cerr << "adding SCC edge ";
-            top->print_tag_set(std::cerr) << " -> ";
-            imn->print_tag_set(std::cerr) << std::endl;
-          }
+  // without any implications, the tag is alone in its metanode
+  assert(node->tags.size() == 1);
+  reach_changed();
+  assert(node->children.empty() && node->parents.empty());
+
+  sink_meta_nodes.erase(node);
+  meta_nodes.erase(node);
+  closure_nodes_.erase(node);
+  tag->clear_meta_node();
+  delete node;
+}
+
+void Context::make_clean() {
+  // a rebuild under way may be all that's needed
+  if(rebuild_ && finish_rebuild()) return;
+  if(!this->recalc_metagraph) return;
+
+  // nothing's querying the old metanodes while this runs, so they're
+  // used again for the new ones
+  MetagraphBuild build;
+  auto closure_tags = take_closure_tags();
+  snapshot_implications(build);
+  build_metagraph(build, true);
+  publish_metagraph(build);
+  for(auto tag : closure_tags) {
+    if(tag->meta_node()) closure_set(tag->meta_node());
+  }
+}
+
+bool Context::start_rebuild() {
+  if(!this->recalc_metagraph || rebuild_) return false;
+
+  rebuild_ = new MetagraphBuild();
+  snapshot_implications(*rebuild_);
+  rebuild_->thread = std::thread([this]() {
+    build_metagraph(*rebuild_, false);
+    rebuild_->done.store(true, std::memory_order_release);
+  });
+  return true;
+}
+
+bool Context::finish_rebuild() {
+  if(!rebuild_) return !this->recalc_metagraph;
+
+  rebuild_->thread.join();
+  auto closure_tags = take_closure_tags();
+  publish_metagraph(*rebuild_);
+  for(auto tag : closure_tags) {
+    if(tag->meta_node()) closure_set(tag->meta_node());
+  }
+
+  // implications that changed since the copy was taken aren't in it
+  if(rebuild_->implications_version != implications_version_) {
+    this->recalc_metagraph = true;
+  }
+  delete rebuild_;
+  rebuild_ = nullptr;
+  return !this->recalc_metagraph;
+}
+
+// the metanodes that kept their closure's entities, by one of their tags,
+// to find them again for once the metagraph is rebuilt
+std::vector<Tag*> Context::take_closure_tags() {
+  std::vector<Tag*> closure_tags;
+  for(auto node : closure_nodes_) {
+    if(node->tags.size()) closure_tags.push_back(*node->tags.begin());
+  }
+  closure_nodes_.clear();
+  return closure_tags;
+}
+
+// copy the implication graph into dense arrays, leaving out the tags
+// that aren't part of it
+void Context::snapshot_implications(MetagraphBuild& build) {
+  build.implications_version = implications_version_;
+
+  auto& scc = scc_finder_;
+  scc.clear();
+  for(auto&& tag_id : id_to_tag) {
+    auto tag = tag_id.second;
+    if(tag->implies.empty() && tag->implied_by.empty()) { continue; }
+    tag->scc_index = scc.tags.size();
+    scc.tags.push_back(tag);
+  }
+  for(auto tag : scc.tags) {
+    scc.edge_begin.push_back(scc.edges.size());
+    for(auto implied : tag->implies) {
+      scc.edges.push_back(implied->scc_index);
+    }
+  }
+}
+
+// find the metanodes of the copied graph, and the edges between them.
+// only the copy is read, so unless it takes the current metanodes to use
+// again ('reuse_nodes'), this can run while the context is in use
+void Context::build_metagraph(MetagraphBuild& build, bool reuse_nodes) {
+  auto get_new_scc = [&]() {
+    if(!reuse_nodes || meta_nodes.empty()) {
+      return new SCCMetaNode();
+    }
+    else {
+      auto ret = *(meta_nodes.begin());
+      const auto _erased = meta_nodes.erase(ret);
+      assert(_erased == 1);
+      ret->children.clear();
+      ret->parents.clear();
+      ret->tags.clear();
+      delete ret->closure;
+      ret->closure = nullptr;
+      return ret;
+    }
+  };
+
+  // big graphs are rebuilt on the pool, if there is one with threads in
+  // it. the serial rebuild goes through the same steps, as a single part
+  auto& scc = scc_finder_;
+  ThreadPool *pool = nullptr;
+  if(rebuild_pool_ && rebuild_pool_->size() && scc.tags.size() >= rebuild_min_tags_) {
+    pool = rebuild_pool_;
+  }
+  const size_t parts = pool ? pool->size() * 4 : 1;
+
+  if(pool) {
+    scc.run_parallel(*pool);
+  }
+  else {
+    // run Tarjan's SCC algorithm
+    scc.run();
+  }
+  build.ordered = !pool;
+
+  if(debug) {
+    std::cerr << "scc: " << scc.num_components() << " metanodes total" << std::endl;
+  }
+
+  // make a metanode for each component. Tarjan's algorithm finds them
+  // children first, so going through them backwards gives their
+  // topological order
+  const size_t num_components = scc.num_components();
+  auto& components = build.components;
+  components.resize(num_components);
+  int64_t order = 0;
+  for(size_t c = num_components; c-- > 0;) {
+    auto component = get_new_scc();
+    component->order = order;
+    order += ORDER_GAP;
+    components[c] = component;
+  }
+  build.order_high = order;
+
+  // set up the metanodes' tags, and their children: the components their
+  // tags imply, besides their own. each part sends the parent links to
+  // the part that owns the child, by the child's index modulo 'parts'
+  std::vector<std::vector<std::vector<std::pair<uint32_t, uint32_t>>>> parent_links(parts);
+  parallel_for(pool, num_components, parts, [&](size_t part, size_t begin, size_t end) {
+    auto& links = parent_links[part];
+    links.resize(parts);
+    std::vector<uint32_t> children;
+
+    for(auto c = begin; c < end; c++) {
+      auto component = components[c];
+      children.clear();
+
+      for(auto i = scc.component_begin[c]; i < scc.component_begin[c + 1]; i++) {
+        const auto tag = scc.component_tags[i];
+        component->tags.insert(scc.tags[tag]);
+
+        for(auto e = scc.edge_begin[tag]; e < scc.edge_begin[tag + 1]; e++) {
+          const auto implied = scc.component_of[scc.edges[e]];
+          if(implied != c) children.push_back(implied);
         }
       }
+
+      std::sort(children.begin(), children.end());
+      children.erase(std::unique(children.begin(), children.end()), children.end());
+      component->children.reserve(children.size());
+      for(auto child : children) {
+        component->children.insert(components[child]);
+        links[child % parts].push_back(std::make_pair(child, (uint32_t) c));
+      }
+    }
+  });
+  parallel_for(pool, parts, parts, [&](size_t part, size_t, size_t) {
+    for(auto&& links : parent_links) {
+      for(auto&& link : links[part]) {
+        components[link.first]->parents.insert(components[link.second]);
+      }
+    }
+  });
+
+  if(debug) {
+    for(auto node : components) {
+      for(auto child : node->children) {
+        std::cerr << "adding SCC edge ";
+        node->print_tag_set(std::cerr) << " -> ";
+        child->print_tag_set(std::cerr) << std::endl;
+      }
     }
   }
 
   // identify all the sink metanodes
-  sink_meta_nodes.clear();
+  std::vector<std::vector<SCCMetaNode*>> sinks(parts);
+  parallel_for(pool, num_components, parts, [&](size_t part, size_t begin, size_t end) {
+    for(auto c = begin; c < end; c++) {
+      if(components[c]->children.empty()) sinks[part].push_back(components[c]);
+    }
+  });
+  for(auto&& part_sinks : sinks) {
+    build.sinks.insert(build.sinks.end(), part_sinks.begin(), part_sinks.end());
+  }
+}
+
+// swap the built metanodes in for the context's
+void Context::publish_metagraph(MetagraphBuild& build) {
+  this->recalc_metagraph = false;
+  metagraph_version_++;
+  plan_version_++;
+  reach_changed();
+
+  // point the tags at their new metanodes
+  for(auto id_tag : id_to_tag) {
+    id_tag.second->clear_meta_node();
+  }
+  for(auto component : build.components) {
+    for(auto tag : component->tags) {
+      tag->set_meta_node(component);
+    }
+  }
+
+  // destroy the remaining metanodes in the old set
   for(auto node : meta_nodes) {
-    if(node->children.empty()) {
-      const auto _inserted = sink_meta_nodes.insert(node).second;
-      assert(_inserted);
+    delete node;
+  }
+  meta_nodes.clear();
+  meta_nodes.insert(build.components.begin(), build.components.end());
+  sink_meta_nodes.clear();
+  sink_meta_nodes.insert(build.sinks.begin(), build.sinks.end());
+
+  order_low_ = 0;
+  order_high_ = build.order_high;
+  if(!build.ordered) {
+    renumber_meta_nodes();
+  }
+
+  if(reduce_metagraph_) {
+    build_reach_index();
+    bool tree_changed = false;
+    for(auto node : build.components) {
+      tree_changed |= reduce_children(node);
+    }
+    if(tree_changed) reach_index_valid_ = false;
+  }
+
+  // bring the standing queries up to date with the new metagraph, and
+  // with the entities that changed while the context was dirty
+  for(auto&& iter : standing_queries_) {
+    refresh_standing_query(iter.second);
+  }
+  standing_pending_.clear();
+}
+
+size_t Context::change_implications(const std::vector<imply_edge>& edges, bool gained) {
+  std::vector<imply_edge> batch;
+  batch.reserve(edges.size());
+  for(auto&& edge : edges) {
+    assert(edge.first && edge.second);
+    if(edge.first != edge.second) batch.push_back(edge);
+  }
+  std::sort(batch.begin(), batch.end());
+  batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+  // leave out the edges that wouldn't change
+  auto last = std::remove_if(batch.begin(), batch.end(), [gained](const imply_edge& edge) {
+    return (edge.first->implies.count(edge.second) == 1) == gained;
+  });
+  batch.erase(last, batch.end());
+
+  const bool was_dirty = is_dirty();
+  if(!was_dirty && batch.size() * BULK_REBUILD_FRACTION < meta_nodes.size()) {
+    // few enough to update the metagraph for
+    for(auto&& edge : batch) {
+      const auto _changed = gained ?
+        edge.first->imply(edge.second) :
+        edge.first->unimply(edge.second);
+      assert(_changed);
     }
+    return batch.size();
+  }
+
+  if(debug) {
+    std::cerr << "rebuilding metagraph for " << batch.size() << " implications" << std::endl;
+  }
+
+  // make_clean brings the standing queries up to date
+  mark_dirty();
+  implications_version_++;
+  for(auto&& edge : batch) {
+    if(gained) {
+      edge.first->implies.insert(edge.second);
+      edge.second->implied_by.insert(edge.first);
+    }
+    else {
+      edge.first->implies.erase(edge.second);
+      edge.second->implied_by.erase(edge.first);
+    }
+  }
+  if(!was_dirty) make_clean();
+  return batch.size();
+}
+
+void Context::enable_snapshots() {
+  if(snapshots_) return;
+  snapshots_ = new SnapshotStore();
+  for(auto&& id_tag : id_to_tag) {
+    snapshots_->add(id_tag.second);
   }
 }
 
+void Context::set_rebuild_threads(unsigned num_threads, size_t min_tags) {
+  // a rebuild under way may be using the pool
+  if(rebuild_) finish_rebuild();
+  if(owns_rebuild_pool_) delete rebuild_pool_;
+  rebuild_pool_ = num_threads > 1 ? new ThreadPool(num_threads) : nullptr;
+  rebuild_min_tags_ = min_tags;
+  owns_rebuild_pool_ = true;
+}
+
+void Context::set_rebuild_pool(ThreadPool *pool, size_t min_tags) {
+  if(rebuild_) finish_rebuild();
+  if(owns_rebuild_pool_) delete rebuild_pool_;
+  rebuild_pool_ = pool;
+  rebuild_min_tags_ = min_tags;
+  owns_rebuild_pool_ = false;
+}
+
+void Context::set_query_pool(ThreadPool *pool, size_t min_entities) {
+  query_pool_ = pool;
+  query_min_entities_ = min_entities;
+}
+
 Tag *Context::new_tag_common(id_type id) {
   auto t = new Tag(this, id);
   this->id_to_tag.insert(std::make_pair(id, t));
+  sketch_entity_added(t);
+  if(snapshots_) snapshots_->add(t);
+
+  // a new entity matches the standing queries that match no tags at all
+  if(!standing_queries_.empty()) {
+    if(is_dirty()) {
+      standing_pending_.insert(t);
+    }
+    else {
+      for(auto&& iter : standing_queries_) {
+        if(iter.second->matches_empty) iter.second->update(t);
+      }
+    }
+  }
   return t;
 }
 
@@ -416,10 +903,17 @@ Tag *Context::new_tag() {
 
 void Context::destroy_tag(Tag *tag) {
   assert(tag->context == this && "tag must be on this context");
+  plan_version_++;
+
+  // a rebuild under way may have the tag in one of its metanodes
+  auto& scc = scc_finder_;
+  if(rebuild_ && tag->scc_index < scc.tags.size() && scc.tags[tag->scc_index] == tag) {
+    finish_rebuild();
+  }
 
-  // remove from all tags
-  for(auto&& e : id_to_tag) {
-    Tag* obj = e.second;
+  // remove from all entities tagged with it
+  while(tag->entities.size()) {
+    Tag* obj = *(tag->entities.begin());
     obj->remove_tag(tag);
   }
 
@@ -445,13 +939,66 @@ void Context::destroy_tag(Tag *tag) {
     assert(_erased == 1);
   }
 
+  // the tag no longer matches any standing query, and queries testing
+  // for it stop testing for it
+  standing_pending_.erase(tag);
+  for(auto&& iter : standing_queries_) {
+    auto sq = iter.second;
+    if(sq->forget(tag) && !is_dirty()) {
+      refresh_standing_query(sq);
+    }
+  }
+
   {
     const auto _erased = id_to_tag.erase(tag->id);
     assert(_erased == 1 && "didn't erase from internal list?");
-    delete tag;
+    sketch_entity_removed(tag);
+    if(snapshots_) {
+      // open snapshots may still hold it
+      snapshots_->remove(tag);
+      snapshots_->retire_entity(tag);
+    }
+    else {
+      delete tag;
+    }
   }
 }
 
+const std::unordered_set<const SCCMetaNode*>& Context::ancestors(SCCMetaNode *node) {
+  assert(node);
+  if(node->ancestors_version == reach_version_) {
+    return node->ancestors;
+  }
+
+  // walk up the parents, visiting each metanode once. a parent with an
+  // up to date closure of its own contributes that instead of being walked
+  auto& closure = node->ancestors;
+  closure.clear();
+  closure.insert(node);
+
+  std::vector<const SCCMetaNode*> stack;
+  stack.push_back(node);
+  while(stack.size()) {
+    auto top = stack.back();
+    stack.pop_back();
+
+    for(auto parent : top->parents) {
+      if(closure.count(parent)) continue;
+
+      if(parent->ancestors_version == reach_version_) {
+        closure.insert(parent->ancestors.begin(), parent->ancestors.end());
+      }
+      else {
+        closure.insert(parent);
+        stack.push_back(parent);
+      }
+    }
+  }
+
+  node->ancestors_version = reach_version_;
+  return closure;
+}
+
 Tag* Context::tag_by_id(id_type tid) const {
   auto iter = id_to_tag.find(tid);
   if(iter != id_to_tag.end()) {
@@ -461,3 +1008,90 @@ Tag* Context::tag_by_id(id_type tid) const {
     return nullptr;
   }
 }
+
+int Context::add_standing_query(QueryClause *clause, StandingQuery::callback_type callback) {
+  auto sq = new StandingQuery(last_standing_id_++, StandingQuery::to_source(clause), callback);
+  delete clause;
+  standing_queries_.insert(std::make_pair(sq->id, sq));
+
+  if(!is_dirty()) {
+    rescan_standing_query(sq);
+  }
+  return sq->id;
+}
+
+bool Context::remove_standing_query(int id) {
+  auto iter = standing_queries_.find(id);
+  if(iter == standing_queries_.end()) {
+    return false;
+  }
+
+  delete iter->second;
+  standing_queries_.erase(iter);
+  return true;
+}
+
+const StandingQuery *Context::standing_query(int id) const {
+  auto iter = standing_queries_.find(id);
+  return iter == standing_queries_.end() ? nullptr : iter->second;
+}
+
+void Context::rescan_standing_query(StandingQuery *sq) {
+  // finding the initial matches isn't a change, so there are no callbacks
+  std::unordered_set<Tag*> unused;
+  sq->derive(unused);
+
+  sq->matches.clear();
+  for(auto&& iter : id_to_tag) {
+    if(sq->clause->matches_set(iter.second->tags)) {
+      sq->matches.insert(iter.second);
+    }
+  }
+}
+
+void Context::refresh_standing_query(StandingQuery *sq) {
+  if(sq->needs_derive) {
+    rescan_standing_query(sq);
+    return;
+  }
+
+  std::unordered_set<Tag*> candidates(standing_pending_);
+  if(sq->derive(candidates)) {
+    for(auto e : candidates) {
+      sq->update(e);
+    }
+  }
+  else {
+    for(auto&& iter : id_to_tag) {
+      sq->update(iter.second);
+    }
+  }
+}
+
+void Context::standing_tagging_changed_impl(Tag *entity, Tag *tag) {
+  if(is_dirty()) {
+    standing_pending_.insert(entity);
+    return;
+  }
+
+  // the entity's match can only change for queries testing for 'tag'
+  for(auto&& iter : standing_queries_) {
+    if(iter.second->covered.count(tag)) {
+      iter.second->update(entity);
+    }
+  }
+}
+
+void Context::standing_implication_changed_impl(Tag *target) {
+  // make_clean refreshes everything once the metagraph is rebuilt
+  if(is_dirty()) return;
+
+  // an implication of 'target' only changes the tags a query tests for
+  // if it already tested for 'target' (directly, or through something
+  // 'target' implies)
+  for(auto&& iter : standing_queries_) {
+    if(iter.second->covered.count(target)) {
+      refresh_standing_query(iter.second);
+    }
+  }
+}
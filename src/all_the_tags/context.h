@@ -6,14 +6,72 @@
 #include <unordered_map>
 #include <algorithm>
 #include <utility>
+#include <map>
+#include <atomic>
+#include <thread>
 
 #include "all_the_tags/query.h"
+#include "all_the_tags/plan.h"
+#include "all_the_tags/batch.h"
+#include "all_the_tags/standing.h"
+#include "all_the_tags/facet.h"
+#include "all_the_tags/stats.h"
 #include "all_the_tags/scc_meta_node.h"
+#include "all_the_tags/scc.h"
+#include "all_the_tags/thread_pool.h"
+#include "all_the_tags/snapshot.h"
 
 struct Tag;
 
+// a batch of implications changing at least 1/BULK_REBUILD_FRACTION as many
+// edges as there are metanodes rebuilds the metagraph, rather than updating
+// it an edge at a time (see `Context::imply_many`). updates are cheap until
+// edges start to join up cycles, and merging those one at a time gets much
+// slower than a rebuild
+static const size_t BULK_REBUILD_FRACTION = 16;
+
+// metanodes implied by fewer metanodes than this (counting themselves)
+// don't keep their closure's entities (see `Context::set_closure_sets`)
+static const size_t CLOSURE_SET_MIN_ANCESTORS = 8;
+
+// graphs with fewer tags than this are rebuilt on the calling thread (see
+// `Context::set_rebuild_threads`)
+static const size_t PARALLEL_REBUILD_MIN_TAGS = 10000;
+
+// queries over fewer entities than this run on the calling thread (see
+// `Context::set_query_pool`)
+static const size_t PARALLEL_QUERY_MIN_ENTITIES = 50000;
+
+// `Context::query_parallel` hands out the buckets of the entities' hash
+// tables this many at a time: enough that taking one costs little next to
+// testing its entities, few enough that the threads finish close together
+static const size_t QUERY_MORSEL_BUCKETS = 1024;
+
 // error codes for `Context::query`
-static const int ERR_CONTEXT_DIRTY = -1;
+static const int ERR_CONTEXT_DIRTY = -1; // no longer returned: see `Context::is_dirty`
+static const int ERR_PLAN_STALE    = -5; // the plan was built against an older metagraph
+
+// a metagraph built from a copy of the implication graph, waiting to
+// replace the context's (see `Context::start_rebuild`)
+struct MetagraphBuild {
+  // the new metanodes, and those without children
+  std::vector<SCCMetaNode*> components;
+  std::vector<SCCMetaNode*> sinks;
+
+  // the orders given to the components, which are only topological if
+  // they were found in one (see `SCCFinder::run_parallel`)
+  int64_t order_high;
+  bool ordered;
+
+  // the context's implications version when the graph was copied
+  uint64_t implications_version;
+
+  // building it in the background
+  std::thread thread;
+  std::atomic<bool> done;
+
+  MetagraphBuild() : order_high(0), ordered(true), implications_version(0), done(false) {}
+};
 
 struct Context {
 private:
@@ -25,8 +83,106 @@ private:
   // to recalculate the metagraph
   bool recalc_metagraph;
 
+  // statistics from the last call to analyze (or null)
+  ContextStats *stats_;
+
+  // bumped whenever the metagraph changes, invalidating anything
+  // derived from it
+  uint64_t metagraph_version_;
+
+  // bumped whenever something a QueryPlan holds on to changes: the
+  // metagraph, the set of tags or the statistics
+  uint64_t plan_version_;
+
+  // bumped whenever an implication is added or removed, whether or not the
+  // metagraph is updated for it
+  uint64_t implications_version_;
+
+  // the metagraph being built in the background (or null)
+  MetagraphBuild *rebuild_;
+
+  // versions of the entities' tags for snapshots (see `enable_snapshots`),
+  // or null
+  SnapshotStore *snapshots_;
+
+  // standing queries by id, and entities whose tags changed while the
+  // context was dirty, to be re-evaluated by make_clean
+  std::map<int, StandingQuery*> standing_queries_;
+  int last_standing_id_;
+  std::unordered_set<Tag*> standing_pending_;
+
+  // sketch of every entity (see `approx_count`)
+  EntitySketch all_sketch_;
+
+  // lowest and highest order given to a metanode (see
+  // `SCCMetaNode::order`). new metanodes go before or after all others
+  int64_t order_low_;
+  int64_t order_high_;
+
+  // kept between rebuilds of the metagraph
+  SCCFinder scc_finder_;
+
+  // bumped whenever which metanodes reach which may have changed, or
+  // metanodes come and go. the ancestor closures are cached against it
+  uint64_t reach_version_;
+
+  // are the reachability labels on the metanodes up to date? if so,
+  // reach_nodes_ holds the metanodes by their tree_begin
+  bool reach_index_valid_;
+  std::vector<SCCMetaNode*> reach_nodes_;
+
+  // keep the metagraph transitively reduced (see `set_transitive_reduction`)
+  bool reduce_metagraph_;
+
+  // keep the entities of metanodes' closures (see `set_closure_sets`), and
+  // the metanodes that have kept them
+  bool closure_sets_;
+  size_t closure_min_ancestors_;
+  std::unordered_set<SCCMetaNode*> closure_nodes_;
+
+  // threads to rebuild the metagraph on (or null), for graphs of at least
+  // rebuild_min_tags_ tags, and whether the context made them
+  ThreadPool *rebuild_pool_;
+  size_t rebuild_min_tags_;
+  bool owns_rebuild_pool_;
+
+  // threads to run query_parallel on (or null), for at least
+  // query_min_entities_ entities. not owned
+  ThreadPool *query_pool_;
+  size_t query_min_entities_;
+
   // internals
   Tag *new_tag_common(id_type id);
+  int64_t order_for_edge(SCCMetaNode *from, SCCMetaNode *to, std::unordered_set<SCCMetaNode*>& cycle);
+  void renumber_meta_nodes();
+  void snapshot_implications(MetagraphBuild& build);
+  void build_metagraph(MetagraphBuild& build, bool reuse_nodes);
+  void publish_metagraph(MetagraphBuild& build);
+  std::vector<Tag*> take_closure_tags();
+  size_t change_implications(const std::vector<std::pair<Tag*, Tag*>>& edges, bool gained);
+  void remove_imply_edge(Tag *tag, Tag *target);
+  void split_meta_node(SCCMetaNode *node);
+  void drop_isolated_meta_node(Tag *tag);
+  void build_reach_index();
+  bool reaches_indexed(const SCCMetaNode *from, const SCCMetaNode *to) const;
+  void reach_edge_added(SCCMetaNode *from, SCCMetaNode *to);
+  bool reaches_searched(const SCCMetaNode *from, const SCCMetaNode *to) const;
+  bool reaches_now(const SCCMetaNode *from, const SCCMetaNode *to) const;
+  bool drop_redundant_edge(SCCMetaNode *from, SCCMetaNode *to);
+  bool reduce_children(SCCMetaNode *node);
+  void reduce_after_edge(SCCMetaNode *from, SCCMetaNode *to);
+  void reduce_after_collapse(SCCMetaNode *node);
+  void restore_reduced_edges(const std::vector<SCCMetaNode*>& nodes);
+  void reach_changed() {
+    reach_version_++;
+    reach_index_valid_ = false;
+  }
+  const EntitySketch& node_sketch(const SCCMetaNode *node) const;
+  bool sketch_of(const QueryClause *clause, EntitySketch& out) const;
+  void sketch_entity_added(Tag *entity);
+  void sketch_entity_removed(Tag *entity);
+  void refresh_standing_query(StandingQuery *sq);
+  void rescan_standing_query(StandingQuery *sq);
 
 public:
   // meta nodes representing the DAG of tag implications
@@ -35,7 +191,26 @@ public:
 
   Context() :
     last_tag_id(0),
-    recalc_metagraph(false)
+    recalc_metagraph(false),
+    stats_(nullptr),
+    metagraph_version_(1),
+    plan_version_(1),
+    implications_version_(0),
+    rebuild_(nullptr),
+    snapshots_(nullptr),
+    last_standing_id_(0),
+    order_low_(0),
+    order_high_(0),
+    reach_version_(1),
+    reach_index_valid_(false),
+    reduce_metagraph_(false),
+    closure_sets_(false),
+    closure_min_ancestors_(CLOSURE_SET_MIN_ANCESTORS),
+    rebuild_pool_(nullptr),
+    rebuild_min_tags_(PARALLEL_REBUILD_MIN_TAGS),
+    owns_rebuild_pool_(false),
+    query_pool_(nullptr),
+    query_min_entities_(PARALLEL_QUERY_MIN_ENTITIES)
     {}
   ~Context();
 
@@ -49,19 +224,112 @@ public:
   // look up tag by id
   Tag* tag_by_id(id_type tid) const;
 
+  // every metanode that implies 'node' (including 'node' itself). computed
+  // once per reachability version and cached on the metanode. this walks
+  // the parents rather than asking `reaches` of every metanode: the walk
+  // only visits the ancestors, where the labels would have to be tested
+  // against the whole metagraph to list them
+  const std::unordered_set<const SCCMetaNode*>& ancestors(SCCMetaNode *node);
+
+  // does 'from' imply 'to', directly or through other metanodes? answered
+  // from labels on the metanodes, built once the metagraph has changed in
+  // a way they can't be kept up to date through. most pairs are settled by
+  // the labels alone, and the rest by a search they prune
+  bool reaches(const SCCMetaNode *from, const SCCMetaNode *to);
+
+  // keep the entities matching each metanode implied by at least
+  // 'min_ancestors' metanodes: those with a tag that implies one in the
+  // metanode. they're found when build_lit first asks for them, kept up to
+  // date as entities are tagged, and found again by make_clean, so
+  // queries for such a tag use the one set, and count it exactly
+  void set_closure_sets(bool keep, size_t min_ancestors = CLOSURE_SET_MIN_ANCESTORS);
+
+  // the entities matching 'node' through any metanode implying it, or
+  // null if they're not kept for it
+  const Tag::entity_set *closure_set(SCCMetaNode *node);
+
+  // does 'tag' imply 'other', directly or not? a tag implies itself
+  bool implies(Tag *tag, Tag *other);
+
+  // adds every metanode 'node' implies (including 'node' itself) to 'out'
+  void descendants(const SCCMetaNode *node, std::vector<SCCMetaNode*>& out);
+
+  uint64_t metagraph_version() const {
+    return metagraph_version_;
+  }
+
+  // bumped whenever the answer to `reaches` may have changed for some pair
+  uint64_t reach_version() const {
+    return reach_version_;
+  }
+
+  // plans built before this last changed (e.g. cached by a `PlanCache`)
+  // may refer to destroyed tags or stale metanodes, and must be rebuilt
+  uint64_t plan_version() const {
+    return plan_version_;
+  }
+
+  // registers 'clause' (taking ownership of it) as a standing query, and
+  // returns its id. from then on, 'callback' is called whenever an entity
+  // starts or stops matching the query, as tags are added to or removed
+  // from entities, entities are created or destroyed, and implications
+  // change. the callback must not modify the context. if the context is
+  // dirty, the initial matches are found by the next make_clean
+  int add_standing_query(QueryClause *clause, StandingQuery::callback_type callback);
+  bool remove_standing_query(int id);
+
+  // the standing query with the given id (or null)
+  const StandingQuery *standing_query(int id) const;
+
   // INTERNAL
   // notify the context that 'dirtying_tag' gained/lost 'other' as an implied
   // tag. 'gained_imply' true if it now implies other, false if implication removed
   // should only be called by Tag* internally
   void dirty_tag_imply_dag(Tag* dirtying_tag, bool gained_imply, Tag* other);
 
+  // INTERNAL
+  // notify the standing queries that 'entity' gained or lost 'tag', or that
+  // an implication of 'target' was added or removed
+  void standing_tagging_changed(Tag *entity, Tag *tag) {
+    if(!standing_queries_.empty()) standing_tagging_changed_impl(entity, tag);
+  }
+  void standing_implication_changed(Tag *target) {
+    if(!standing_queries_.empty()) standing_implication_changed_impl(target);
+  }
+
+  // INTERNAL
+  // keep the sketches of 'tag' and its metanode up to date after 'entity'
+  // gained or lost it
+  void sketch_tagging_changed(Tag *entity, Tag *tag);
+
+  // INTERNAL
+  // keep the closure sets holding 'tag' up to date after 'entity' gained
+  // or lost it
+  void closure_tagging_changed(Tag *entity, Tag *tag) {
+    if(!closure_nodes_.empty()) closure_tagging_changed_impl(entity, tag);
+  }
+
+  // INTERNAL
+  // publish a new version of 'entity's tags to the snapshots
+  void snapshot_tagging_changed(Tag *entity) {
+    if(snapshots_) snapshots_->update(entity);
+  }
+
+private:
+  void standing_tagging_changed_impl(Tag *entity, Tag *tag);
+  void standing_implication_changed_impl(Tag *target);
+  void closure_tagging_changed_impl(Tag *entity, Tag *tag);
+
 public:
-  // calls 'match' callback with all entities that match the QueryClause
-  // returns true if query was succesfull, false otherwise (e.g. context was dirty)
+  // calls 'match' callback with all entities that match the QueryClause,
+  // and returns the number of entities tested. a dirty context answers
+  // from the metagraph as of the last make_clean (see `is_dirty`). returns
+  // ERR_PLAN_STALE for a clause over metanodes that aren't current: it
+  // has to be built again
   template<class UnaryFunction>
   long query(const QueryClause *q, UnaryFunction match) const {
-    if(is_dirty()) {
-      return ERR_CONTEXT_DIRTY;
+    if(!is_current(q)) {
+      return ERR_PLAN_STALE;
     }
 
     long i = 0;
@@ -75,12 +343,133 @@ public:
     return i;
   }
 
+  // are the metanodes 'q' refers to (those build_lit put in it) still the
+  // context's? they're replaced as `metagraph_version` changes, and freed
+  // once the metagraph is rebuilt
+  bool is_current(const QueryClause *q) const {
+    const uint64_t version = q->metagraph_version();
+    return !version || version == metagraph_version_;
+  }
+
+  // has nothing 'plan' refers to changed since it was built?
+  bool is_current(const QueryPlan *plan) const {
+    return plan->version == plan_version_;
+  }
+
+  // runs a plan from `plan_query` with the engine it chose, or returns
+  // ERR_PLAN_STALE if it isn't current (a `PlanCache` plans it again)
+  template<class UnaryFunction>
+  long query(const QueryPlan *plan, UnaryFunction match) const {
+    if(!is_current(plan)) {
+      return ERR_PLAN_STALE;
+    }
+    if(plan->engine != QueryEngine_Index) {
+      return query(plan->exec_clause(), match);
+    }
+
+    const QueryClause *q = plan->candidate_clause();
+    const bool subtract = !plan->excluded.empty();
+    long i = 0;
+
+    if(plan->postings.size() == 1) {
+      for(auto e : *(plan->postings[0])) {
+        i++;
+        if(subtract && plan->is_excluded(e)) continue;
+        if(q->matches_set(e->tags)) {
+          match(e);
+        }
+      }
+    }
+    else {
+      // an entity can be in more than one of the lists
+      std::unordered_set<Tag*> seen;
+      for(auto list : plan->postings) {
+        for(auto e : *list) {
+          if(!seen.insert(e).second) continue;
+          i++;
+          if(subtract && plan->is_excluded(e)) continue;
+          if(q->matches_set(e->tags)) {
+            match(e);
+          }
+        }
+      }
+    }
+    return i;
+  }
+
+  // runs every query in 'batch' in a single pass over the entities, calling
+  // 'match' with the index of the query and the entity for each match
+  template<class BinaryFunction>
+  long query(const QueryBatch *batch, BinaryFunction match) const {
+    long i = 0;
+    for(auto&& iter : id_to_tag) {
+      i++;
+      auto e = iter.second;
+      batch->eval(e->tags, [&](size_t query) {
+        match(query, e);
+      });
+    }
+    return i;
+  }
+
+  // number of entities matching each query in 'batch', in one pass
+  long count(const QueryBatch *batch, std::vector<long>& counts) const {
+    counts.assign(batch->size(), 0);
+    return query(batch, [&](size_t query, Tag *e) {
+      (void)e;
+      counts[query]++;
+    });
+  }
+
+  // runs 'plan' as `query` would, with the work spread over the query pool
+  // (see `set_query_pool`), and puts the matches in 'matches', in no
+  // particular order. the entities are split into morsels that threads
+  // take as they go, and the index engine's posting lists (an 'or's
+  // operands) are visited in parallel, each leaving out entities already
+  // in the lists before it. returns the number of entities tested, or
+  // ERR_PLAN_STALE. any number of threads may run queries at once
+  long query_parallel(const QueryPlan *plan, std::vector<Tag*>& matches) const;
+
+  // counts the tags on the entities matching 'plan' (see `FacetOptions`),
+  // visiting the entities the same way `query` would. returns the number
+  // of entities visited, or ERR_PLAN_STALE
+  long facet(const QueryPlan *plan, FacetResult& result, const FacetOptions& options = FacetOptions()) const;
+
+  // estimated number of entities matching 'clause', from sketches of the
+  // entities with each tag and metanode, so it takes about the same time
+  // no matter how many entities match. usually within a few percent, and
+  // exact when few entities are involved
+  double approx_count(const QueryClause *clause) const;
+
+  // estimated number of entities matching both 'l' and 'r'
+  double approx_and_count(const QueryClause *l, const QueryClause *r) const;
+
+  // sample the entities to gather the statistics used by the cost based
+  // optimizer (see `plan_query`)
+  void analyze(size_t sample_size = 10000, size_t num_frequent = 64);
+  const ContextStats *stats() const {
+    return stats_;
+  }
+
+  // keep versions of every entity's tags, so that other threads can open
+  // a `ContextSnapshot` and query it without locking while this thread
+  // goes on changing the context. must be called before any snapshot is
+  // opened. each change to an entity's tags then copies them, and a few
+  // pages of the store, and destroyed tags are deleted once no snapshot
+  // could be using them
+  void enable_snapshots();
+  SnapshotStore *snapshot_store() const {
+    return snapshots_;
+  }
+
   // context statistics
   size_t num_tags() const {
     return id_to_tag.size();
   }
 
-  // is a call to make_clean() required?
+  // is a call to make_clean() required? while it is, the metagraph is
+  // left as it was, and queries go on using it: they see the tags on the
+  // entities as they are, but the implications as of the last make_clean
   bool is_dirty() const {
     return recalc_metagraph;
   }
@@ -93,6 +482,71 @@ public:
 
   // recalculate the metagraph of tag implications from scratch
   void make_clean();
+
+  // start recalculating the metagraph on a thread of its own, from a copy
+  // of the implications as they are now, leaving the current one to be
+  // queried until `finish_rebuild` swaps the new one in. the context can
+  // be used (from the thread that started the rebuild) in the meantime.
+  // returns false if the context is clean or a rebuild is under way.
+  //
+  // swapping the new metagraph in frees the old metanodes, as make_clean
+  // does. so plans, and clauses from build_lit, built before then can't
+  // be used after it: `query` returns ERR_PLAN_STALE for them (see
+  // `is_current`), and they must be deleted or built again rather than
+  // optimized, planned or registered as standing queries
+  bool start_rebuild();
+
+  // has the rebuild started by `start_rebuild` finished building?
+  bool rebuild_ready() const {
+    return rebuild_ && rebuild_->done.load(std::memory_order_acquire);
+  }
+
+  // wait for the rebuild to finish, and publish the new metagraph in one
+  // step, as make_clean would. if implications changed after the rebuild
+  // started, the context stays dirty. returns true if it's now clean
+  bool finish_rebuild();
+
+  // an implication: 'first' implies 'second'
+  using imply_edge = std::pair<Tag*, Tag*>;
+
+  // adds (removes) every implication in 'edges' at once, ignoring any that
+  // are repeated, imply the tag itself or are already there (not there),
+  // and returns how many were added (removed). the metagraph is rebuilt if
+  // that's cheaper than updating it for each edge in turn, or left for
+  // make_clean if the context is dirty
+  size_t imply_many(const std::vector<imply_edge>& edges) {
+    return change_implications(edges, true);
+  }
+  size_t unimply_many(const std::vector<imply_edge>& edges) {
+    return change_implications(edges, false);
+  }
+
+  // keep only the metanode edges that other edges don't already imply
+  // (the transitive reduction of the metagraph), or all of them. what
+  // implies what, and so what queries match, stays the same, but walks
+  // over the metagraph have fewer edges to follow
+  void set_transitive_reduction(bool reduce);
+  bool transitive_reduction() const {
+    return reduce_metagraph_;
+  }
+
+  // rebuild the metagraph on 'num_threads' threads when it has at least
+  // 'min_tags' tags in it. 0 or 1 threads rebuilds on the calling thread
+  void set_rebuild_threads(unsigned num_threads, size_t min_tags = PARALLEL_REBUILD_MIN_TAGS);
+
+  // rebuild on 'pool' instead, which the context doesn't own and others
+  // may be using (e.g. `ThreadPool::shared`), or on the calling thread if
+  // it's null
+  void set_rebuild_pool(ThreadPool *pool, size_t min_tags = PARALLEL_REBUILD_MIN_TAGS);
+
+  // run `query_parallel` on 'pool' (not owned) when there are at least
+  // 'min_entities' entities to test, or on the calling thread if it's
+  // null. contexts and queries sharing one pool (e.g. `ThreadPool::shared`)
+  // never run more threads than it has, plus those waiting on it
+  void set_query_pool(ThreadPool *pool, size_t min_entities = PARALLEL_QUERY_MIN_ENTITIES);
+  ThreadPool *query_pool() const {
+    return query_pool_;
+  }
 };
 
 #endif
@@ -0,0 +1,242 @@
+#include "all_the_tags/explain.h"
+#include "all_the_tags/context.h"
+
+#include <chrono>
+#include <sstream>
+#include <iostream>
+
+typedef std::chrono::steady_clock explain_clock;
+
+// wraps a clause, counting how often it's evaluated and matches, and how
+// long it takes
+struct QueryClauseProbe : public QueryClause {
+  QueryClause *c;
+  ExplainNode *node;
+
+  QueryClauseProbe(QueryClause *c_, ExplainNode *node_) : c(c_), node(node_) {}
+  virtual ~QueryClauseProbe() { delete c; }
+
+  virtual bool matches_set(const Tag::tagging_map& tags) const {
+    const auto start = explain_clock::now();
+    bool matched = c->matches_set(tags);
+    node->time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      explain_clock::now() - start).count();
+
+    node->evaluated++;
+    if(matched) node->matched++;
+    return matched;
+  }
+
+  virtual int depth()        const { return c->depth();        }
+  virtual int num_children() const { return c->num_children(); }
+  virtual int entity_count() const { return c->entity_count(); }
+
+  virtual double selectivity(const ContextStats& stats) const {
+    return c->selectivity(stats);
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    return c->eval_cost(stats);
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const {
+    return c->postings(out);
+  }
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    return c->exact_postings(out);
+  }
+  virtual uint64_t metagraph_version() const {
+    return c->metagraph_version();
+  }
+
+  virtual QueryClauseProbe *dup() const {
+    assert(false);
+    return nullptr;
+  }
+
+  virtual void debug_print(int indent = 0) const {
+    c->debug_print(indent);
+  }
+};
+
+static ExplainNode *explain_clause(const QueryClause *clause, const ContextStats& stats) {
+  auto node = new ExplainNode();
+  node->est_selectivity = clause->selectivity(stats);
+  node->est_count = node->est_selectivity * stats.num_entities;
+  node->est_cost = clause->eval_cost(stats);
+
+  std::ostringstream detail;
+
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    node->type = (bin->type == QueryClauseAnd) ? "and" : "or";
+    node->children.push_back(explain_clause(bin->l, stats));
+    node->children.push_back(explain_clause(bin->r, stats));
+  }
+  else if(auto not_clause = dynamic_cast<const QueryClauseNot*>(clause)) {
+    node->type = "not";
+    node->children.push_back(explain_clause(not_clause->c, stats));
+  }
+  else if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    node->type = "lit";
+    detail << lit->t->id << " (" << std::bitset<8>(lit->rel_mask) << ")";
+  }
+  else if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    node->type = "meta";
+    detail << "(" << std::bitset<8>(meta->rel) << ") ";
+    meta->node->print_tag_set(detail);
+  }
+  else if(auto metaset = dynamic_cast<const QueryClauseMetaSet*>(clause)) {
+    node->type = "metaset";
+    detail << "(" << std::bitset<8>(metaset->rel) << ") " << metaset->nodes.size() << " metanodes";
+  }
+  else if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    node->type = "any";
+  }
+  else if(dynamic_cast<const QueryClauseNone*>(clause)) {
+    node->type = "none";
+  }
+  else {
+    // e.g. a JIT compiled clause, which can't be looked into
+    node->type = "opaque";
+  }
+
+  node->detail = detail.str();
+  return node;
+}
+
+// copy of 'clause' with every clause wrapped in a probe that records into
+// the matching node of 'node'
+static QueryClause *instrument(const QueryClause *clause, ExplainNode *node) {
+  QueryClause *copy;
+
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    assert(node->children.size() == 2);
+    copy = new QueryClauseBin(bin->type,
+      instrument(bin->l, node->children[0]),
+      instrument(bin->r, node->children[1]));
+  }
+  else if(auto not_clause = dynamic_cast<const QueryClauseNot*>(clause)) {
+    assert(node->children.size() == 1);
+    copy = new QueryClauseNot(instrument(not_clause->c, node->children[0]));
+  }
+  else {
+    copy = clause->dup();
+  }
+
+  return new QueryClauseProbe(copy, node);
+}
+
+QueryExplain *explain_query(const Context& ctx, const QueryPlan *plan) {
+  // the same statistics `plan_query` estimates with
+  ContextStats defaults;
+  const ContextStats *stats = ctx.stats();
+  if(!stats) {
+    defaults.num_entities = ctx.num_tags();
+    stats = &defaults;
+  }
+
+  auto explain = new QueryExplain();
+  explain->engine         = plan->engine;
+  explain->est_matches    = plan->est_matches;
+  explain->est_candidates = plan->est_candidates;
+  explain->scan_cost      = plan->scan_cost;
+  explain->index_cost     = plan->index_cost;
+  explain->jit_cost       = plan->jit_cost;
+  explain->root = explain_clause(plan->clause, *stats);
+  explain->num_excluded = plan->excluded.size();
+  if(plan->residual) {
+    explain->residual = explain_clause(plan->residual, *stats);
+  }
+  return explain;
+}
+
+QueryExplain *explain_analyze(const Context& ctx, const QueryPlan *plan) {
+  if(!ctx.is_current(plan)) {
+    return nullptr;
+  }
+
+  auto explain = explain_query(ctx, plan);
+
+  // run the instrumented clause the same way the plan would be run,
+  // subtracting the same lists and testing the rest against the residual
+  QueryPlan run(instrument(plan->clause, explain->root));
+  run.engine = (plan->engine == QueryEngine_Index) ? QueryEngine_Index : QueryEngine_Scan;
+  run.postings = plan->postings;
+  run.version = plan->version;
+  if(run.engine == QueryEngine_Index && plan->residual) {
+    run.excluded = plan->excluded;
+    run.residual = instrument(plan->residual, explain->residual);
+  }
+
+  long matches = 0;
+  const auto start = explain_clock::now();
+  long candidates = ctx.query(&run, [&](Tag *e) {
+    (void)e;
+    matches++;
+  });
+  explain->total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    explain_clock::now() - start).count();
+
+  assert(candidates >= 0);
+  explain->analyzed   = true;
+  explain->candidates = candidates;
+  explain->matches    = matches;
+  if(run.residual) {
+    explain->subtracted = candidates - explain->residual->evaluated;
+  }
+  return explain;
+}
+
+static void print_node(std::ostream& out, const ExplainNode *node, bool analyzed, int indent) {
+  for(int i = 0; i < indent; i++) {
+    out << "  ";
+  }
+
+  out << node->type;
+  if(node->detail.size()) {
+    out << " " << node->detail;
+  }
+  out << " [est count: " << node->est_count <<
+    " sel: " << node->est_selectivity <<
+    " cost: " << node->est_cost << "]";
+
+  if(analyzed) {
+    out << " [evaluated: " << node->evaluated <<
+      " matched: " << node->matched;
+    if(node->evaluated) {
+      out << " sel: " << node->actual_selectivity() <<
+        " time: " << node->time_ns << "ns";
+    }
+    out << "]";
+  }
+  out << std::endl;
+
+  for(auto child : node->children) {
+    print_node(out, child, analyzed, indent + 1);
+  }
+}
+
+void QueryExplain::print(std::ostream& out) const {
+  out << "engine: " << query_engine_name(engine) <<
+    " (cost scan: " << scan_cost <<
+    " index: " << index_cost <<
+    " jit: " << jit_cost << ")" << std::endl;
+  out << "estimated matches: " << est_matches <<
+    " candidates: " << est_candidates << std::endl;
+
+  if(analyzed) {
+    out << "actual matches: " << matches <<
+      " candidates: " << candidates <<
+      " time: " << total_ns << "ns" << std::endl;
+  }
+
+  print_node(out, root, analyzed, 0);
+  if(residual) {
+    out << "subtracting " << num_excluded << " lists";
+    if(analyzed) out << " (" << subtracted << " candidates)";
+    out << ", then testing:" << std::endl;
+    print_node(out, residual, analyzed, 1);
+  }
+}
+
+void QueryExplain::debug_print() const {
+  print(std::cerr);
+}
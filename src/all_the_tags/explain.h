@@ -0,0 +1,115 @@
+#ifndef __EXPLAIN_H__
+#define __EXPLAIN_H__
+
+#include <vector>
+#include <string>
+#include <ostream>
+
+#include "all_the_tags/plan.h"
+
+struct Context;
+
+// one clause of an explained plan, mirroring the shape of the optimized
+// clause tree
+struct ExplainNode {
+  // clause type ("and", "or", "not", "lit", "meta", "metaset", "any",
+  // "none") and what it tests for, e.g. the tag id of a literal
+  std::string type;
+  std::string detail;
+
+  // optimizer estimates for the clause
+  double est_selectivity;
+  double est_count;
+  double est_cost;
+
+  // filled in by `explain_analyze`: how many entities the clause was
+  // evaluated against, how many of those it matched, and the time (in ns)
+  // spent evaluating it, including its children and the timer overhead
+  long evaluated;
+  long matched;
+  double time_ns;
+
+  std::vector<ExplainNode*> children;
+
+  ExplainNode() :
+    est_selectivity(0),
+    est_count(0),
+    est_cost(0),
+    evaluated(0),
+    matched(0),
+    time_ns(0)
+    {}
+  ExplainNode(const ExplainNode&) = delete;
+  ~ExplainNode() {
+    for(auto c : children) delete c;
+  }
+
+  // fraction of the entities it was evaluated against that matched, or -1
+  // if it was never evaluated (e.g. short circuited)
+  double actual_selectivity() const {
+    return evaluated ? (double)matched / evaluated : -1;
+  }
+};
+
+struct QueryExplain {
+  QueryEngine engine;
+
+  // the plan's estimates (see `QueryPlan`)
+  double est_matches;
+  double est_candidates;
+  double scan_cost;
+  double index_cost;
+  double jit_cost;
+
+  // true if the query was run to fill in the actual counts
+  bool analyzed;
+  long candidates;
+  long matches;
+  double total_ns;
+
+  ExplainNode *root;
+
+  // the posting lists the index engine subtracts from the candidates, and
+  // the clause it tests those left against instead of 'root' (null if
+  // nothing is subtracted; see `QueryPlan::residual`). once analyzed,
+  // 'subtracted' is how many candidates were in one of the lists
+  size_t num_excluded;
+  ExplainNode *residual;
+  long subtracted;
+
+  QueryExplain() :
+    engine(QueryEngine_Scan),
+    est_matches(0),
+    est_candidates(0),
+    scan_cost(0),
+    index_cost(-1),
+    jit_cost(-1),
+    analyzed(false),
+    candidates(0),
+    matches(0),
+    total_ns(0),
+    root(nullptr),
+    num_excluded(0),
+    residual(nullptr),
+    subtracted(0)
+    {}
+  QueryExplain(const QueryExplain&) = delete;
+  ~QueryExplain() {
+    delete root;
+    delete residual;
+  }
+
+  void print(std::ostream& out) const;
+  void debug_print() const;
+};
+
+// describe how 'plan' will be run, with the optimizer's estimate for each
+// of its clauses
+QueryExplain *explain_query(const Context& ctx, const QueryPlan *plan);
+
+// run 'plan' with every clause instrumented, recording the actual counts
+// and times next to the estimates. JIT plans are analyzed by running the
+// clause they were compiled from. returns null if the plan isn't current
+QueryExplain *explain_analyze(const Context& ctx, const QueryPlan *plan);
+
+#endif /* __EXPLAIN_H__ */
@@ -0,0 +1,191 @@
+#include "all_the_tags/facet.h"
+#include "all_the_tags/context.h"
+
+static Tag *entity_of(const std::pair<const id_type, Tag*>& iter) { return iter.second; }
+static Tag *entity_of(Tag *entity) { return entity; }
+
+// calls 'fn' with every entity in part 'part' of 'parts' of an unordered
+// container, splitting it by bucket
+template<class Container, class Fn>
+static void for_each_in_part(const Container& container, size_t part, size_t parts, Fn fn) {
+  const size_t buckets = container.bucket_count();
+  const size_t begin = buckets * part / parts, end = buckets * (part + 1) / parts;
+  for(size_t b = begin; b < end; b++) {
+    for(auto iter = container.begin(b); iter != container.end(b); ++iter) {
+      fn(entity_of(*iter));
+    }
+  }
+}
+
+// counts for the entities in one part
+struct FacetPartial {
+  long visited;
+  long matches;
+  std::vector<FacetCount> counts;
+  std::unordered_map<Tag*, size_t> slots; // when counting every tag
+
+  FacetPartial() : visited(0), matches(0) {}
+};
+
+struct FacetCounter {
+  const QueryClause *clause;
+  const FacetOptions& options;
+  // candidate tag -> its index in options.candidates
+  const std::unordered_map<Tag*, size_t>& candidate_index;
+
+  FacetCounter(const QueryClause *clause_, const FacetOptions& options_, const std::unordered_map<Tag*, size_t>& candidate_index_) :
+    clause(clause_), options(options_), candidate_index(candidate_index_) {}
+
+  void init(FacetPartial& partial) const {
+    for(auto t : options.candidates) {
+      partial.counts.push_back(new_count(t));
+    }
+  }
+
+  FacetCount new_count(Tag *t) const {
+    FacetCount count = {t, 0, {}};
+    if(options.per_rel) count.rel_counts.resize(NUM_REL_BITS);
+    return count;
+  }
+
+  void count(FacetCount& count, rel_type rel) const {
+    count.count++;
+    if(options.per_rel) {
+      for(int bit = 0; bit < NUM_REL_BITS; bit++) {
+        if(rel & ((rel_type)1 << bit)) count.rel_counts[bit]++;
+      }
+    }
+  }
+
+  void add(FacetPartial& partial, const Tag *e) const {
+    partial.visited++;
+    if(!clause->matches_set(e->tags)) return;
+    partial.matches++;
+
+    if(options.candidates.empty()) {
+      for(auto&& tagging : e->tags) {
+        auto slot = partial.slots.insert(std::make_pair(tagging.first, partial.counts.size()));
+        if(slot.second) partial.counts.push_back(new_count(tagging.first));
+        count(partial.counts[slot.first->second], tagging.second);
+      }
+    }
+    else if(options.candidates.size() < e->tags.size()) {
+      // probe the entity for each candidate
+      for(size_t i = 0; i < options.candidates.size(); i++) {
+        auto iter = e->tags.find(options.candidates[i]);
+        if(iter != e->tags.end()) count(partial.counts[i], iter->second);
+      }
+    }
+    else {
+      // look up each of the entity's tags in the candidates
+      for(auto&& tagging : e->tags) {
+        auto iter = candidate_index.find(tagging.first);
+        if(iter != candidate_index.end()) count(partial.counts[iter->second], tagging.second);
+      }
+    }
+  }
+};
+
+long Context::facet(const QueryPlan *plan, FacetResult& result, const FacetOptions& options) const {
+  if(!is_current(plan)) {
+    return ERR_PLAN_STALE;
+  }
+
+  std::unordered_map<Tag*, size_t> candidate_index;
+  for(size_t i = 0; i < options.candidates.size(); i++) {
+    candidate_index.insert(std::make_pair(options.candidates[i], i));
+  }
+
+  const bool index = plan->engine == QueryEngine_Index;
+  FacetCounter counter(index ? plan->candidate_clause() : plan->exec_clause(), options, candidate_index);
+  const size_t parts = std::max(1u, options.num_threads);
+  std::vector<FacetPartial> partials(parts);
+  for(auto&& partial : partials) {
+    counter.init(partial);
+  }
+
+  // an entity can be in more than one posting list, so they're merged
+  // before being split between the threads
+  std::vector<Tag*> merged;
+  if(index && plan->postings.size() > 1) {
+    std::unordered_set<Tag*> seen;
+    for(auto list : plan->postings) {
+      for(auto e : *list) {
+        if(seen.insert(e).second) merged.push_back(e);
+      }
+    }
+  }
+
+  auto run_part = [&](size_t part) {
+    FacetPartial& partial = partials[part];
+    auto add = [&](Tag *e) {
+      if(index && plan->is_excluded(e)) {
+        partial.visited++;
+        return;
+      }
+      counter.add(partial, e);
+    };
+
+    if(!index) {
+      for_each_in_part(id_to_tag, part, parts, add);
+    }
+    else if(plan->postings.size() == 1) {
+      for_each_in_part(*(plan->postings[0]), part, parts, add);
+    }
+    else {
+      size_t begin = merged.size() * part / parts, end = merged.size() * (part + 1) / parts;
+      for(size_t i = begin; i < end; i++) {
+        add(merged[i]);
+      }
+    }
+  };
+
+  // the parts share the query pool with every other query, rather than
+  // each facet starting threads of its own
+  parallel_for(query_pool_, parts, parts, [&](size_t part, size_t, size_t) {
+    run_part(part);
+  });
+
+  // merge the parts into the first
+  FacetPartial& total = partials[0];
+  for(size_t part = 1; part < parts; part++) {
+    FacetPartial& partial = partials[part];
+    total.visited += partial.visited;
+    total.matches += partial.matches;
+
+    for(size_t i = 0; i < partial.counts.size(); i++) {
+      auto& from = partial.counts[i];
+      size_t slot = i;
+      if(options.candidates.empty()) {
+        auto inserted = total.slots.insert(std::make_pair(from.tag, total.counts.size()));
+        if(inserted.second) {
+          total.counts.push_back(counter.new_count(from.tag));
+        }
+        slot = inserted.first->second;
+      }
+
+      auto& to = total.counts[slot];
+      to.count += from.count;
+      for(size_t bit = 0; bit < from.rel_counts.size(); bit++) {
+        to.rel_counts[bit] += from.rel_counts[bit];
+      }
+    }
+  }
+
+  auto by_count = [](const FacetCount& a, const FacetCount& b) {
+    if(a.count != b.count) return a.count > b.count;
+    return a.tag->id < b.tag->id;
+  };
+  auto& counts = total.counts;
+  if(options.top_k && options.top_k < counts.size()) {
+    std::partial_sort(counts.begin(), counts.begin() + options.top_k, counts.end(), by_count);
+    counts.resize(options.top_k);
+  }
+  else {
+    std::sort(counts.begin(), counts.end(), by_count);
+  }
+
+  result.matches = total.matches;
+  result.counts.swap(counts);
+  return total.visited;
+}
@@ -0,0 +1,55 @@
+#ifndef __FACET_H__
+#define __FACET_H__
+
+#include <vector>
+
+#include "all_the_tags/tag.h"
+
+// number of bits in a rel mask, each counted separately by a facet with
+// 'per_rel' set
+static const int NUM_REL_BITS = sizeof(rel_type) * 8;
+
+struct FacetOptions {
+  // only count these tags (every tag is counted if empty). candidates
+  // are reported even if none of the matches have them
+  std::vector<Tag*> candidates;
+
+  // also count the matches with each rel bit set, per tag
+  bool per_rel;
+
+  // only report the tags with the highest counts (all if 0)
+  size_t top_k;
+
+  // split the entities into this many parts, run on the context's query
+  // pool (see `Context::set_query_pool`), or in turn without one
+  unsigned num_threads;
+
+  FacetOptions() :
+    per_rel(false),
+    top_k(0),
+    num_threads(1)
+    {}
+};
+
+struct FacetCount {
+  Tag *tag;
+
+  // number of matching entities tagged with 'tag'
+  long count;
+
+  // if 'per_rel' was set, rel_counts[i] is the number of matching entities
+  // tagged with 'tag' with rel bit i set
+  std::vector<long> rel_counts;
+};
+
+struct FacetResult {
+  // number of entities that matched the query
+  long matches;
+
+  // highest count first (ties by lowest tag id)
+  std::vector<FacetCount> counts;
+
+  FacetResult() : matches(0) {}
+};
+
+#endif /* __FACET_H__ */
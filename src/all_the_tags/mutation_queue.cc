@@ -0,0 +1,266 @@
+#include "all_the_tags/mutation_queue.h"
+#include "all_the_tags/context.h"
+#include "all_the_tags/tag.h"
+
+MutationQueue::MutationQueue(Context& ctx) :
+  num_batches(0),
+  num_mutations(0),
+  num_coalesced(0),
+  ctx_(ctx),
+  head_(&stub_),
+  tail_(&stub_),
+  next_seq_(1),
+  applied_(0),
+  sleeping_(false),
+  stopping_(false) {
+  applier_ = std::thread([this]() { run(); });
+}
+
+MutationQueue::~MutationQueue() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  applier_.join();
+}
+
+uint64_t MutationQueue::push(Mutation::Type type, id_type a, id_type b, rel_type rel,
+  std::function<void(Context&)> fn) {
+  auto m = new Mutation();
+  m->type = type;
+  m->a = a;
+  m->b = b;
+  m->rel = rel;
+  m->fn = std::move(fn);
+  // the applier may be done with it (and have deleted it) once it's queued
+  const uint64_t seq = m->seq = next_seq_.fetch_add(1, std::memory_order_acq_rel);
+  enqueue(m);
+
+  if(sleeping_.load(std::memory_order_seq_cst)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.notify_one();
+  }
+  return seq;
+}
+
+uint64_t MutationQueue::call(std::function<void(Context&)> fn) {
+  assert(fn);
+  return push(Mutation::CALL, 0, 0, 0, std::move(fn));
+}
+
+void MutationQueue::enqueue(Mutation *m) {
+  m->next.store(nullptr, std::memory_order_relaxed);
+  auto prev = head_.exchange(m, std::memory_order_seq_cst);
+  // between the exchange and this store, the applier can't get past 'prev'
+  prev->next.store(m, std::memory_order_release);
+}
+
+// the next mutation, or null if there's none, or the one after the tail
+// is still being pushed
+Mutation *MutationQueue::dequeue() {
+  auto tail = tail_;
+  auto next = tail->next.load(std::memory_order_acquire);
+  if(tail == &stub_) {
+    if(!next) return nullptr;
+    tail_ = tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if(next) {
+    tail_ = next;
+    return tail;
+  }
+
+  // 'tail' is the last one pushed, unless a push is under way. it can only
+  // be taken once there's something behind it, so put the stub there
+  if(tail != head_.load(std::memory_order_acquire)) return nullptr;
+  enqueue(&stub_);
+  next = tail->next.load(std::memory_order_acquire);
+  if(next) {
+    tail_ = next;
+    return tail;
+  }
+  return nullptr;
+}
+
+bool MutationQueue::maybe_queued() {
+  return tail_->next.load(std::memory_order_acquire) ||
+    head_.load(std::memory_order_seq_cst) != tail_;
+}
+
+void MutationQueue::run() {
+  std::vector<Mutation*> batch;
+  std::vector<uint64_t> seqs;
+  while(true) {
+    batch.clear();
+    while(batch.size() < MUTATION_BATCH_MAX) {
+      auto m = dequeue();
+      if(!m) break;
+      batch.push_back(m);
+    }
+
+    if(batch.empty()) {
+      if(maybe_queued()) {
+        // a push is half done
+        std::this_thread::yield();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if(stopping_) break;
+      sleeping_.store(true, std::memory_order_seq_cst);
+      if(!maybe_queued()) wake_.wait(lock);
+      sleeping_.store(false, std::memory_order_relaxed);
+      continue;
+    }
+
+    seqs.clear();
+    for(auto m : batch) {
+      apply(m);
+      seqs.push_back(m->seq);
+    }
+    apply_pending();
+    for(auto m : batch) {
+      delete m;
+    }
+
+    num_batches++;
+    num_mutations += batch.size();
+    mark_applied(seqs);
+  }
+  assert(pending_tags_.empty() && pending_implies_.empty());
+}
+
+void MutationQueue::apply(Mutation *m) {
+  const auto key = std::make_pair(m->a, m->b);
+  switch(m->type) {
+  case Mutation::ADD_TAG:
+  case Mutation::REMOVE_TAG: {
+    auto inserted = pending_tags_.insert(std::make_pair(key, PendingTagging{ALL_REL_MASK, 0}));
+    if(!inserted.second) num_coalesced++;
+    auto& pending = inserted.first->second;
+    if(m->type == Mutation::ADD_TAG) {
+      pending.set |= m->rel;
+    }
+    else {
+      pending.keep &= ~m->rel;
+      pending.set &= ~m->rel;
+    }
+    pending_ids_.insert(m->a);
+    pending_ids_.insert(m->b);
+    break;
+  }
+
+  case Mutation::IMPLY:
+  case Mutation::UNIMPLY: {
+    auto inserted = pending_implies_.insert(std::make_pair(key, m->type == Mutation::IMPLY));
+    if(!inserted.second) {
+      num_coalesced++;
+      inserted.first->second = m->type == Mutation::IMPLY;
+    }
+    pending_ids_.insert(m->a);
+    pending_ids_.insert(m->b);
+    break;
+  }
+
+  case Mutation::NEW_TAG:
+    // what's pending for the id was for one that didn't exist
+    if(ctx_.tag_by_id(m->a)) break;
+    forget_pending(m->a);
+    ctx_.new_tag(m->a);
+    break;
+
+  case Mutation::DESTROY_TAG: {
+    // and what's pending for it would be undone by destroying it
+    auto tag = ctx_.tag_by_id(m->a);
+    if(!tag) break;
+    forget_pending(m->a);
+    ctx_.destroy_tag(tag);
+    break;
+  }
+
+  case Mutation::CALL:
+    apply_pending();
+    m->fn(ctx_);
+    break;
+  }
+}
+
+void MutationQueue::forget_pending(id_type id) {
+  if(!pending_ids_.count(id)) return;
+
+  for(auto iter = pending_tags_.begin(); iter != pending_tags_.end();) {
+    if(iter->first.first == id || iter->first.second == id) {
+      iter = pending_tags_.erase(iter);
+      num_coalesced++;
+    }
+    else {
+      ++iter;
+    }
+  }
+  for(auto iter = pending_implies_.begin(); iter != pending_implies_.end();) {
+    if(iter->first.first == id || iter->first.second == id) {
+      iter = pending_implies_.erase(iter);
+      num_coalesced++;
+    }
+    else {
+      ++iter;
+    }
+  }
+}
+
+void MutationQueue::apply_pending() {
+  for(auto&& iter : pending_tags_) {
+    auto entity = ctx_.tag_by_id(iter.first.first), tag = ctx_.tag_by_id(iter.first.second);
+    if(!entity || !tag) continue;
+
+    auto tagged = entity->tags.find(tag);
+    const rel_type had = tagged == entity->tags.end() ? 0 : tagged->second;
+    const rel_type want = (had & iter.second.keep) | iter.second.set;
+    if(want == had) continue;
+
+    if(!want) {
+      entity->remove_tag(tag);
+      continue;
+    }
+    if(had & ~want) entity->remove_tag(tag, had & ~want);
+    if(want & ~had) entity->add_tag(tag, want & ~had);
+  }
+
+  std::vector<Context::imply_edge> gained, lost;
+  for(auto&& iter : pending_implies_) {
+    auto tag = ctx_.tag_by_id(iter.first.first), other = ctx_.tag_by_id(iter.first.second);
+    if(!tag || !other) continue;
+    (iter.second ? gained : lost).push_back(std::make_pair(tag, other));
+  }
+  if(lost.size())   ctx_.unimply_many(lost);
+  if(gained.size()) ctx_.imply_many(gained);
+
+  pending_tags_.clear();
+  pending_implies_.clear();
+  pending_ids_.clear();
+}
+
+void MutationQueue::mark_applied(const std::vector<uint64_t>& seqs) {
+  // a producer can take a sequence number and be beaten to the queue by
+  // one that took a later number, so track those that came early
+  uint64_t applied = applied_.load(std::memory_order_relaxed);
+  for(auto seq : seqs) {
+    if(seq == applied + 1) applied++;
+    else                   applied_ahead_.push(seq);
+    while(applied_ahead_.size() && applied_ahead_.top() == applied + 1) {
+      applied_ahead_.pop();
+      applied++;
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  applied_.store(applied, std::memory_order_release);
+  applied_cv_.notify_all();
+}
+
+void MutationQueue::wait(uint64_t seq) {
+  if(applied() >= seq) return;
+  std::unique_lock<std::mutex> lock(mutex_);
+  applied_cv_.wait(lock, [&]() { return applied() >= seq; });
+}
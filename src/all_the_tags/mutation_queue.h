@@ -0,0 +1,168 @@
+#ifndef __MUTATION_QUEUE_H__
+#define __MUTATION_QUEUE_H__
+
+#include <vector>
+#include <queue>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+#include "all_the_tags/id.h"
+
+struct Context;
+
+// most mutations the applier takes off the queue at once
+static const size_t MUTATION_BATCH_MAX = 4096;
+
+// a queued change to a context, named by ids so it can be made by a
+// thread that can't touch the context's tags
+struct Mutation {
+  enum Type {
+    NEW_TAG,
+    DESTROY_TAG,
+    ADD_TAG,    // tag 'a' with 'b'
+    REMOVE_TAG, // untag 'a' from 'b'
+    IMPLY,      // 'a' implies 'b'
+    UNIMPLY,
+    CALL        // run 'fn' on the applier's thread
+  };
+
+  Type type;
+  id_type a, b;
+  rel_type rel;
+  std::function<void(Context&)> fn;
+  uint64_t seq;
+
+  // next in the queue, set by the producer that pushes after this one
+  std::atomic<Mutation*> next;
+
+  Mutation() : type(CALL), a(0), b(0), rel(0), seq(0), next(nullptr) {}
+};
+
+// changes to a context from any number of threads, applied in order by a
+// single thread of the queue's own. producers push onto a lock-free queue
+// (Vyukov's intrusive MPSC queue), and the applier takes everything
+// waiting as one batch: changes that cancel out or repeat (an add then a
+// remove of the same tag, say) are folded together, and what's left of
+// the batch's implications goes through `Context::imply_many`, for one
+// round of metagraph maintenance rather than one per edge.
+//
+// every mutation gets a sequence number, and `wait` returns once it's
+// been applied. while the queue runs, only the applier may touch the
+// context: read it through a `ContextSnapshot`, or with `call`.
+// mutations naming ids that don't exist when they're applied do nothing
+struct MutationQueue {
+  MutationQueue(Context& ctx);
+  MutationQueue(const MutationQueue&) = delete;
+
+  // applies whatever's still queued, then stops the applier
+  ~MutationQueue();
+
+  // queue a mutation, returning its sequence number. thread safe
+  uint64_t new_tag(id_type id) {
+    return push(Mutation::NEW_TAG, id, 0, 0);
+  }
+  uint64_t destroy_tag(id_type id) {
+    return push(Mutation::DESTROY_TAG, id, 0, 0);
+  }
+  uint64_t add_tag(id_type entity, id_type tag, rel_type rel = 1) {
+    return push(Mutation::ADD_TAG, entity, tag, rel);
+  }
+  uint64_t remove_tag(id_type entity, id_type tag, rel_type rel = ALL_REL_MASK) {
+    return push(Mutation::REMOVE_TAG, entity, tag, rel);
+  }
+  uint64_t imply(id_type tag, id_type other) {
+    return push(Mutation::IMPLY, tag, other, 0);
+  }
+  uint64_t unimply(id_type tag, id_type other) {
+    return push(Mutation::UNIMPLY, tag, other, 0);
+  }
+
+  // run 'fn' on the applier's thread, after every mutation queued before
+  // it has been applied
+  uint64_t call(std::function<void(Context&)> fn);
+
+  // the sequence number the next mutation pushed will get
+  uint64_t next_seq() const {
+    return next_seq_.load(std::memory_order_acquire);
+  }
+
+  // every mutation up to and including this one has been applied
+  uint64_t applied() const {
+    return applied_.load(std::memory_order_acquire);
+  }
+
+  // wait until mutation 'seq' (and all before it) has been applied
+  void wait(uint64_t seq);
+
+  // wait for everything queued so far
+  void flush() {
+    wait(next_seq() - 1);
+  }
+
+  // batches applied, mutations taken off the queue, and of those, how
+  // many were folded into others or cancelled out
+  std::atomic<uint64_t> num_batches;
+  std::atomic<uint64_t> num_mutations;
+  std::atomic<uint64_t> num_coalesced;
+
+private:
+  Context& ctx_;
+
+  // the queue: producers swap themselves in at the head, and the applier
+  // takes from the tail. 'stub_' keeps it from ever being empty
+  std::atomic<Mutation*> head_;
+  Mutation *tail_;
+  Mutation stub_;
+
+  std::atomic<uint64_t> next_seq_;
+  std::atomic<uint64_t> applied_;
+
+  // the applier sleeps on 'wake_' when there's nothing queued, and those
+  // waiting on a sequence number on 'applied_cv_'
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable applied_cv_;
+  std::atomic<bool> sleeping_;
+  std::atomic<bool> stopping_;
+
+  // sequence numbers applied ahead of one that was pushed late
+  std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>> applied_ahead_;
+
+  // the changes of the batch not yet made to the context, folded together
+  // by (entity, tag) and (tag, other). a tagging ends up as the rels it
+  // had, masked by 'keep', plus 'set'
+  struct PendingTagging {
+    rel_type keep;
+    rel_type set;
+  };
+  struct PairHash {
+    size_t operator()(const std::pair<id_type, id_type>& p) const {
+      return std::hash<uint64_t>()(((uint64_t) p.first << 32) | p.second);
+    }
+  };
+  std::unordered_map<std::pair<id_type, id_type>, PendingTagging, PairHash> pending_tags_;
+  std::unordered_map<std::pair<id_type, id_type>, bool, PairHash> pending_implies_;
+  std::unordered_set<id_type> pending_ids_;
+
+  std::thread applier_;
+
+  uint64_t push(Mutation::Type type, id_type a, id_type b, rel_type rel,
+    std::function<void(Context&)> fn = nullptr);
+  void enqueue(Mutation *m);
+  Mutation *dequeue();
+  bool maybe_queued();
+
+  void run();
+  void apply(Mutation *m);
+  void apply_pending();
+  void forget_pending(id_type id);
+  void mark_applied(const std::vector<uint64_t>& seqs);
+};
+
+#endif /* __MUTATION_QUEUE_H__ */
@@ -0,0 +1,96 @@
+#include "all_the_tags/context.h"
+#include "all_the_tags/tag.h"
+
+// an entity of a hash container of them, keyed by id or not
+static inline Tag *entity_of(Tag *e) {
+  return e;
+}
+static inline Tag *entity_of(const std::pair<const id_type, Tag*>& iter) {
+  return iter.second;
+}
+
+// tests the entities of a hash container a morsel of its buckets at a
+// time, skipping those 'skip' returns true for and keeping those 'match'
+// does in 'found' (a list for each morsel). returns the number tested
+template<class Container, class Skip, class Match>
+static long scan_morsels(ThreadPool *pool, const Container& entities,
+  std::vector<std::vector<Tag*>>& found, Skip skip, Match match) {
+
+  const size_t buckets = entities.bucket_count();
+  found.resize((buckets + QUERY_MORSEL_BUCKETS - 1) / QUERY_MORSEL_BUCKETS);
+  std::atomic<long> tested(0);
+
+  parallel_morsels(pool, buckets, QUERY_MORSEL_BUCKETS, [&](size_t morsel, size_t begin, size_t end) {
+    auto& out = found[morsel];
+    long i = 0;
+    for(size_t b = begin; b < end; b++) {
+      for(auto iter = entities.begin(b); iter != entities.end(b); ++iter) {
+        auto e = entity_of(*iter);
+        if(skip(e)) continue;
+        i++;
+        if(match(e)) out.push_back(e);
+      }
+    }
+    tested += i;
+  });
+  return tested;
+}
+
+long Context::query_parallel(const QueryPlan *plan, std::vector<Tag*>& matches) const {
+  if(!is_current(plan)) {
+    return ERR_PLAN_STALE;
+  }
+
+  // small queries aren't worth handing out
+  const size_t to_test = plan->engine == QueryEngine_Index ? plan->est_candidates : id_to_tag.size();
+  ThreadPool *pool = to_test >= query_min_entities_ ? query_pool_ : nullptr;
+
+  // the matches of each morsel, of each list visited
+  std::vector<std::vector<std::vector<Tag*>>> found;
+  long tested = 0;
+
+  if(plan->engine != QueryEngine_Index) {
+    const QueryClause *q = plan->exec_clause();
+    found.resize(1);
+    tested = scan_morsels(pool, id_to_tag, found[0],
+      [](Tag *) { return false; },
+      [q](Tag *e) { return q->matches_set(e->tags); });
+  }
+  else {
+    const QueryClause *q = plan->candidate_clause();
+    const auto& postings = plan->postings;
+    const bool subtract = !plan->excluded.empty();
+
+    // each list is visited by a task of its own, which splits it into
+    // morsels in turn. an entity in more than one list is tested by the
+    // first only, so the lists don't need to share what they've seen
+    found.resize(postings.size());
+    std::atomic<long> total(0);
+    TaskGroup lists(pool);
+    for(size_t l = 0; l < postings.size(); l++) {
+      lists.run([&, l]() {
+        auto earlier = [&postings, l](Tag *e) {
+          for(size_t k = 0; k < l; k++) {
+            if(postings[k]->count(e)) return true;
+          }
+          return false;
+        };
+        total += scan_morsels(pool, *(postings[l]), found[l], earlier,
+          [plan, q, subtract](Tag *e) {
+            if(subtract && plan->is_excluded(e)) return false;
+            return q->matches_set(e->tags);
+          });
+      });
+    }
+    lists.wait();
+    tested = total;
+  }
+
+  matches.clear();
+  for(auto&& list : found) {
+    for(auto&& morsel : list) {
+      matches.insert(matches.end(), morsel.begin(), morsel.end());
+    }
+  }
+  return tested;
+}
@@ -0,0 +1,304 @@
+#include "all_the_tags/parser.h"
+#include "all_the_tags/context.h"
+
+#include <cctype>
+#include <cstdint>
+
+enum QueryTokenType {
+  QueryToken_End,
+  QueryToken_And,
+  QueryToken_Or,
+  QueryToken_Not,
+  QueryToken_LParen,
+  QueryToken_RParen,
+  QueryToken_Any,
+  QueryToken_Colon,
+  QueryToken_Num  // a tag id or rel mask (parameters are resolved to ids)
+};
+
+struct QueryToken {
+  QueryTokenType type;
+  uint32_t value;
+  size_t pos;
+};
+
+// deeper nesting than this is rejected rather than risk running out of stack
+static const int MAX_PARSE_DEPTH = 512;
+
+static bool set_error(ParseError *err, int code, size_t pos, const std::string& message) {
+  if(err) {
+    err->code = code;
+    err->pos = pos;
+    err->message = message;
+  }
+  return false;
+}
+
+// reads a decimal or hex number starting at 'i', advancing past it
+static bool lex_number(const std::string& text, size_t& i, uint32_t& value, ParseError *err) {
+  const size_t start = i;
+  int base = 10;
+  if(text[i] == '0' && i + 1 < text.size() && (text[i + 1] == 'x' || text[i + 1] == 'X')) {
+    base = 16;
+    i += 2;
+  }
+
+  uint64_t accum = 0;
+  size_t digits = 0;
+  for(; i < text.size(); i++, digits++) {
+    int c = text[i], digit;
+    if(isdigit(c)) {
+      digit = c - '0';
+    }
+    else if(base == 16 && isxdigit(c)) {
+      digit = tolower(c) - 'a' + 10;
+    }
+    else {
+      break;
+    }
+
+    accum = accum * base + digit;
+    if(accum > UINT32_MAX) {
+      return set_error(err, ERR_PARSE_SYNTAX, start, "number out of range");
+    }
+  }
+
+  if(!digits) {
+    return set_error(err, ERR_PARSE_SYNTAX, start, "expected a number");
+  }
+
+  value = (uint32_t)accum;
+  return true;
+}
+
+static bool lex_query(
+  const std::string& text,
+  const std::vector<id_type>& params,
+  std::vector<QueryToken>& tokens,
+  ParseError *err
+) {
+  size_t i = 0;
+  while(true) {
+    while(i < text.size() && isspace(text[i])) {
+      i++;
+    }
+
+    QueryToken tok = {QueryToken_End, 0, i};
+    if(i == text.size()) {
+      tokens.push_back(tok);
+      return true;
+    }
+
+    switch(text[i]) {
+      case '&':
+      case '+': tok.type = QueryToken_And;    i++; break;
+      case '|': tok.type = QueryToken_Or;     i++; break;
+      case '!': tok.type = QueryToken_Not;    i++; break;
+      case '(': tok.type = QueryToken_LParen; i++; break;
+      case ')': tok.type = QueryToken_RParen; i++; break;
+      case '*': tok.type = QueryToken_Any;    i++; break;
+      case ':': tok.type = QueryToken_Colon;  i++; break;
+
+      case '$': {
+        i++;
+        uint32_t param;
+        if(i == text.size() || !isdigit(text[i]) || !lex_number(text, i, param, err)) {
+          return set_error(err, ERR_PARSE_SYNTAX, tok.pos, "expected a parameter number");
+        }
+        if(param >= params.size()) {
+          return set_error(err, ERR_PARSE_PARAM, tok.pos, "no value for parameter");
+        }
+        tok.type = QueryToken_Num;
+        tok.value = params[param];
+        break;
+      }
+
+      default:
+        if(!isdigit(text[i])) {
+          return set_error(err, ERR_PARSE_SYNTAX, i, std::string("unexpected character '") + text[i] + "'");
+        }
+        if(!lex_number(text, i, tok.value, err)) {
+          return false;
+        }
+        tok.type = QueryToken_Num;
+    }
+
+    tokens.push_back(tok);
+  }
+}
+
+bool normalize_query(
+  const std::string& text,
+  const std::vector<id_type>& params,
+  std::string& out,
+  ParseError *err
+) {
+  std::vector<QueryToken> tokens;
+  if(!lex_query(text, params, tokens, err)) {
+    return false;
+  }
+
+  out.clear();
+  out.reserve(text.size());
+
+  QueryTokenType last = QueryToken_End;
+  for(auto&& tok : tokens) {
+    switch(tok.type) {
+      case QueryToken_End:    break;
+      case QueryToken_And:    out += '&'; break;
+      case QueryToken_Or:     out += '|'; break;
+      case QueryToken_Not:    out += '!'; break;
+      case QueryToken_LParen: out += '('; break;
+      case QueryToken_RParen: out += ')'; break;
+      case QueryToken_Any:    out += '*'; break;
+      case QueryToken_Colon:  out += ':'; break;
+      case QueryToken_Num:
+        // keep '1 2' from reading as '12'
+        if(last == QueryToken_Num) out += ' ';
+        out += std::to_string(tok.value);
+        break;
+    }
+    last = tok.type;
+  }
+
+  return true;
+}
+
+// recursive descent over the tokens, one method per precedence level
+struct QueryParser {
+  const Context& ctx;
+  const std::vector<QueryToken>& tokens;
+  ParseError *err;
+  size_t i;
+  int depth;
+
+  QueryParser(const Context& ctx_, const std::vector<QueryToken>& tokens_, ParseError *err_) :
+    ctx(ctx_), tokens(tokens_), err(err_), i(0), depth(0) {}
+
+  const QueryToken& peek() const {
+    return tokens[i];
+  }
+
+  QueryClause *fail(int code, size_t pos, const std::string& message) {
+    set_error(err, code, pos, message);
+    return nullptr;
+  }
+
+  QueryClause *parse_or() {
+    QueryClause *l = parse_and();
+    while(l && peek().type == QueryToken_Or) {
+      i++;
+      QueryClause *r = parse_and();
+      if(!r) {
+        delete l;
+        return nullptr;
+      }
+      l = build_or(l, r);
+    }
+    return l;
+  }
+
+  QueryClause *parse_and() {
+    QueryClause *l = parse_unary();
+    while(l && peek().type == QueryToken_And) {
+      i++;
+      QueryClause *r = parse_unary();
+      if(!r) {
+        delete l;
+        return nullptr;
+      }
+      l = build_and(l, r);
+    }
+    return l;
+  }
+
+  QueryClause *parse_unary() {
+    if(++depth > MAX_PARSE_DEPTH) {
+      return fail(ERR_PARSE_SYNTAX, peek().pos, "query nested too deeply");
+    }
+
+    QueryClause *clause;
+    if(peek().type == QueryToken_Not) {
+      i++;
+      clause = parse_unary();
+      if(clause) clause = build_not(clause);
+    }
+    else {
+      clause = parse_atom();
+    }
+
+    depth--;
+    return clause;
+  }
+
+  QueryClause *parse_atom() {
+    const QueryToken& tok = peek();
+
+    switch(tok.type) {
+      case QueryToken_LParen: {
+        i++;
+        QueryClause *clause = parse_or();
+        if(!clause) return nullptr;
+        if(peek().type != QueryToken_RParen) {
+          delete clause;
+          return fail(ERR_PARSE_SYNTAX, peek().pos, "expected ')'");
+        }
+        i++;
+        return clause;
+      }
+
+      case QueryToken_Any:
+        i++;
+        return new QueryClauseAny();
+
+      case QueryToken_Num: {
+        i++;
+        Tag *tag = ctx.tag_by_id(tok.value);
+        if(!tag) {
+          return fail(ERR_PARSE_UNKNOWN_TAG, tok.pos, "no tag with id " + std::to_string(tok.value));
+        }
+
+        rel_type rel = ALL_REL_MASK;
+        if(peek().type == QueryToken_Colon) {
+          i++;
+          if(peek().type != QueryToken_Num) {
+            return fail(ERR_PARSE_SYNTAX, peek().pos, "expected a rel mask");
+          }
+          rel = peek().value;
+          if(!rel) {
+            return fail(ERR_PARSE_SYNTAX, peek().pos, "rel mask can't be empty");
+          }
+          i++;
+        }
+        return build_lit(tag, rel);
+      }
+
+      case QueryToken_End:
+        return fail(ERR_PARSE_SYNTAX, tok.pos, "unexpected end of query");
+
+      default:
+        return fail(ERR_PARSE_SYNTAX, tok.pos, "expected a tag, '*', '!' or '('");
+    }
+  }
+};
+
+QueryClause *parse_query(
+  const Context& ctx,
+  const std::string& text,
+  const std::vector<id_type>& params,
+  ParseError *err
+) {
+  std::vector<QueryToken> tokens;
+  if(!lex_query(text, params, tokens, err)) {
+    return nullptr;
+  }
+
+  QueryParser parser(ctx, tokens, err);
+  QueryClause *clause = parser.parse_or();
+  if(clause && parser.peek().type != QueryToken_End) {
+    delete clause;
+    return parser.fail(ERR_PARSE_SYNTAX, parser.peek().pos, "unexpected token after query");
+  }
+
+  return clause;
+}
@@ -0,0 +1,55 @@
+#ifndef __PARSER_H__
+#define __PARSER_H__
+
+#include <string>
+#include <vector>
+
+#include "all_the_tags/query.h"
+#include "all_the_tags/id.h"
+
+struct Context;
+
+// error codes for `parse_query`
+static const int ERR_PARSE_SYNTAX      = -2;
+static const int ERR_PARSE_UNKNOWN_TAG = -3;
+static const int ERR_PARSE_PARAM       = -4;
+
+struct ParseError {
+  int code;        // 0, or one of the ERR_PARSE_* codes
+  size_t pos;      // offset into the query text the error was found at
+  std::string message;
+
+  ParseError() : code(0), pos(0) {}
+};
+
+// infix query syntax, from lowest to highest precedence:
+//
+//   a | b      either matches
+//   a & b      both match ('+' is accepted for '&')
+//   !a         doesn't match
+//   (a)        grouping
+//   *          matches everything
+//   12         the tag with id 12 (ids can be given in hex, e.g. 0xc)
+//   $0         the tag whose id is params[0]
+//   12:3       tag 12, only when tagged with a rel in the mask 3
+//
+// returns the clause, or null with 'err' (if given) describing why the
+// query couldn't be parsed
+QueryClause *parse_query(
+  const Context& ctx,
+  const std::string& text,
+  const std::vector<id_type>& params = std::vector<id_type>(),
+  ParseError *err = nullptr);
+
+// canonical form of a query, without parsing it: whitespace is dropped,
+// parameters are replaced with their ids and numbers are written in
+// decimal. queries with the same canonical form parse to the same clause.
+// returns false (with 'err' set) on the same lexical and parameter errors
+// as `parse_query`
+bool normalize_query(
+  const std::string& text,
+  const std::vector<id_type>& params,
+  std::string& out,
+  ParseError *err = nullptr);
+
+#endif /* __PARSER_H__ */
@@ -0,0 +1,151 @@
+#include "all_the_tags/plan.h"
+#include "all_the_tags/context.h"
+
+#include <iostream>
+
+// forward decls
+QueryClause* jit_optimize(QueryClause* clause);
+
+const char *query_engine_name(QueryEngine engine) {
+  switch(engine) {
+    case QueryEngine_Scan:  return "scan";
+    case QueryEngine_Index: return "index";
+    case QueryEngine_JIT:   return "jit";
+  }
+  return "unknown";
+}
+
+void QueryPlan::debug_print() const {
+  std::cerr <<
+    "plan(" << query_engine_name(engine) << ")" <<
+    " matches: " << est_matches <<
+    " candidates: " << est_candidates <<
+    " cost scan: " << scan_cost <<
+    " index: " << index_cost <<
+    " jit: " << jit_cost << std::endl;
+  clause->debug_print(1);
+  if(residual) {
+    std::cerr << "subtracting " << excluded.size() << " lists, then testing:" << std::endl;
+    residual->debug_print(1);
+  }
+}
+
+// the operands of the chain of 'and's at the top of 'clause'
+static void conjuncts(QueryClause *clause, std::vector<QueryClause*>& out) {
+  auto bin = dynamic_cast<QueryClauseBin*>(clause);
+  if(bin && bin->type == QueryClauseAnd) {
+    conjuncts(bin->l, out);
+    conjuncts(bin->r, out);
+  }
+  else {
+    out.push_back(clause);
+  }
+}
+
+// split the 'not's that are cheaper to subtract as posting lists than to
+// test off the top level 'and' of the plan's clause. returns the cost of
+// handling a candidate that way, or -1 if there's nothing to subtract
+static double plan_exclusions(QueryPlan *plan, const ContextStats& stats) {
+  std::vector<QueryClause*> parts;
+  conjuncts(plan->clause, parts);
+
+  std::vector<QueryClause*> kept;
+  std::vector<const Tag::entity_set*> excluded;
+  for(auto part : parts) {
+    auto not_clause = dynamic_cast<QueryClauseNot*>(part);
+    std::vector<const Tag::entity_set*> lists;
+    if(not_clause && not_clause->c->exact_postings(lists) &&
+       lists.size() * stats.index_cost < part->eval_cost(stats)) {
+      excluded.insert(excluded.end(), lists.begin(), lists.end());
+    }
+    else {
+      kept.push_back(part);
+    }
+  }
+  if(excluded.empty()) {
+    return -1;
+  }
+
+  // the others keep the order the optimizer gave them. one of them gave
+  // the candidates, so there's always at least one
+  QueryClause *residual = nullptr;
+  for(auto part : kept) {
+    residual = residual ? build_and(residual, part->dup()) : part->dup();
+  }
+  assert(residual);
+
+  plan->excluded.swap(excluded);
+  plan->residual = residual;
+  return plan->excluded.size() * stats.index_cost + residual->eval_cost(stats);
+}
+
+QueryPlan *plan_query(const Context& ctx, QueryClause *clause, QueryOptFlags flags) {
+  // without gathered statistics, plan using the default costs and
+  // independence between tags
+  ContextStats defaults;
+  const ContextStats *stats = ctx.stats();
+  if(!stats) {
+    defaults.num_entities = ctx.num_tags();
+    defaults.sketches = &ctx;
+    stats = &defaults;
+  }
+
+  // a clause over metanodes that are gone can't be optimized, and gives a
+  // plan that's never current
+  if(!ctx.is_current(clause)) {
+    return new QueryPlan(clause);
+  }
+
+  clause = optimize(clause, (QueryOptFlags)(flags & ~QueryOptFlags_JIT), stats);
+  auto plan = new QueryPlan(clause);
+  plan->version = ctx.plan_version();
+
+  const double num_entities = ctx.num_tags();
+  const double cost = clause->eval_cost(*stats);
+
+  plan->est_matches = clause->selectivity(*stats) * num_entities;
+  plan->scan_cost   = num_entities * cost;
+
+  if(clause->postings(plan->postings)) {
+    size_t candidates = 0;
+    for(auto list : plan->postings) { candidates += list->size(); }
+    plan->est_candidates = candidates;
+
+    const double subtract_cost = plan_exclusions(plan, *stats);
+    if(subtract_cost >= 0 && subtract_cost < cost) {
+      plan->index_cost = candidates * (stats->index_cost + subtract_cost);
+    }
+    else {
+      plan->excluded.clear();
+      delete plan->residual;
+      plan->residual = nullptr;
+      plan->index_cost = candidates * (stats->index_cost + cost);
+    }
+  }
+  else {
+    plan->postings.clear();
+    plan->est_candidates = num_entities;
+  }
+
+  if(flags & QueryOptFlags_JIT) {
+    // compiling mostly saves the dispatch through the interior nodes
+    double saved = clause->num_children() * stats->node_cost * (1.0 - stats->jit_node_factor);
+    plan->jit_cost = stats->jit_compile_cost + num_entities * std::max(0.0, cost - saved);
+  }
+
+  double best = plan->scan_cost;
+  if(plan->index_cost >= 0 && plan->index_cost < best) {
+    best = plan->index_cost;
+    plan->engine = QueryEngine_Index;
+  }
+  if(plan->jit_cost >= 0 && plan->jit_cost < best) {
+    best = plan->jit_cost;
+    plan->engine = QueryEngine_JIT;
+  }
+
+  if(plan->engine == QueryEngine_JIT) {
+    plan->jit = jit_optimize(clause);
+  }
+
+  return plan;
+}
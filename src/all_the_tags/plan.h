@@ -0,0 +1,94 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <vector>
+
+#include "all_the_tags/query.h"
+#include "all_the_tags/stats.h"
+
+struct Context;
+
+// how `Context::query` runs a planned query
+enum QueryEngine {
+  QueryEngine_Scan,  // test every entity against the clause
+  QueryEngine_Index, // test only the entities in the clause's posting lists
+  QueryEngine_JIT    // test every entity against the JIT compiled clause
+};
+
+const char *query_engine_name(QueryEngine engine);
+
+struct QueryPlan {
+  // the optimized clause, and its compiled form if the JIT engine was chosen
+  QueryClause *clause;
+  QueryClause *jit;
+
+  QueryEngine engine;
+
+  // posting lists that the index engine visits
+  std::vector<const Tag::entity_set*> postings;
+
+  // posting lists of the 'not's in the clause's top level 'and' that the
+  // index engine subtracts from the candidates (an entity in any of them
+  // can't match), and what's left of the clause to test the rest with.
+  // 'residual' is null if nothing is subtracted
+  std::vector<const Tag::entity_set*> excluded;
+  QueryClause *residual;
+
+  // estimates the engine was chosen from (costs are in ns, negative if
+  // the engine wasn't available for the query)
+  double est_matches;
+  double est_candidates;
+  double scan_cost;
+  double index_cost;
+  double jit_cost;
+
+  // the context's plan version the plan was built at. `Context::query`
+  // refuses to run it once that's changed (see `Context::plan_version`)
+  uint64_t version;
+
+  QueryPlan(QueryClause *clause_) :
+    clause(clause_),
+    jit(nullptr),
+    engine(QueryEngine_Scan),
+    residual(nullptr),
+    est_matches(0),
+    est_candidates(0),
+    scan_cost(0),
+    index_cost(-1),
+    jit_cost(-1),
+    version(0)
+    {}
+  QueryPlan(const QueryPlan&) = delete;
+  ~QueryPlan() {
+    delete clause;
+    delete jit;
+    delete residual;
+  }
+
+  // the clause entities are tested against
+  const QueryClause *exec_clause() const {
+    return jit ? jit : clause;
+  }
+
+  // the clause the index engine tests the candidates that weren't
+  // subtracted against
+  const QueryClause *candidate_clause() const {
+    return residual ? residual : exec_clause();
+  }
+
+  bool is_excluded(Tag *e) const {
+    for(auto list : excluded) {
+      if(list->count(e)) return true;
+    }
+    return false;
+  }
+
+  void debug_print() const;
+};
+
+// optimize 'clause' using the context's statistics (see `Context::analyze`)
+// and choose the cheapest engine to run it with. the plan takes ownership
+// of 'clause'. the JIT engine is only considered if 'flags' asks for it
+QueryPlan *plan_query(const Context& ctx, QueryClause *clause, QueryOptFlags flags = QueryOptFlags_Default);
+
+#endif /* __PLAN_H__ */
@@ -0,0 +1,52 @@
+#include "all_the_tags/plan_cache.h"
+#include "all_the_tags/context.h"
+
+const QueryPlan *PlanCache::get(
+  const std::string& text,
+  const std::vector<id_type>& params,
+  ParseError *err
+) {
+  if(version != ctx.plan_version()) {
+    clear();
+    version = ctx.plan_version();
+  }
+
+  std::string key;
+  if(!normalize_query(text, params, key, err)) {
+    return nullptr;
+  }
+
+  auto iter = by_key.find(key);
+  if(iter != by_key.end()) {
+    hits++;
+    lru.splice(lru.begin(), lru, iter->second);
+    return iter->second->plan;
+  }
+
+  QueryClause *clause = parse_query(ctx, text, params, err);
+  if(!clause) {
+    return nullptr;
+  }
+
+  misses++;
+  auto plan = plan_query(ctx, clause, flags);
+  lru.push_front(Entry{key, plan});
+  by_key[lru.front().key] = lru.begin();
+
+  while(lru.size() > capacity) {
+    auto& oldest = lru.back();
+    by_key.erase(oldest.key);
+    delete oldest.plan;
+    lru.pop_back();
+  }
+
+  return plan;
+}
+
+void PlanCache::clear() {
+  for(auto&& entry : lru) {
+    delete entry.plan;
+  }
+  lru.clear();
+  by_key.clear();
+}
@@ -0,0 +1,72 @@
+#ifndef __PLAN_CACHE_H__
+#define __PLAN_CACHE_H__
+
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "all_the_tags/plan.h"
+#include "all_the_tags/parser.h"
+
+struct Context;
+
+// least recently used cache of query text -> planned query, so repeated
+// queries skip parsing, optimizing and JIT compiling. queries are keyed
+// on their normalized text (see `normalize_query`), with parameters
+// filled in. the whole cache is dropped when `Context::plan_version`
+// changes, e.g. when the metagraph changes or a tag is destroyed
+struct PlanCache {
+  PlanCache(const Context& ctx_, size_t capacity_ = 256, QueryOptFlags flags_ = QueryOptFlags_Default) :
+    ctx(ctx_),
+    capacity(capacity_),
+    flags(flags_),
+    version(0),
+    hits(0),
+    misses(0)
+  {
+    assert(capacity > 0);
+  }
+  PlanCache(const PlanCache&) = delete;
+  ~PlanCache() {
+    clear();
+  }
+
+  // the plan for a query, parsed and planned on its first use. returns
+  // null (with 'err' set, if given) if the query can't be parsed.
+  // the plan is owned by the cache, and is valid until it's evicted by a
+  // later call to `get` or the cache is cleared
+  const QueryPlan *get(
+    const std::string& text,
+    const std::vector<id_type>& params = std::vector<id_type>(),
+    ParseError *err = nullptr);
+
+  void clear();
+
+  size_t size() const {
+    return lru.size();
+  }
+
+  const Context& ctx;
+  const size_t capacity;
+  const QueryOptFlags flags;
+
+private:
+  struct Entry {
+    std::string key;
+    QueryPlan *plan;
+  };
+
+  // most recently used at the front
+  std::list<Entry> lru;
+  std::unordered_map<std::string, std::list<Entry>::iterator> by_key;
+
+  // the context's plan version the cached plans were built at
+  uint64_t version;
+
+public:
+  size_t hits;
+  size_t misses;
+};
+
+#endif /* __PLAN_CACHE_H__ */
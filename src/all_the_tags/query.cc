@@ -12,6 +12,60 @@
 int QueryClauseMetaNode::entity_count() const {
   return node->entity_count();
 }
+double QueryClauseMetaNode::selectivity(const ContextStats& stats) const {
+  if(stats.num_entities == 0) return 0;
+  if(stats.sketches) {
+    // entities with more than one of the tags are only counted once
+    return std::min(1.0, stats.sketches->approx_count(this) / stats.num_entities);
+  }
+  return std::min(1.0, (double)node->entity_count() / stats.num_entities);
+}
+bool QueryClauseMetaNode::postings(std::vector<const Tag::entity_set*>& out) const {
+  for(auto t : node->tags) {
+    out.push_back(&(t->entities));
+  }
+  return true;
+}
+int QueryClauseMetaSet::entity_count() const {
+  if(closure) return closure->size();
+  int sum = 0;
+  for(auto node : nodes) { sum += node->entity_count(); }
+  return sum;
+}
+double QueryClauseMetaSet::selectivity(const ContextStats& stats) const {
+  if(stats.num_entities == 0) return 0;
+  if(closure) {
+    // counted exactly, other than for the rel mask
+    return std::min(1.0, (double)closure->size() / stats.num_entities);
+  }
+  if(stats.sketches) {
+    return std::min(1.0, stats.sketches->approx_count(this) / stats.num_entities);
+  }
+  return std::min(1.0, (double)entity_count() / stats.num_entities);
+}
+bool QueryClauseMetaSet::postings(std::vector<const Tag::entity_set*>& out) const {
+  if(closure) {
+    out.push_back(closure);
+    return true;
+  }
+  for(auto node : nodes) {
+    for(auto t : node->tags) {
+      out.push_back(&(t->entities));
+    }
+  }
+  return true;
+}
+void QueryClauseMetaSet::debug_print(int indent) const {
+  print_indent(indent);
+  std::cerr << "metaset(" << entity_count() << ") (";
+  std::cerr << std::bitset<8>(rel);
+  std::cerr << ") : ";
+  for(auto node : nodes) {
+    node->print_tag_set(std::cerr);
+  }
+  std::cerr << std::endl;
+}
+
 void QueryClauseMetaNode::debug_print(int indent) const {
   print_indent(indent);
   std::cerr << "meta(" << entity_count() << ") (";
@@ -29,28 +83,12 @@ QueryClause *build_lit(Tag *tag, rel_type rel) {
   QueryClause *clause = nullptr;
 
   if(tag->meta_node()) {
-    // if tag has a metanode, query against it rather than
-    // the literal tag
-
-    // collect all metanodes that imply this metanode
-    std::unordered_set<SCCMetaNode*> meta_nodes;
-
-    std::function<void(SCCMetaNode*)> recurse = [&](SCCMetaNode *node) {
-      assert(node);
-      meta_nodes.insert(node);
-      for(auto parent : node->parents) {
-        recurse(parent);
-      }
-    };
-
-    // collect all reachable metanodes from this node into meta_nodes
-    recurse(tag->meta_node());
-
-    for(auto node : meta_nodes) {
-      auto built = new QueryClauseMetaNode(node, rel);
-      if(!clause) { clause = built; }
-      else        { clause = build_or(clause, built); }
-    }
+    // if tag has a metanode, query against every metanode that
+    // implies it rather than the literal tag
+    auto set = new QueryClauseMetaSet(tag->context->ancestors(tag->meta_node()), rel, tag);
+    set->closure = tag->context->closure_set(tag->meta_node());
+    set->version = tag->context->metagraph_version();
+    clause = set;
   }
   else {
     // if literal tag is only one on it, query against it
@@ -70,17 +108,115 @@ QueryClauseNot *build_not(QueryClause *c) {
   return new QueryClauseNot(c);
 }
 
+bool QueryClauseBin::exact_postings(std::vector<const Tag::entity_set*>& out) const {
+  // the entities matching both sides of an 'and' aren't a union of lists
+  if(type != QueryClauseOr) return false;
+
+  std::vector<const Tag::entity_set*> l_lists, r_lists;
+  if(!l->exact_postings(l_lists) || !r->exact_postings(r_lists)) return false;
+  out.insert(out.end(), l_lists.begin(), l_lists.end());
+  out.insert(out.end(), r_lists.begin(), r_lists.end());
+  return true;
+}
+
+bool QueryClauseBin::postings(std::vector<const Tag::entity_set*>& out) const {
+  std::vector<const Tag::entity_set*> l_lists, r_lists;
+  bool have_l = l->postings(l_lists);
+  bool have_r = r->postings(r_lists);
+
+  if(type == QueryClauseOr) {
+    // a match can come from either side, so both need to be indexed
+    if(!have_l || !have_r) return false;
+    out.insert(out.end(), l_lists.begin(), l_lists.end());
+    out.insert(out.end(), r_lists.begin(), r_lists.end());
+    return true;
+  }
+
+  // a match has to be in both sides, so either side bounds the result;
+  // drive from whichever has fewer candidates
+  if(!have_l && !have_r) return false;
+
+  auto num_candidates = [](const std::vector<const Tag::entity_set*>& lists) {
+    size_t sum = 0;
+    for(auto list : lists) { sum += list->size(); }
+    return sum;
+  };
+
+  const auto& best =
+    !have_r ? l_lists :
+    !have_l ? r_lists :
+    (num_candidates(l_lists) <= num_candidates(r_lists) ? l_lists : r_lists);
+  out.insert(out.end(), best.begin(), best.end());
+  return true;
+}
+
+// the tag that a clause tests for, if it only tests for a single tag
+static const Tag *single_tag(const QueryClause *clause) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    return lit->t;
+  }
+  if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    if(meta->node->tags.size() == 1) return *(meta->node->tags.begin());
+  }
+  if(auto metaset = dynamic_cast<const QueryClauseMetaSet*>(clause)) {
+    if(metaset->nodes.size() == 1) {
+      auto node = *(metaset->nodes.begin());
+      if(node->tags.size() == 1) return *(node->tags.begin());
+    }
+  }
+  return nullptr;
+}
+
+static bool is_leaf(const QueryClause *clause) {
+  return
+    dynamic_cast<const QueryClauseLit*>(clause) ||
+    dynamic_cast<const QueryClauseMetaNode*>(clause) ||
+    dynamic_cast<const QueryClauseMetaSet*>(clause);
+}
+
+double and_selectivity(const QueryClause *l, const QueryClause *r, const ContextStats& stats) {
+  double l_sel = l->selectivity(stats);
+  double r_sel = r->selectivity(stats);
+
+  auto l_tag = single_tag(l);
+  auto r_tag = single_tag(r);
+  if(l_tag && r_tag) {
+    double both = stats.pair_frequency(l_tag, r_tag);
+    if(both >= 0) {
+      return std::min(both, std::min(l_sel, r_sel));
+    }
+  }
+
+  if(stats.sketches && stats.num_entities && is_leaf(l) && is_leaf(r)) {
+    // sample the smaller side's sketch for entities matching both
+    double both = stats.sketches->approx_and_count(l, r) / stats.num_entities;
+    return std::min(both, std::min(l_sel, r_sel));
+  }
+
+  // nothing known about the pair, assume they're independent
+  return l_sel * r_sel;
+}
+
+double or_selectivity(const QueryClause *l, const QueryClause *r, const ContextStats& stats) {
+  double sel = l->selectivity(stats) + r->selectivity(stats) - and_selectivity(l, r, stats);
+  return std::max(0.0, std::min(1.0, sel));
+}
+
 // forward decls
-QueryClause* hc_tree_optimize(QueryClauseBin* clause);
+QueryClause* hc_tree_optimize(QueryClauseBin* clause, const ContextStats *stats);
 QueryClause* jit_optimize(QueryClause* clause);
 
-QueryClause *optimize(QueryClause *clause, QueryOptFlags flags) {
+QueryClause *optimize(QueryClause *clause, QueryOptFlags flags, const ContextStats *stats) {
+
+  if(flags & QueryOptFlags_Simplify) {
+    clause = simplify(clause);
+  }
 
   if(flags & QueryOptFlags_Reorder) {
     auto cast_bin = dynamic_cast<QueryClauseBin*>(clause);
     // not a binary clause; ignore
     if(cast_bin) {
-      clause = hc_tree_optimize(cast_bin);
+      clause = hc_tree_optimize(cast_bin, stats);
     }
   }
 
@@ -96,20 +232,30 @@ QueryClause *optimize(QueryClause *clause, QueryOptFlags flags) {
 class QueryClauseCompare
 {
   QueryClauseBinType type;
+
+  // a 'not' matches the entities its child doesn't, so it's ordered as if
+  // it matched everything rather than by its child's count, and never
+  // goes first in an 'and'
+  static long count(const QueryClause *c) {
+    if(dynamic_cast<const QueryClauseNot*>(c)) {
+      return QueryClauseAny().entity_count();
+    }
+    return c->entity_count();
+  }
 public:
   QueryClauseCompare(QueryClauseBinType type_) : type(type_) {}
   bool operator() (const QueryClause* l, const QueryClause* r) const {
     if(type == QueryClauseAnd) {
       // reverse priority (lower entites at top) for left
-      return l->entity_count() > r->entity_count();
+      return count(l) > count(r);
     }
     else {
-      return l->entity_count() < r->entity_count();
+      return count(l) < count(r);
     }
   }
 };
 
-QueryClause* hc_tree_optimize(QueryClauseBin* clause) {
+QueryClause* hc_tree_optimize(QueryClauseBin* clause, const ContextStats *stats) {
   // used when building the HC tree
   std::priority_queue<
     QueryClause*,
@@ -190,25 +336,64 @@ QueryClause* hc_tree_optimize(QueryClauseBin* clause) {
     if(!leaf) continue;
 
     auto old_count = leaf->entity_count();
-    leaf = optimize(leaf);
+    leaf = optimize(leaf, QueryOptFlags_Reorder, stats);
     assert(old_count == leaf->entity_count());
   }
 
-  // insert all the leafs into the priority queue
-  for(auto leaf : unsorted_leafs) {
-    if(!leaf) continue;
+  QueryClause *root = nullptr;
 
-    queued_leafs.push(leaf);
+  if(stats) {
+    // rank each leaf by its cost per entity that it decides the clause for
+    // (entities it rejects for an 'and', accepts for an 'or'), and chain
+    // them so the lowest ranked is evaluated first
+    auto rank = [&](const QueryClause *leaf) {
+      double sel = leaf->selectivity(*stats);
+      double decides = (clause->type == QueryClauseAnd) ? (1.0 - sel) : sel;
+      return leaf->eval_cost(*stats) / std::max(decides, 1e-9);
+    };
+
+    std::vector<std::pair<double, QueryClause*>> ranked;
+    for(auto leaf : unsorted_leafs) {
+      if(!leaf) continue;
+      ranked.push_back(std::make_pair(rank(leaf), leaf));
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+      [](const std::pair<double, QueryClause*>& a, const std::pair<double, QueryClause*>& b) {
+        return a.first < b.first;
+      });
+
+    for(auto&& pair : ranked) {
+      if(!root) {
+        root = pair.second;
+      }
+      else {
+        auto parent = get_bin_node();
+        parent->l = root;
+        parent->r = pair.second;
+        root = parent;
+      }
+    }
   }
+  else {
+    // insert all the leafs into the priority queue
+    for(auto leaf : unsorted_leafs) {
+      if(!leaf) continue;
 
-  // build the huffman coding tree
-  while(queued_leafs.size() > 1) {
-    auto first  = queued_leafs.top(); queued_leafs.pop();
-    auto second = queued_leafs.top(); queued_leafs.pop();
-    auto parent = get_bin_node();
-    parent->l = first;
-    parent->r = second;
-    queued_leafs.push(parent);
+      queued_leafs.push(leaf);
+    }
+
+    // build the huffman coding tree
+    while(queued_leafs.size() > 1) {
+      auto first  = queued_leafs.top(); queued_leafs.pop();
+      auto second = queued_leafs.top(); queued_leafs.pop();
+      auto parent = get_bin_node();
+      parent->l = first;
+      parent->r = second;
+      queued_leafs.push(parent);
+    }
+
+    // last element in the queue is the root of the tree
+    root = queued_leafs.top();
   }
 
   // delete the unused recycled nodes
@@ -217,8 +402,7 @@ QueryClause* hc_tree_optimize(QueryClauseBin* clause) {
     recycle_bin.pop();
   }
 
-  // last element in the
-  return queued_leafs.top();
+  return root;
 }
 
 struct QueryClauseJitNode : public QueryClause {
@@ -227,12 +411,31 @@ struct QueryClauseJitNode : public QueryClause {
   typedef bool (*func_type)(const Tag::tagging_map*);
   func_type func;
 
-  QueryClauseJitNode() {}
-  virtual ~QueryClauseJitNode() {}
+  // the clause that was compiled, kept around for estimates
+  QueryClause *source;
+
+  QueryClauseJitNode(QueryClause *source_) : source(source_) {}
+  virtual ~QueryClauseJitNode() { delete source; }
 
   virtual int depth()        const { return 0; }
   virtual int num_children() const { return 0; }
-  virtual int entity_count() const { return 0; }
+  virtual int entity_count() const { return source->entity_count(); }
+
+  virtual double selectivity(const ContextStats& stats) const {
+    return source->selectivity(stats);
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    return source->eval_cost(stats);
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const {
+    return source->postings(out);
+  }
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    return source->exact_postings(out);
+  }
+  virtual uint64_t metagraph_version() const {
+    return source->metagraph_version();
+  }
 
   virtual bool matches_set(const Tag::tagging_map& tags) const {
     return func(&tags);
@@ -262,10 +465,17 @@ bool extern_set_has_meta(
   return QueryClauseMetaNode::matches_set(node, rel, *tags);
 }
 
+bool extern_set_has_metaset(
+  QueryClauseMetaSet const* set,
+  Tag::tagging_map const* tags
+) {
+  return QueryClauseMetaSet::matches_set(set->nodes, set->rel, *tags);
+}
+
 QueryClause* jit_optimize(QueryClause* clause) {
   using namespace asmjit;
 
-  auto ret = new QueryClauseJitNode();
+  auto ret = new QueryClauseJitNode(clause->dup());
 
   X86Assembler a(&(ret->runtime));
   X86Compiler c(&a);
@@ -278,8 +488,10 @@ QueryClause* jit_optimize(QueryClause* clause) {
 
   X86GpVar has_tag_func_ptr = c.newIntPtr("tag_fn");
   X86GpVar has_meta_func_ptr = c.newIntPtr("meta_fn");
+  X86GpVar has_metaset_func_ptr = c.newIntPtr("metaset_fn");
   c.mov(has_tag_func_ptr, imm_ptr((void*)extern_set_has_tag));
   c.mov(has_meta_func_ptr, imm_ptr((void*)extern_set_has_meta));
+  c.mov(has_metaset_func_ptr, imm_ptr((void*)extern_set_has_metaset));
 
   std::function<void(const QueryClause*, X86GpVar&)> codegen_tree =
     [&](QueryClause const* clause, X86GpVar& res_var)
@@ -315,9 +527,20 @@ QueryClause* jit_optimize(QueryClause* clause) {
       call->setArg(2, tag_set_ptr);
       call->setRet(0, res_var);
     }
+    else if(auto metaset = dynamic_cast<const QueryClauseMetaSet*>(clause)) {
+      // the set is owned by the JIT node's own copy of the clause, which
+      // lives as long as the code
+      X86CallNode* call = c.call(has_metaset_func_ptr, FuncBuilder2<int, QueryClauseMetaSet*, int*>(kCallConvHost));
+      call->setArg(0, imm_ptr(metaset));
+      call->setArg(1, tag_set_ptr);
+      call->setRet(0, res_var);
+    }
     else if(auto any = dynamic_cast<const QueryClauseAny*>(clause)) {
       c.mov(res_var, 1);
     }
+    else if(dynamic_cast<const QueryClauseNone*>(clause)) {
+      c.mov(res_var, 0);
+    }
     else if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
       codegen_tree(not_->c, res_var);
       c.xor_(res_var, 1);
@@ -328,7 +551,8 @@ QueryClause* jit_optimize(QueryClause* clause) {
     }
   };
 
-  codegen_tree(clause, test_var);
+  // from the node's copy, not 'clause', which the caller may delete
+  codegen_tree(ret->source, test_var);
   c.ret(test_var);
   c.endFunc();
   c.finalize();
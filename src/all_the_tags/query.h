@@ -5,8 +5,11 @@
 #include <algorithm>
 #include <iostream>
 #include <bitset>
+#include <vector>
+#include <string>
 
 #include "all_the_tags/tag.h"
+#include "all_the_tags/stats.h"
 
 struct QueryClause;
 struct QueryClauseBin;
@@ -14,8 +17,11 @@ struct QueryClauseNot;
 struct SCCMetaNode;
 
 enum QueryOptFlags {
-  QueryOptFlags_Reorder = 0x1,
-  QueryOptFlags_JIT     = 0x2
+  QueryOptFlags_Reorder  = 0x1,
+  QueryOptFlags_JIT      = 0x2,
+  QueryOptFlags_Simplify = 0x4,
+
+  QueryOptFlags_Default  = QueryOptFlags_Reorder | QueryOptFlags_Simplify
 };
 
 QueryClause    *build_lit(Tag *tag);
@@ -23,7 +29,29 @@ QueryClause    *build_lit(Tag *tag, rel_type rel_mask);
 QueryClauseBin *build_and(QueryClause *r, QueryClause *l);
 QueryClauseBin *build_or (QueryClause *r, QueryClause *l);
 QueryClauseNot *build_not(QueryClause *c);
-QueryClause    *optimize(QueryClause *clause, QueryOptFlags flags = QueryOptFlags_Reorder);
+// if 'stats' is given, children are ordered by their expected cost per
+// eliminated entity rather than by their raw entity counts
+QueryClause    *optimize(QueryClause *clause, QueryOptFlags flags = QueryOptFlags_Default,
+                         const ContextStats *stats = nullptr);
+
+// boolean rewrites that don't change what the clause matches: folds
+// any/none and double negation, pushes negation through 'or', removes
+// duplicate and absorbed operands, detects contradictions and factors
+// common terms out of an 'or' of 'and's
+QueryClause    *simplify(QueryClause *clause);
+
+// true if every entity matching 'x' also matches 'y'. this can miss some
+// implications, but never claims one that doesn't hold
+bool            clause_implies(const QueryClause *x, const QueryClause *y);
+
+// canonical text for a clause, equal for clauses that only differ in the
+// order or grouping of 'and'/'or' operands
+std::string     clause_key(const QueryClause *clause);
+
+// estimated fraction of entities matching both/either of the clauses,
+// using the sampled co-occurrence of frequent tags where it's known
+double and_selectivity(const QueryClause *l, const QueryClause *r, const ContextStats& stats);
+double or_selectivity (const QueryClause *l, const QueryClause *r, const ContextStats& stats);
 
 // root clause AST type
 struct QueryClause {
@@ -36,6 +64,43 @@ struct QueryClause {
   virtual int entity_count() const = 0;
   virtual QueryClause *dup() const = 0;
 
+  // estimated fraction of entities that match the clause
+  virtual double selectivity(const ContextStats& stats) const = 0;
+  // estimated cost (in ns) of evaluating the clause against one entity
+  virtual double eval_cost(const ContextStats& stats) const = 0;
+
+  // collect posting lists whose union is a superset of the entities that
+  // match the clause. returns false if the clause can't use the index
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const {
+    (void)out;
+    return false;
+  }
+
+  // collect posting lists whose union is exactly the entities that match
+  // the clause, so they can be subtracted from the candidates of an 'and'
+  // it's negated in. returns false if there aren't any
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    (void)out;
+    return false;
+  }
+
+  // the oldest `Context::metagraph_version` any of the clause's metanodes
+  // were taken from, or 0 if it doesn't refer to any
+  virtual uint64_t metagraph_version() const {
+    return 0;
+  }
+
+  double estimate_count(const ContextStats& stats) const {
+    return selectivity(stats) * stats.num_entities;
+  }
+
+  // the older of two versions from `metagraph_version`
+  static uint64_t oldest_version(uint64_t a, uint64_t b) {
+    if(!a) return b;
+    if(!b) return a;
+    return std::min(a, b);
+  }
+
   virtual void debug_print(int indent = 0) const = 0;
 protected:
   void print_indent(int indent) const {
@@ -59,6 +124,18 @@ struct QueryClauseNot : public QueryClause {
   virtual int depth()        const { return c->depth() + 1;        }
   virtual int num_children() const { return c->num_children() + 1; }
   virtual int entity_count() const { return c->entity_count();     }
+
+  virtual double selectivity(const ContextStats& stats) const {
+    return 1.0 - c->selectivity(stats);
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    return stats.node_cost + c->eval_cost(stats);
+  }
+
+  virtual uint64_t metagraph_version() const {
+    return c->metagraph_version();
+  }
+
   virtual QueryClauseNot *dup() const {
     return new QueryClauseNot(c->dup());
   }
@@ -94,7 +171,8 @@ struct QueryClauseBin : public QueryClause {
       return l->matches_set(tags) && r->matches_set(tags);
     }
     else {
-      return r->matches_set(tags) || l->matches_set(tags);
+      // left first, the same order the JIT and the optimizer assume
+      return l->matches_set(tags) || r->matches_set(tags);
     }
   }
 
@@ -109,6 +187,27 @@ struct QueryClauseBin : public QueryClause {
     }
   }
 
+  virtual double selectivity(const ContextStats& stats) const {
+    if(type == QueryClauseAnd) {
+      return and_selectivity(l, r, stats);
+    }
+    else {
+      return or_selectivity(l, r, stats);
+    }
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    // 'r' is only evaluated if 'l' doesn't short circuit
+    double l_sel = l->selectivity(stats);
+    double r_prob = (type == QueryClauseAnd) ? l_sel : (1.0 - l_sel);
+    return stats.node_cost + l->eval_cost(stats) + r_prob * r->eval_cost(stats);
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const;
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const;
+
+  virtual uint64_t metagraph_version() const {
+    return oldest_version(l->metagraph_version(), r->metagraph_version());
+  }
+
   virtual QueryClauseBin *dup() const {
     return new QueryClauseBin(type, l->dup(), r->dup());
   }
@@ -150,6 +249,23 @@ struct QueryClauseLit : public QueryClause {
   virtual int depth()        const { return 0; }
   virtual int num_children() const { return 0; }
   virtual int entity_count() const { return t->entity_count(); }
+
+  virtual double selectivity(const ContextStats& stats) const {
+    return stats.tag_freq(t);
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    return stats.lit_cost;
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const {
+    out.push_back(&(t->entities));
+    return true;
+  }
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    // an entity's rel is never 0, so only a mask testing for some rels
+    // leaves out entities from the list
+    return rel_mask == ALL_REL_MASK && postings(out);
+  }
+
   virtual QueryClauseLit *dup() const {
     return new QueryClauseLit(t, rel_mask);
   }
@@ -164,7 +280,11 @@ struct QueryClauseMetaNode : public QueryClause {
   SCCMetaNode* node;
   rel_type rel;
 
-  QueryClauseMetaNode(SCCMetaNode *node_, rel_type rel_) : node(node_), rel(rel_) {}
+  // the context's metagraph version 'node' was taken from (0 if unknown)
+  uint64_t version;
+
+  QueryClauseMetaNode(SCCMetaNode *node_, rel_type rel_, uint64_t version_ = 0) :
+    node(node_), rel(rel_), version(version_) {}
   virtual ~QueryClauseMetaNode() { node = nullptr; }
 
   virtual bool matches_set(const Tag::tagging_map& tags) const {
@@ -188,8 +308,87 @@ struct QueryClauseMetaNode : public QueryClause {
   virtual int depth()        const { return 0; }
   virtual int num_children() const { return 0; }
   virtual int entity_count() const;
+
+  virtual double selectivity(const ContextStats& stats) const;
+  virtual double eval_cost(const ContextStats& stats) const {
+    return stats.meta_cost_per_tag * stats.avg_tags_per_entity;
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const;
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    return rel == ALL_REL_MASK && postings(out);
+  }
+
+  virtual uint64_t metagraph_version() const {
+    return version;
+  }
+
   virtual QueryClauseMetaNode *dup() const {
-    return new QueryClauseMetaNode(node, rel);
+    return new QueryClauseMetaNode(node, rel, version);
+  }
+
+  virtual void debug_print(int indent = 0) const;
+};
+
+// matches entities with a tag in any of a set of metanodes (e.g. all of the
+// metanodes that imply a tag), testing each of the entity's tags once
+// rather than scanning the entity's tags once per metanode
+struct QueryClauseMetaSet : public QueryClause {
+  using node_set = std::unordered_set<const SCCMetaNode*>;
+  node_set nodes;
+  rel_type rel;
+
+  // the tag the set was built for by build_lit (its metanode and every
+  // metanode implying it), or null if the set is made up of other nodes
+  Tag *origin;
+
+  // every entity with a tag in 'nodes', if the origin's metanode keeps
+  // them (see `Context::closure_set`), or null
+  const Tag::entity_set *closure;
+
+  // the context's metagraph version 'nodes' were taken from (0 if unknown)
+  uint64_t version;
+
+  QueryClauseMetaSet(const node_set& nodes_, rel_type rel_, Tag *origin_ = nullptr,
+    const Tag::entity_set *closure_ = nullptr, uint64_t version_ = 0) :
+    nodes(nodes_), rel(rel_), origin(origin_), closure(closure_), version(version_) {}
+  virtual ~QueryClauseMetaSet() {}
+
+  virtual bool matches_set(const Tag::tagging_map& tags) const {
+    return QueryClauseMetaSet::matches_set(nodes, rel, tags);
+  }
+
+  static inline bool matches_set(const node_set& nodes, const rel_type rel, const Tag::tagging_map& tags) {
+    for(auto t : tags) {
+      if(!(t.second & rel)) continue;
+
+      auto node = t.first->meta_node();
+      if(node && nodes.count(node)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  virtual int depth()        const { return 0; }
+  virtual int num_children() const { return 0; }
+  virtual int entity_count() const;
+
+  virtual double selectivity(const ContextStats& stats) const;
+  virtual double eval_cost(const ContextStats& stats) const {
+    return stats.metaset_cost_per_tag * stats.avg_tags_per_entity;
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const;
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    return rel == ALL_REL_MASK && postings(out);
+  }
+
+  virtual uint64_t metagraph_version() const {
+    return version;
+  }
+
+  virtual QueryClauseMetaSet *dup() const {
+    return new QueryClauseMetaSet(nodes, rel, origin, closure, version);
   }
 
   virtual void debug_print(int indent = 0) const;
@@ -209,6 +408,14 @@ struct QueryClauseAny : public QueryClause {
   virtual int num_children() const { return 0; }
   virtual int entity_count() const { return 999999999; }
 
+  virtual double selectivity(const ContextStats& stats) const {
+    (void)stats;
+    return 1.0;
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    return stats.node_cost;
+  }
+
   virtual void debug_print(int indent = 0) const {
     print_indent(indent);
     std::cerr << "any(999999999)" << std::endl;
@@ -219,4 +426,44 @@ struct QueryClauseAny : public QueryClause {
   }
 };
 
+// represents a clause that can't match anything (e.g. a contradiction)
+struct QueryClauseNone : public QueryClause {
+  virtual bool matches_set(const Tag::tagging_map& tags) const {
+    (void)tags;
+    return false;
+  }
+
+  QueryClauseNone() {}
+  virtual ~QueryClauseNone() {}
+
+  virtual int depth()        const { return 0; }
+  virtual int num_children() const { return 0; }
+  virtual int entity_count() const { return 0; }
+
+  virtual double selectivity(const ContextStats& stats) const {
+    (void)stats;
+    return 0.0;
+  }
+  virtual double eval_cost(const ContextStats& stats) const {
+    return stats.node_cost;
+  }
+  virtual bool postings(std::vector<const Tag::entity_set*>& out) const {
+    // nothing to visit
+    (void)out;
+    return true;
+  }
+  virtual bool exact_postings(std::vector<const Tag::entity_set*>& out) const {
+    return postings(out);
+  }
+
+  virtual void debug_print(int indent = 0) const {
+    print_indent(indent);
+    std::cerr << "none(0)" << std::endl;
+  }
+
+  virtual QueryClauseNone* dup() const {
+    return new QueryClauseNone();
+  }
+};
+
 #endif /* __QUERY_H__ */
@@ -0,0 +1,153 @@
+#include "all_the_tags/context.h"
+#include "all_the_tags/tag.h"
+
+// the labels are two intervals per metanode. metanodes only reach those
+// after them in the topological order, up to their 'reach_high', so a
+// metanode outside of that interval isn't reachable. and a depth first
+// search numbers the metanodes so that those in a metanode's subtree of
+// the search's spanning forest, which are all reachable, come in one
+// range. it's only the pairs in between that have to be searched for,
+// following the edges that aren't in the forest
+
+// label every metanode in a depth first search of the metagraph
+void Context::build_reach_index() {
+  reach_nodes_.clear();
+  reach_nodes_.reserve(meta_nodes.size());
+  for(auto node : meta_nodes) {
+    node->tree_parent = nullptr;
+    node->tree_end = 0;
+  }
+
+  using frame = std::pair<SCCMetaNode*, std::unordered_set<SCCMetaNode*>::const_iterator>;
+  std::vector<frame> frames;
+  auto visit = [&](SCCMetaNode *node, SCCMetaNode *parent) {
+    node->tree_parent = parent;
+    node->tree_begin = reach_nodes_.size();
+    node->tree_end = node->tree_begin + 1; // marks it visited
+    node->reach_high = node->order;
+    reach_nodes_.push_back(node);
+    frames.push_back(std::make_pair(node, node->children.cbegin()));
+  };
+
+  // every metanode can be reached from one without parents
+  for(auto root : meta_nodes) {
+    if(root->parents.size()) continue;
+    visit(root, nullptr);
+
+    while(frames.size()) {
+      auto node = frames.back().first;
+      auto& next_child = frames.back().second;
+
+      if(next_child != node->children.cend()) {
+        auto child = *(next_child++);
+        if(!child->tree_end) visit(child, node);
+        else node->reach_high = std::max(node->reach_high, child->reach_high);
+        continue;
+      }
+
+      // done with the subtree, which is finished with before returning to
+      // the parent: the metagraph doesn't have any cycles
+      frames.pop_back();
+      node->tree_end = reach_nodes_.size();
+      if(frames.size()) {
+        auto parent = frames.back().first;
+        parent->reach_high = std::max(parent->reach_high, node->reach_high);
+      }
+    }
+  }
+
+  assert(reach_nodes_.size() == meta_nodes.size());
+  reach_index_valid_ = true;
+}
+
+bool Context::reaches_indexed(const SCCMetaNode *from, const SCCMetaNode *to) const {
+  assert(reach_index_valid_);
+  if(from == to) return true;
+
+  auto out_of_reach = [to](const SCCMetaNode *node) {
+    return to->order < node->order || to->order > node->reach_high;
+  };
+  auto in_subtree = [to](const SCCMetaNode *node) {
+    return node->tree_begin <= to->tree_begin && to->tree_begin < node->tree_end;
+  };
+
+  if(out_of_reach(from)) return false;
+  if(in_subtree(from)) return true;
+
+  std::unordered_set<const SCCMetaNode*> seen;
+  std::vector<const SCCMetaNode*> stack;
+  stack.push_back(from);
+  while(stack.size()) {
+    auto node = stack.back();
+    stack.pop_back();
+    for(auto child : node->children) {
+      if(out_of_reach(child)) continue;
+      if(in_subtree(child)) return true;
+      if(seen.insert(child).second) stack.push_back(child);
+    }
+  }
+  return false;
+}
+
+// 'from' gained the child 'to', without the order changing. what reaches
+// 'from' now reaches as far as 'to' does, and the spanning forest stays
+void Context::reach_edge_added(SCCMetaNode *from, SCCMetaNode *to) {
+  reach_version_++;
+  if(!reach_index_valid_) return;
+
+  std::vector<SCCMetaNode*> stack;
+  stack.push_back(from);
+  while(stack.size()) {
+    auto node = stack.back();
+    stack.pop_back();
+    if(node->reach_high >= to->reach_high) continue;
+
+    node->reach_high = to->reach_high;
+    stack.insert(stack.end(), node->parents.begin(), node->parents.end());
+  }
+}
+
+bool Context::reaches(const SCCMetaNode *from, const SCCMetaNode *to) {
+  assert(from && to);
+  if(!reach_index_valid_) build_reach_index();
+  return reaches_indexed(from, to);
+}
+
+bool Context::implies(Tag *tag, Tag *other) {
+  if(tag == other) return true;
+
+  // tags without a metanode don't imply anything
+  auto from = tag->meta_node(), to = other->meta_node();
+  return from && to && reaches(from, to);
+}
+
+void Context::descendants(const SCCMetaNode *node, std::vector<SCCMetaNode*>& out) {
+  assert(node);
+  if(!reach_index_valid_) build_reach_index();
+
+  // each metanode reached brings its whole subtree along, after which only
+  // the edges leaving the subtree need following. so a metanode that's
+  // been seen has had its subtree seen too, and can be skipped over
+  std::vector<bool> seen(reach_nodes_.size());
+  std::vector<const SCCMetaNode*> stack;
+  stack.push_back(node);
+  while(stack.size()) {
+    auto top = stack.back();
+    stack.pop_back();
+
+    auto i = top->tree_begin;
+    while(i < top->tree_end) {
+      auto reached = reach_nodes_[i];
+      if(seen[i]) {
+        i = reached->tree_end;
+        continue;
+      }
+      seen[i++] = true;
+
+      out.push_back(reached);
+      for(auto child : reached->children) {
+        if(!seen[child->tree_begin]) stack.push_back(child);
+      }
+    }
+  }
+}
@@ -0,0 +1,220 @@
+#include "all_the_tags/context.h"
+#include "all_the_tags/tag.h"
+
+static bool debug = false;
+
+// keeping the metagraph transitively reduced: a metanode edge is dropped
+// when another path already leads from its parent to its child. the
+// edges left are still each backed by a tag implying another, so the
+// metanodes reach the same ones they would with every edge
+
+// does 'from' reach 'to', searching only the metanodes that come between
+// them in the order
+bool Context::reaches_searched(const SCCMetaNode *from, const SCCMetaNode *to) const {
+  if(from == to) return true;
+  if(from->order >= to->order) return false;
+
+  std::unordered_set<const SCCMetaNode*> seen;
+  std::vector<const SCCMetaNode*> stack;
+  stack.push_back(from);
+  while(stack.size()) {
+    auto node = stack.back();
+    stack.pop_back();
+    for(auto child : node->children) {
+      if(child == to) return true;
+      if(child->order < to->order && seen.insert(child).second) {
+        stack.push_back(child);
+      }
+    }
+  }
+  return false;
+}
+
+// with the labels if they're up to date, without them otherwise. the
+// labels stay true while edges are dropped without changing what reaches
+// what, even if they were in the spanning forest
+bool Context::reaches_now(const SCCMetaNode *from, const SCCMetaNode *to) const {
+  return reach_index_valid_ ? reaches_indexed(from, to) : reaches_searched(from, to);
+}
+
+// returns true if the edge was in the labels' spanning forest, which then
+// needs to be found again
+bool Context::drop_redundant_edge(SCCMetaNode *from, SCCMetaNode *to) {
+  if(debug) {
+    std::cerr << "dropping redundant SCC edge ";
+    from->print_tag_set(std::cerr) << " -> ";
+    to->print_tag_set(std::cerr) << std::endl;
+  }
+
+  const auto _removed = from->remove_child(to);
+  assert(_removed);
+  // another path leaves 'from', so it's still not a sink
+  assert(from->children.size());
+  return reach_index_valid_ && to->tree_parent == from;
+}
+
+// drops the edges of 'node' to children its other children lead to. a
+// child can only be reached through those before it in the order, and
+// one reached through a dropped child is reached through a kept one too
+bool Context::reduce_children(SCCMetaNode *node) {
+  std::vector<SCCMetaNode*> children(node->children.begin(), node->children.end());
+  std::sort(children.begin(), children.end(), [](const SCCMetaNode *a, const SCCMetaNode *b) {
+    return a->order < b->order;
+  });
+
+  bool tree_changed = false;
+  std::vector<SCCMetaNode*> kept;
+  for(auto child : children) {
+    bool redundant = false;
+    for(auto other : kept) {
+      if(reaches_now(other, child)) {
+        redundant = true;
+        break;
+      }
+    }
+
+    if(redundant) tree_changed |= drop_redundant_edge(node, child);
+    else          kept.push_back(child);
+  }
+  return tree_changed;
+}
+
+// the metanodes 'node' reaches (or those reaching it), including itself
+template<class Neighbours>
+static std::unordered_set<SCCMetaNode*> closure(SCCMetaNode *node, Neighbours neighbours) {
+  std::unordered_set<SCCMetaNode*> seen;
+  std::vector<SCCMetaNode*> stack;
+  seen.insert(node);
+  stack.push_back(node);
+  while(stack.size()) {
+    auto top = stack.back();
+    stack.pop_back();
+    for(auto next : neighbours(top)) {
+      if(seen.insert(next).second) stack.push_back(next);
+    }
+  }
+  return seen;
+}
+
+static const std::unordered_set<SCCMetaNode*>& parents_of(SCCMetaNode *node) {
+  return node->parents;
+}
+static const std::unordered_set<SCCMetaNode*>& children_of(SCCMetaNode *node) {
+  return node->children;
+}
+
+// the edge 'from' -> 'to' was added, without closing a cycle. an edge
+// from a metanode reaching 'from' to one 'to' reaches is now redundant
+// (other than the new edge itself): the path through the new edge
+// can't start with it, or there would be a cycle
+void Context::reduce_after_edge(SCCMetaNode *from, SCCMetaNode *to) {
+  const auto above = closure(from, parents_of);
+  const auto below = closure(to, children_of);
+
+  bool tree_changed = false;
+  std::vector<SCCMetaNode*> dropped;
+  for(auto node : above) {
+    dropped.clear();
+    for(auto child : node->children) {
+      if(below.count(child) && !(node == from && child == to)) {
+        dropped.push_back(child);
+      }
+    }
+    for(auto child : dropped) {
+      tree_changed |= drop_redundant_edge(node, child);
+    }
+  }
+  if(tree_changed) reach_index_valid_ = false;
+}
+
+// 'node' is the metanode a cycle collapsed into. its own edges and its
+// parents' edges to it may now be redundant, as may any edge from above
+// it to below it, by the same argument as for a new edge
+void Context::reduce_after_collapse(SCCMetaNode *node) {
+  bool tree_changed = reduce_children(node);
+  const std::vector<SCCMetaNode*> parents(node->parents.begin(), node->parents.end());
+  for(auto parent : parents) {
+    tree_changed |= reduce_children(parent);
+  }
+
+  const auto above = closure(node, parents_of);
+  const auto below = closure(node, children_of);
+  std::vector<SCCMetaNode*> dropped;
+  for(auto ancestor : above) {
+    if(ancestor == node) continue;
+    dropped.clear();
+    for(auto child : ancestor->children) {
+      if(child != node && below.count(child)) dropped.push_back(child);
+    }
+    for(auto child : dropped) {
+      tree_changed |= drop_redundant_edge(ancestor, child);
+    }
+  }
+  if(tree_changed) reach_index_valid_ = false;
+}
+
+// edges were removed from (or split off) 'nodes', so the metanodes above
+// them may no longer reach everything their tags imply through the edges
+// that were left. going up from the bottom, each one gets back the edges
+// to what it no longer reaches, then those are reduced again, as are the
+// edges of 'nodes' and their parents, which may have been added back
+void Context::restore_reduced_edges(const std::vector<SCCMetaNode*>& nodes) {
+  std::unordered_set<SCCMetaNode*> above, to_reduce;
+  for(auto node : nodes) {
+    auto node_above = closure(node, parents_of);
+    above.insert(node_above.begin(), node_above.end());
+    to_reduce.insert(node);
+    to_reduce.insert(node->parents.begin(), node->parents.end());
+  }
+
+  std::vector<SCCMetaNode*> bottom_up(above.begin(), above.end());
+  std::sort(bottom_up.begin(), bottom_up.end(), [](const SCCMetaNode *a, const SCCMetaNode *b) {
+    return a->order > b->order;
+  });
+
+  bool tree_changed = false;
+  for(auto node : bottom_up) {
+    bool restored = false;
+    for(auto tag : node->tags) {
+      for(auto implied : tag->implies) {
+        auto implied_mn = implied->meta_node();
+        if(implied_mn == node || node->children.count(implied_mn)) continue;
+        if(reaches_now(node, implied_mn)) continue;
+
+        if(debug) {
+          std::cerr << "restoring SCC edge ";
+          node->print_tag_set(std::cerr) << " -> ";
+          implied_mn->print_tag_set(std::cerr) << std::endl;
+        }
+        node->add_child(implied_mn);
+        sink_meta_nodes.erase(node);
+        restored = true;
+      }
+    }
+    if(restored || to_reduce.count(node)) tree_changed |= reduce_children(node);
+  }
+  if(tree_changed) reach_index_valid_ = false;
+}
+
+void Context::set_transitive_reduction(bool reduce) {
+  if(reduce == reduce_metagraph_) return;
+  reduce_metagraph_ = reduce;
+  if(is_dirty()) return;
+
+  metagraph_version_++;
+  plan_version_++;
+  if(reduce) {
+    // reachability doesn't change, so the labels stay true throughout
+    if(!reach_index_valid_) build_reach_index();
+    bool tree_changed = false;
+    for(auto node : meta_nodes) {
+      tree_changed |= reduce_children(node);
+    }
+    if(tree_changed) reach_index_valid_ = false;
+  }
+  else {
+    // every edge comes back with a rebuild
+    mark_dirty();
+    make_clean();
+  }
+}
@@ -0,0 +1,272 @@
+#include "all_the_tags/scc.h"
+#include "all_the_tags/thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+
+void SCCFinder::run() {
+  const uint32_t n = tags.size();
+  edge_begin.push_back(edges.size());
+
+  index_.assign(n, -1);
+  low_link_.assign(n, -1);
+  on_stack_.assign(n, 0);
+  stack_.clear();
+  frames_.clear();
+  component_begin.clear();
+  component_tags.clear();
+  component_of.assign(n, 0);
+
+  int32_t next_index = 0;
+  auto visit = [&](uint32_t v) {
+    index_[v] = low_link_[v] = next_index++;
+    stack_.push_back(v);
+    on_stack_[v] = 1;
+    frames_.push_back(std::make_pair(v, edge_begin[v]));
+  };
+
+  for(uint32_t root = 0; root < n; root++) {
+    if(index_[root] != -1) continue;
+    visit(root);
+
+    while(frames_.size()) {
+      const uint32_t v = frames_.back().first;
+      uint32_t& next_edge = frames_.back().second;
+
+      if(next_edge < edge_begin[v + 1]) {
+        const uint32_t w = edges[next_edge++];
+        if(index_[w] == -1) {
+          // successor w not visited, recurse on it
+          visit(w);
+        }
+        else if(on_stack_[w]) {
+          // successor w is in stack S and hence in the current SCC
+          low_link_[v] = std::min(low_link_[v], index_[w]);
+        }
+        continue;
+      }
+
+      // done with v's edges: return to its caller
+      frames_.pop_back();
+      if(frames_.size()) {
+        const uint32_t caller = frames_.back().first;
+        low_link_[caller] = std::min(low_link_[caller], low_link_[v]);
+      }
+
+      // if v is a root node, pop the stack and generate an SCC
+      if(low_link_[v] == index_[v]) {
+        const uint32_t component = component_begin.size();
+        component_begin.push_back(component_tags.size());
+        while(true) {
+          const uint32_t w = stack_.back();
+          stack_.pop_back();
+          on_stack_[w] = 0;
+          component_tags.push_back(w);
+          component_of[w] = component;
+          if(w == v) break;
+        }
+      }
+    }
+  }
+
+  component_begin.push_back(component_tags.size());
+  assert(stack_.empty());
+}
+
+// part of tags whose component has been found
+static const uint32_t DONE = UINT32_MAX;
+
+// parts smaller than this are searched by the task that split them off,
+// rather than handed to another thread
+static const size_t PARALLEL_GRAIN = 1024;
+
+void SCCFinder::run_parallel(ThreadPool& pool) {
+  const uint32_t n = tags.size();
+  edge_begin.push_back(edges.size());
+
+  // reverse the graph, to search backwards
+  rev_begin_.assign(n + 1, 0);
+  for(auto w : edges) {
+    rev_begin_[w + 1]++;
+  }
+  for(uint32_t v = 0; v < n; v++) {
+    rev_begin_[v + 1] += rev_begin_[v];
+  }
+  rev_edges_.resize(edges.size());
+  std::vector<uint32_t>& next_rev = in_degree_;
+  next_rev.assign(rev_begin_.begin(), rev_begin_.end() - 1);
+  for(uint32_t v = 0; v < n; v++) {
+    for(auto e = edge_begin[v]; e < edge_begin[v + 1]; e++) {
+      rev_edges_[next_rev[edges[e]]++] = v;
+    }
+  }
+
+  if(part_size_ < n) {
+    part_.reset(new std::atomic<uint32_t>[n]);
+    part_size_ = n;
+  }
+  for(uint32_t v = 0; v < n; v++) {
+    part_[v].store(0, std::memory_order_relaxed);
+  }
+  forward_.assign(n, DONE);
+  backward_.assign(n, DONE);
+  in_degree_.assign(n, 0);
+  out_degree_.assign(n, 0);
+  component_sizes_.clear();
+  component_tags.clear();
+
+  // every tag starts out in part 0
+  std::atomic<uint32_t> next_part(1);
+  std::mutex found_mutex;
+  std::vector<uint32_t> all(n);
+  for(uint32_t v = 0; v < n; v++) {
+    all[v] = v;
+  }
+  {
+    TaskGroup group(&pool);
+    search_part(group, all, 0, next_part, found_mutex);
+    group.wait();
+  }
+
+  component_begin.resize(component_sizes_.size() + 1);
+  component_begin[0] = 0;
+  for(size_t c = 0; c < component_sizes_.size(); c++) {
+    component_begin[c + 1] = component_begin[c] + component_sizes_[c];
+  }
+  assert(component_begin.back() == n);
+
+  component_of.resize(n);
+  parallel_for(&pool, num_components(), pool.size() * 4 + 1,
+    [this](size_t, size_t begin, size_t end) {
+    for(auto c = begin; c < end; c++) {
+      for(auto i = component_begin[c]; i < component_begin[c + 1]; i++) {
+        component_of[component_tags[i]] = c;
+      }
+    }
+  });
+}
+
+// finds the components of the tags in 'part' (the tags of 'tags'). the
+// tags of other parts may be changing part at the same time, but never
+// into or out of this one
+void SCCFinder::search_part(TaskGroup& group, std::vector<uint32_t>& tags_in_part, uint32_t part,
+  std::atomic<uint32_t>& next_part, std::mutex& found_mutex) {
+
+  auto in_part = [this](uint32_t v, uint32_t p) {
+    return part_[v].load(std::memory_order_relaxed) == p;
+  };
+
+  // components found by this task, flushed at the end
+  std::vector<uint32_t> found_tags, found_sizes;
+
+  // parts still to search, this one first
+  std::vector<std::pair<std::vector<uint32_t>, uint32_t>> todo;
+  todo.push_back(std::make_pair(std::move(tags_in_part), part));
+
+  std::vector<uint32_t> queue, split[4];
+  while(todo.size()) {
+    std::vector<uint32_t> members = std::move(todo.back().first);
+    const uint32_t p = todo.back().second;
+    todo.pop_back();
+
+    // trim the tags that imply or are implied by nothing else in the part:
+    // each is a component of its own
+    queue.clear();
+    for(auto v : members) {
+      uint32_t in = 0, out = 0;
+      for(auto e = rev_begin_[v]; e < rev_begin_[v + 1]; e++) {
+        in += in_part(rev_edges_[e], p);
+      }
+      for(auto e = edge_begin[v]; e < edge_begin[v + 1]; e++) {
+        out += in_part(edges[e], p);
+      }
+      in_degree_[v] = in;
+      out_degree_[v] = out;
+      if(in == 0 || out == 0) queue.push_back(v);
+    }
+    while(queue.size()) {
+      const auto v = queue.back();
+      queue.pop_back();
+      if(!in_part(v, p)) continue;
+      part_[v].store(DONE, std::memory_order_relaxed);
+      found_tags.push_back(v);
+      found_sizes.push_back(1);
+
+      for(auto e = edge_begin[v]; e < edge_begin[v + 1]; e++) {
+        const auto w = edges[e];
+        if(in_part(w, p) && --in_degree_[w] == 0) queue.push_back(w);
+      }
+      for(auto e = rev_begin_[v]; e < rev_begin_[v + 1]; e++) {
+        const auto u = rev_edges_[e];
+        if(in_part(u, p) && --out_degree_[u] == 0) queue.push_back(u);
+      }
+    }
+
+    auto last = std::remove_if(members.begin(), members.end(),
+      [&](uint32_t v) { return !in_part(v, p); });
+    members.erase(last, members.end());
+    if(members.empty()) continue;
+
+    // search forwards and backwards from a pivot, marking the tags found
+    // with the part they were found from
+    const auto pivot = members[0];
+    auto search = [&](std::vector<uint32_t>& mark,
+      const std::vector<uint32_t>& begin, const std::vector<uint32_t>& out) {
+      queue.clear();
+      queue.push_back(pivot);
+      mark[pivot] = p;
+      while(queue.size()) {
+        const auto v = queue.back();
+        queue.pop_back();
+        for(auto e = begin[v]; e < begin[v + 1]; e++) {
+          const auto w = out[e];
+          if(in_part(w, p) && mark[w] != p) {
+            mark[w] = p;
+            queue.push_back(w);
+          }
+        }
+      }
+    };
+    search(forward_, edge_begin, edges);
+    search(backward_, rev_begin_, rev_edges_);
+
+    // found both ways: the pivot's component. found one way or neither:
+    // three parts to search next
+    for(auto& s : split) {
+      s.clear();
+    }
+    for(auto v : members) {
+      const bool f = forward_[v] == p, b = backward_[v] == p;
+      split[f * 2 + b].push_back(v);
+    }
+
+    const auto& component = split[3];
+    found_tags.insert(found_tags.end(), component.begin(), component.end());
+    found_sizes.push_back(component.size());
+    for(auto v : component) {
+      part_[v].store(DONE, std::memory_order_relaxed);
+    }
+
+    for(int i = 0; i < 3; i++) {
+      if(split[i].empty()) continue;
+      const uint32_t sub = next_part++;
+      for(auto v : split[i]) {
+        part_[v].store(sub, std::memory_order_relaxed);
+      }
+
+      if(split[i].size() >= PARALLEL_GRAIN) {
+        auto sub_tags = std::make_shared<std::vector<uint32_t>>(std::move(split[i]));
+        group.run([this, &group, sub_tags, sub, &next_part, &found_mutex]() {
+          search_part(group, *sub_tags, sub, next_part, found_mutex);
+        });
+      }
+      else {
+        todo.push_back(std::make_pair(std::move(split[i]), sub));
+      }
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(found_mutex);
+  component_tags.insert(component_tags.end(), found_tags.begin(), found_tags.end());
+  component_sizes_.insert(component_sizes_.end(), found_sizes.begin(), found_sizes.end());
+}
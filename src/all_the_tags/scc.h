@@ -0,0 +1,85 @@
+#ifndef __SCC_H__
+#define __SCC_H__
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+struct Tag;
+struct ThreadPool;
+struct TaskGroup;
+
+// finds the strongly connected components of (part of) the implication
+// graph with an iterative Tarjan's algorithm, over a dense copy of the
+// graph. the buffers are kept between runs, so finding the components
+// again doesn't allocate once they've grown to the size of the graph
+struct SCCFinder {
+  // the graph: tags by dense index, and the indexes of the tags each one
+  // implies. the edges of tag i are edges[edge_begin[i]] up to (but not
+  // including) edges[edge_begin[i + 1]]
+  std::vector<Tag*> tags;
+  std::vector<uint32_t> edge_begin;
+  std::vector<uint32_t> edges;
+
+  // the components, children before parents (the reverse of a topological
+  // order). the tags of component c are component_tags[component_begin[c]]
+  // up to component_tags[component_begin[c + 1]]
+  std::vector<uint32_t> component_begin;
+  std::vector<uint32_t> component_tags;
+  std::vector<uint32_t> component_of; // by tag index
+
+  // start a new graph. fill in 'tags', then for each tag in turn, push
+  // the start of its edges onto 'edge_begin' and its edges onto 'edges'
+  void clear() {
+    tags.clear();
+    edge_begin.clear();
+    edges.clear();
+  }
+
+  size_t num_components() const {
+    return component_begin.size() - 1;
+  }
+
+  // find the components of the graph
+  void run();
+
+  // find the components on a pool of threads, by forward-backward search:
+  // the tags both reachable from and reaching a pivot tag make up its
+  // component, and the rest splits into three parts that can't share a
+  // component, searched in turn as separate tasks. the components come
+  // out in no particular order
+  void run_parallel(ThreadPool& pool);
+
+private:
+  std::vector<int32_t> index_;
+  std::vector<int32_t> low_link_;
+  std::vector<uint8_t> on_stack_;
+  std::vector<uint32_t> stack_;
+
+  // the depth first search's call stack: a tag, and its next edge to follow
+  std::vector<std::pair<uint32_t, uint32_t>> frames_;
+
+  // for run_parallel: the reversed graph, the part each tag is in (read by
+  // the tasks searching other parts), and the marks and degrees of each
+  // tag, only touched by the task searching its part
+  std::vector<uint32_t> rev_begin_;
+  std::vector<uint32_t> rev_edges_;
+  std::unique_ptr<std::atomic<uint32_t>[]> part_;
+  size_t part_size_ = 0;
+  std::vector<uint32_t> forward_;
+  std::vector<uint32_t> backward_;
+  std::vector<uint32_t> in_degree_;
+  std::vector<uint32_t> out_degree_;
+
+  // the size of each component found by run_parallel
+  std::vector<uint32_t> component_sizes_;
+
+  void search_part(TaskGroup& group, std::vector<uint32_t>& tags_in_part, uint32_t part,
+    std::atomic<uint32_t>& next_part, std::mutex& found_mutex);
+};
+
+#endif /* __SCC_H__ */
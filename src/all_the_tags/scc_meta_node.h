@@ -8,6 +8,53 @@ struct SCCMetaNode {
   std::unordered_set<SCCMetaNode*> parents;
   std::unordered_set<Tag*>         tags;
 
+  // position in a topological order of the metagraph: every child has a
+  // higher order than its parents. see `Context::order_for_edge`
+  int64_t order;
+
+  // closure of the metanodes that imply this one (including itself), as of
+  // reachability version 'ancestors_version'. see `Context::ancestors`
+  using node_set = std::unordered_set<const SCCMetaNode*>;
+  node_set ancestors;
+  uint64_t ancestors_version;
+
+  // reachability labels (see `Context::reaches`): at least the highest
+  // order of any metanode this one reaches, and the range of positions
+  // this one's subtree takes up in a depth first numbering of a spanning
+  // forest of the metagraph, along with its parent in the forest
+  int64_t reach_high;
+  uint32_t tree_begin;
+  uint32_t tree_end;
+  SCCMetaNode *tree_parent;
+
+  // the entities with a tag in any of 'ancestors', as of reachability
+  // version 'closure_version', if they're kept for this metanode (see
+  // `Context::closure_set`)
+  Tag::entity_set *closure;
+  uint64_t closure_version;
+
+  // sketch of the entities with any of 'tags', as of metagraph version
+  // 'sketch_version'. built when first needed, then kept up to date as
+  // entities are tagged (see `Context::approx_count`)
+  mutable EntitySketch *sketch;
+  mutable uint64_t sketch_version;
+
+  SCCMetaNode() :
+    order(0),
+    ancestors_version(0),
+    reach_high(0),
+    tree_begin(0),
+    tree_end(0),
+    tree_parent(nullptr),
+    closure(nullptr),
+    closure_version(0),
+    sketch(nullptr),
+    sketch_version(0) {}
+  ~SCCMetaNode() {
+    delete closure;
+    delete sketch;
+  }
+
   bool add_child(SCCMetaNode* c) {
     assert(c);
     assert(c != this);
@@ -48,7 +95,7 @@ struct SCCMetaNode {
     assert(parents.size() == 0);
   }
 
-  std::ostream& print_tag_set(std::ostream& os) {
+  std::ostream& print_tag_set(std::ostream& os) const {
     os << "{";
     bool first = true;
     for(auto tag : tags) {
@@ -0,0 +1,195 @@
+#include "all_the_tags/sharded.h"
+#include "all_the_tags/tag.h"
+
+#include <mutex>
+#include <condition_variable>
+
+ShardedContext::ShardedContext(size_t num_shards) {
+  assert(num_shards > 0);
+  for(size_t i = 0; i < num_shards; i++) {
+    shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+  }
+}
+
+ShardedContext::~ShardedContext() {
+  flush();
+}
+
+void ShardedContext::route(id_type entity, std::function<void(Context&)> fn) {
+  auto& shard = *shards_[shard_of(entity)];
+  shard.worker.submit([&shard, fn]() { fn(shard.ctx); });
+}
+
+void ShardedContext::scatter(const std::function<void(size_t, Shard&)>& fn) {
+  // not ThreadPool::wait, which would run the shards' tasks on this thread
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t remaining = shards_.size();
+
+  for(size_t i = 0; i < shards_.size(); i++) {
+    auto& shard = *shards_[i];
+    shard.worker.submit([&, i]() {
+      fn(i, *shards_[i]);
+      std::unique_lock<std::mutex> lock(mutex);
+      if(--remaining == 0) done.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&]() { return remaining == 0; });
+}
+
+void ShardedContext::flush() {
+  scatter([](size_t, Shard&) {});
+}
+
+bool ShardedContext::new_tag(id_type id) {
+  if(tag_ids_.count(id) || entity_ids_.count(id)) return false;
+  tag_ids_.insert(id);
+  for(auto&& shard : shards_) {
+    auto s = shard.get();
+    s->worker.submit([s, id]() {
+      s->ctx.new_tag(id);
+      s->tags.insert(id);
+    });
+  }
+  return true;
+}
+
+bool ShardedContext::destroy_tag(id_type id) {
+  if(!tag_ids_.erase(id)) return false;
+  for(auto&& shard : shards_) {
+    auto s = shard.get();
+    s->worker.submit([s, id]() {
+      s->ctx.destroy_tag(s->ctx.tag_by_id(id));
+      s->tags.erase(id);
+    });
+  }
+  return true;
+}
+
+bool ShardedContext::imply(id_type tag, id_type other) {
+  if(!tag_ids_.count(tag) || !tag_ids_.count(other)) return false;
+  for(auto&& shard : shards_) {
+    auto& ctx = shard->ctx;
+    shard->worker.submit([&ctx, tag, other]() {
+      ctx.tag_by_id(tag)->imply(ctx.tag_by_id(other));
+    });
+  }
+  return true;
+}
+
+bool ShardedContext::unimply(id_type tag, id_type other) {
+  if(!tag_ids_.count(tag) || !tag_ids_.count(other)) return false;
+  for(auto&& shard : shards_) {
+    auto& ctx = shard->ctx;
+    shard->worker.submit([&ctx, tag, other]() {
+      ctx.tag_by_id(tag)->unimply(ctx.tag_by_id(other));
+    });
+  }
+  return true;
+}
+
+bool ShardedContext::new_entity(id_type id) {
+  if(tag_ids_.count(id) || !entity_ids_.insert(id).second) return false;
+  route(id, [id](Context& ctx) {
+    ctx.new_tag(id);
+  });
+  return true;
+}
+
+bool ShardedContext::destroy_entity(id_type id) {
+  if(!entity_ids_.erase(id)) return false;
+  route(id, [id](Context& ctx) {
+    ctx.destroy_tag(ctx.tag_by_id(id));
+  });
+  return true;
+}
+
+bool ShardedContext::add_tag(id_type entity, id_type tag, rel_type rel) {
+  if(!entity_ids_.count(entity) || !tag_ids_.count(tag)) return false;
+  route(entity, [entity, tag, rel](Context& ctx) {
+    ctx.tag_by_id(entity)->add_tag(ctx.tag_by_id(tag), rel);
+  });
+  return true;
+}
+
+bool ShardedContext::remove_tag(id_type entity, id_type tag, rel_type rel) {
+  if(!entity_ids_.count(entity) || !tag_ids_.count(tag)) return false;
+  route(entity, [entity, tag, rel](Context& ctx) {
+    ctx.tag_by_id(entity)->remove_tag(ctx.tag_by_id(tag), rel);
+  });
+  return true;
+}
+
+bool ShardedContext::query(const std::string& text, ShardedQueryResult& result,
+  const ShardedQueryOptions& options) {
+
+  // each shard only needs to send the matches that could make the cut
+  const size_t wanted = options.limit ? options.offset + options.limit : SIZE_MAX;
+  auto before = [&options](id_type a, id_type b) {
+    return options.descending ? a > b : a < b;
+  };
+
+  std::vector<std::vector<id_type>> matches(shards_.size());
+  std::vector<long> counts(shards_.size(), 0);
+  std::vector<ParseError> errs(shards_.size());
+  scatter([&](size_t i, Shard& shard) {
+    auto plan = shard.plans.get(text, options.params, &errs[i]);
+    if(!plan) return;
+
+    auto& ids = matches[i];
+    shard.ctx.query(plan, [&](Tag *e) {
+      // the tags are in every shard, but aren't entities
+      if(!shard.tags.count(e->id)) ids.push_back(e->id);
+    });
+    counts[i] = ids.size();
+
+    if(ids.size() > wanted) {
+      std::nth_element(ids.begin(), ids.begin() + wanted, ids.end(), before);
+      ids.resize(wanted);
+    }
+  });
+
+  result.ids.clear();
+  result.count = 0;
+  result.err = ParseError();
+  for(size_t i = 0; i < shards_.size(); i++) {
+    if(errs[i].code) {
+      result.err = errs[i];
+      return false;
+    }
+    result.count += counts[i];
+    result.ids.insert(result.ids.end(), matches[i].begin(), matches[i].end());
+  }
+
+  // gather the shards' matches into one ordered page
+  auto& ids = result.ids;
+  const size_t end = std::min(wanted, ids.size());
+  std::partial_sort(ids.begin(), ids.begin() + end, ids.end(), before);
+  ids.resize(end);
+  ids.erase(ids.begin(), ids.begin() + std::min(options.offset, ids.size()));
+  return true;
+}
+
+long ShardedContext::count(const std::string& text, const std::vector<id_type>& params) {
+  std::vector<long> counts(shards_.size(), 0);
+  scatter([&](size_t i, Shard& shard) {
+    ParseError err;
+    auto plan = shard.plans.get(text, params, &err);
+    if(!plan) {
+      counts[i] = err.code;
+      return;
+    }
+    shard.ctx.query(plan, [&](Tag *e) {
+      if(!shard.tags.count(e->id)) counts[i]++;
+    });
+  });
+
+  long total = 0;
+  for(auto count : counts) {
+    if(count < 0) return count;
+    total += count;
+  }
+  return total;
+}
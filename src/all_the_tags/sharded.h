@@ -0,0 +1,136 @@
+#ifndef __SHARDED_H__
+#define __SHARDED_H__
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_set>
+#include <cstdint>
+
+#include "all_the_tags/context.h"
+#include "all_the_tags/plan_cache.h"
+#include "all_the_tags/thread_pool.h"
+
+struct ShardedQueryOptions {
+  // parameters of the query text (see `parse_query`)
+  std::vector<id_type> params;
+
+  // the matches to return, in order of id: skip 'offset' of them and
+  // return up to 'limit' (all if 0)
+  size_t offset;
+  size_t limit;
+  bool descending;
+
+  ShardedQueryOptions() :
+    offset(0),
+    limit(0),
+    descending(false)
+    {}
+};
+
+struct ShardedQueryResult {
+  // the ids of the matches asked for, in order
+  std::vector<id_type> ids;
+
+  // the number of matches in every shard, however many were returned
+  long count;
+
+  // why the query couldn't be parsed, if it couldn't
+  ParseError err;
+
+  ShardedQueryResult() : count(0) {}
+};
+
+// entities split by id between a number of contexts (shards), each only
+// ever touched by a thread of its own, with every shard holding all of
+// the tags and the implications between them. writes to an entity are
+// queued for its shard, so writes to different shards are applied in
+// parallel; changes to the tags go to every shard. queries are parsed and
+// run by every shard (against writes queued before them), and the
+// matches gathered into one ordered list.
+//
+// a ShardedContext is driven from one thread. the tags and entities are
+// named by id, and the ids of tags and entities are all distinct. queries
+// can only name tags, not entities
+struct ShardedContext {
+  ShardedContext(size_t num_shards);
+  ShardedContext(const ShardedContext&) = delete;
+
+  // waits for the queued writes, then stops the shards' threads
+  ~ShardedContext();
+
+  size_t num_shards() const {
+    return shards_.size();
+  }
+
+  // the shard an entity lives in
+  size_t shard_of(id_type entity) const {
+    return entity % shards_.size();
+  }
+
+  // add (remove) a tag to (from) every shard. return false if the id is
+  // in use (not a tag)
+  bool new_tag(id_type id);
+  bool destroy_tag(id_type id);
+
+  // 'tag' implies (no longer implies) 'other' in every shard. return
+  // false if either isn't a tag
+  bool imply(id_type tag, id_type other);
+  bool unimply(id_type tag, id_type other);
+
+  // add (remove) an entity to (from) its shard. return false if the id is
+  // in use (not an entity)
+  bool new_entity(id_type id);
+  bool destroy_entity(id_type id);
+
+  // tag (untag) an entity, in its shard. return false if the entity or tag
+  // don't exist. the write is applied in the background
+  bool add_tag(id_type entity, id_type tag, rel_type rel = 1);
+  bool remove_tag(id_type entity, id_type tag, rel_type rel = ALL_REL_MASK);
+
+  // run a query on every shard, and gather the matches. returns false
+  // (with result.err set) if it couldn't be parsed
+  bool query(const std::string& text, ShardedQueryResult& result,
+    const ShardedQueryOptions& options = ShardedQueryOptions());
+
+  // number of entities matching a query in every shard, or a parse error
+  // code
+  long count(const std::string& text,
+    const std::vector<id_type>& params = std::vector<id_type>());
+
+  // wait for every queued write to be applied
+  void flush();
+
+  // a shard's context. only safe to look at after a `flush`, with no
+  // writes since
+  const Context& shard(size_t i) const {
+    return shards_[i]->ctx;
+  }
+
+private:
+  struct Shard {
+    Context ctx;
+    PlanCache plans;
+
+    // the ids of the tags, which aren't matches
+    std::unordered_set<id_type> tags;
+
+    // a single thread, so the shard's writes and queries run in the order
+    // they were queued. declared last so it stops before the rest goes
+    ThreadPool worker;
+
+    Shard() : plans(ctx), worker(1) {}
+  };
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // the ids in use, to check writes against before they're queued
+  std::unordered_set<id_type> tag_ids_;
+  std::unordered_set<id_type> entity_ids_;
+
+  // queue 'fn' for one shard, or run it on every shard and wait for all
+  void route(id_type entity, std::function<void(Context&)> fn);
+  void scatter(const std::function<void(size_t, Shard&)>& fn);
+};
+
+#endif /* __SHARDED_H__ */
@@ -0,0 +1,526 @@
+#include "all_the_tags/query.h"
+#include "all_the_tags/scc_meta_node.h"
+
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+static QueryClauseBinType flip(QueryClauseBinType type) {
+  return type == QueryClauseAnd ? QueryClauseOr : QueryClauseAnd;
+}
+
+// operands of a (possibly nested) chain of 'type' nodes
+static void collect_operands(const QueryClause *clause, QueryClauseBinType type, std::vector<const QueryClause*>& out) {
+  auto bin = dynamic_cast<const QueryClauseBin*>(clause);
+  if(bin && bin->type == type) {
+    collect_operands(bin->l, type, out);
+    collect_operands(bin->r, type, out);
+  }
+  else {
+    out.push_back(clause);
+  }
+}
+
+// moves the operands of a chain of 'type' nodes into 'out', deleting
+// the chain's nodes
+static void take_operands(QueryClause *clause, QueryClauseBinType type, std::vector<QueryClause*>& out) {
+  auto bin = dynamic_cast<QueryClauseBin*>(clause);
+  if(bin && bin->type == type) {
+    take_operands(bin->l, type, out);
+    take_operands(bin->r, type, out);
+    bin->l = bin->r = nullptr;
+    delete bin;
+  }
+  else {
+    out.push_back(clause);
+  }
+}
+
+static QueryClause *chain(QueryClauseBinType type, const std::vector<QueryClause*>& operands) {
+  assert(operands.size());
+  QueryClause *root = operands[0];
+  for(size_t i = 1; i < operands.size(); i++) {
+    root = new QueryClauseBin(type, root, operands[i]);
+  }
+  return root;
+}
+
+std::string clause_key(const QueryClause *clause) {
+  std::ostringstream os;
+
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    os << "lit(" << lit->t << ":" << lit->rel_mask << ")";
+  }
+  else if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    os << "meta(" << meta->node << ":" << meta->rel << ")";
+  }
+  else if(auto metaset = dynamic_cast<const QueryClauseMetaSet*>(clause)) {
+    std::vector<const SCCMetaNode*> nodes(metaset->nodes.begin(), metaset->nodes.end());
+    std::sort(nodes.begin(), nodes.end());
+
+    os << "metaset(" << metaset->rel;
+    for(auto node : nodes) { os << ":" << node; }
+    os << ")";
+  }
+  else if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    os << "any";
+  }
+  else if(dynamic_cast<const QueryClauseNone*>(clause)) {
+    os << "none";
+  }
+  else if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    os << "!" << clause_key(not_->c);
+  }
+  else if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    std::vector<const QueryClause*> operands;
+    collect_operands(bin, bin->type, operands);
+
+    std::vector<std::string> keys;
+    for(auto op : operands) { keys.push_back(clause_key(op)); }
+    std::sort(keys.begin(), keys.end());
+
+    os << (bin->type == QueryClauseAnd ? "and(" : "or(");
+    for(size_t i = 0; i < keys.size(); i++) {
+      if(i) os << ",";
+      os << keys[i];
+    }
+    os << ")";
+  }
+  else {
+    // opaque clause (e.g. JIT compiled), only equal to itself
+    os << "opaque(" << clause << ")";
+  }
+
+  return os.str();
+}
+
+// rel masks: every relationship in 'x' is also in 'y'
+static bool rel_subset(rel_type x, rel_type y) {
+  return (x & ~y) == 0;
+}
+
+// implication between two leaves. build_lit expands a tag into a leaf for
+// every metanode that implies it, so for leaves built from the metagraph
+// implication is just containment; 'child | ...' has a leaf for every
+// leaf in the expansion of 'parent'
+static bool leaf_implies(const QueryClause *x, const QueryClause *y) {
+  auto x_lit  = dynamic_cast<const QueryClauseLit*>(x);
+  auto x_meta = dynamic_cast<const QueryClauseMetaNode*>(x);
+  auto x_set  = dynamic_cast<const QueryClauseMetaSet*>(x);
+  auto y_lit  = dynamic_cast<const QueryClauseLit*>(y);
+  auto y_meta = dynamic_cast<const QueryClauseMetaNode*>(y);
+  auto y_set  = dynamic_cast<const QueryClauseMetaSet*>(y);
+
+  if(x_set) {
+    // every metanode in the set has to imply 'y'
+    for(auto node : x_set->nodes) {
+      QueryClauseMetaNode single(const_cast<SCCMetaNode*>(node), x_set->rel);
+      if(!leaf_implies(&single, y)) return false;
+    }
+    return true;
+  }
+  if(y_set) {
+    if(x_meta) {
+      return y_set->nodes.count(x_meta->node) && rel_subset(x_meta->rel, y_set->rel);
+    }
+    if(x_lit) {
+      auto node = x_lit->t->meta_node();
+      return node && y_set->nodes.count(node) && rel_subset(x_lit->rel_mask, y_set->rel);
+    }
+    return false;
+  }
+
+  if(x_lit && y_lit) {
+    return x_lit->t == y_lit->t && rel_subset(x_lit->rel_mask, y_lit->rel_mask);
+  }
+  if(x_meta && y_meta) {
+    return x_meta->node == y_meta->node && rel_subset(x_meta->rel, y_meta->rel);
+  }
+  if(x_lit && y_meta) {
+    // the tag has joined a metanode since the literal was built
+    return x_lit->t->meta_node() == y_meta->node && rel_subset(x_lit->rel_mask, y_meta->rel);
+  }
+  if(x_meta && y_lit) {
+    return x_meta->node->tags.size() == 1 &&
+      *(x_meta->node->tags.begin()) == y_lit->t &&
+      rel_subset(x_meta->rel, y_lit->rel_mask);
+  }
+  return false;
+}
+
+bool clause_implies(const QueryClause *x, const QueryClause *y) {
+  if(dynamic_cast<const QueryClauseNone*>(x)) return true;
+  if(dynamic_cast<const QueryClauseAny*>(y))  return true;
+
+  auto x_bin = dynamic_cast<const QueryClauseBin*>(x);
+  auto y_bin = dynamic_cast<const QueryClauseBin*>(y);
+
+  // x implies y if it implies one of y's disjuncts, or all of its conjuncts
+  if(y_bin) {
+    std::vector<const QueryClause*> ys;
+    collect_operands(y_bin, y_bin->type, ys);
+
+    if(y_bin->type == QueryClauseOr) {
+      for(auto op : ys) {
+        if(clause_implies(x, op)) return true;
+      }
+    }
+    else {
+      bool all = true;
+      for(auto op : ys) {
+        if(!clause_implies(x, op)) { all = false; break; }
+      }
+      if(all) return true;
+    }
+  }
+
+  // x implies y if one of x's conjuncts, or all of its disjuncts, imply y
+  if(x_bin) {
+    std::vector<const QueryClause*> xs;
+    collect_operands(x_bin, x_bin->type, xs);
+
+    if(x_bin->type == QueryClauseAnd) {
+      for(auto op : xs) {
+        if(clause_implies(op, y)) return true;
+      }
+      return false;
+    }
+    else {
+      for(auto op : xs) {
+        if(!clause_implies(op, y)) return false;
+      }
+      return true;
+    }
+  }
+
+  if(y_bin) return false;
+
+  // !a implies !b if b implies a
+  auto x_not = dynamic_cast<const QueryClauseNot*>(x);
+  auto y_not = dynamic_cast<const QueryClauseNot*>(y);
+  if(x_not && y_not) {
+    return clause_implies(y_not->c, x_not->c);
+  }
+
+  return leaf_implies(x, y);
+}
+
+static QueryClause *simplify_not(QueryClauseNot *not_) {
+  QueryClause *child = simplify(not_->c);
+  not_->c = nullptr;
+  delete not_;
+
+  // !!a -> a
+  if(auto inner = dynamic_cast<QueryClauseNot*>(child)) {
+    auto ret = inner->c;
+    inner->c = nullptr;
+    delete inner;
+    return ret;
+  }
+
+  if(dynamic_cast<QueryClauseAny*>(child)) {
+    delete child;
+    return new QueryClauseNone();
+  }
+  if(dynamic_cast<QueryClauseNone*>(child)) {
+    delete child;
+    return new QueryClauseAny();
+  }
+
+  if(auto bin = dynamic_cast<QueryClauseBin*>(child)) {
+    const auto type = bin->type;
+    std::vector<QueryClause*> operands;
+    take_operands(bin, type, operands);
+
+    // De Morgan. pushing a negation through an 'or' gives an 'and' that
+    // can merge with its siblings (which may drive the index); through an
+    // 'and' only when that cancels out all of the negations
+    bool all_negated = true;
+    for(auto op : operands) {
+      if(!dynamic_cast<QueryClauseNot*>(op)) all_negated = false;
+    }
+
+    if(type == QueryClauseOr || all_negated) {
+      for(auto&& op : operands) {
+        op = new QueryClauseNot(op);
+      }
+      return simplify(chain(flip(type), operands));
+    }
+
+    return new QueryClauseNot(chain(type, operands));
+  }
+
+  return new QueryClauseNot(child);
+}
+
+// deletes all of 'operands' and returns 'ret'
+static QueryClause *replace_all(std::vector<QueryClause*>& operands, QueryClause *ret) {
+  for(auto op : operands) { delete op; }
+  operands.clear();
+  return ret;
+}
+
+static QueryClause *simplify_bin(QueryClauseBin *bin) {
+  const auto type  = bin->type;
+  const auto other = flip(type);
+
+  // identity element (a & any == a, a | none == a) and
+  // absorbing element (a & none == none, a | any == any)
+  auto is_identity = [&](const QueryClause *c) {
+    return type == QueryClauseAnd ?
+      !!dynamic_cast<const QueryClauseAny*>(c) :
+      !!dynamic_cast<const QueryClauseNone*>(c);
+  };
+  auto is_absorbing = [&](const QueryClause *c) {
+    return type == QueryClauseAnd ?
+      !!dynamic_cast<const QueryClauseNone*>(c) :
+      !!dynamic_cast<const QueryClauseAny*>(c);
+  };
+  auto identity = [&]() -> QueryClause* {
+    if(type == QueryClauseAnd) return new QueryClauseAny();
+    return new QueryClauseNone();
+  };
+  auto absorbing = [&]() -> QueryClause* {
+    if(type == QueryClauseAnd) return new QueryClauseNone();
+    return new QueryClauseAny();
+  };
+
+  std::vector<QueryClause*> operands;
+  {
+    std::vector<QueryClause*> raw;
+    take_operands(bin, type, raw);
+    for(auto op : raw) {
+      // a simplified operand may turn into the same type of node
+      take_operands(simplify(op), type, operands);
+    }
+  }
+
+  // merge the metanode leafs of an 'or' into a single set per rel mask
+  if(type == QueryClauseOr) {
+    std::unordered_map<rel_type, QueryClauseMetaSet*> sets;
+    std::vector<QueryClause*> kept;
+    for(auto op : operands) {
+      auto ms = dynamic_cast<QueryClauseMetaSet*>(op);
+      auto ml = dynamic_cast<QueryClauseMetaNode*>(op);
+      if(!ms && !ml) {
+        kept.push_back(op);
+        continue;
+      }
+
+      rel_type rel = ms ? ms->rel : ml->rel;
+      auto iter = sets.find(rel);
+      if(iter == sets.end()) {
+        if(!ms) {
+          ms = new QueryClauseMetaSet(QueryClauseMetaSet::node_set({ml->node}), rel,
+            nullptr, nullptr, ml->version);
+          delete op;
+        }
+        sets.insert(std::make_pair(rel, ms));
+        kept.push_back(ms);
+      }
+      else {
+        if(ms) iter->second->nodes.insert(ms->nodes.begin(), ms->nodes.end());
+        else   iter->second->nodes.insert(ml->node);
+        iter->second->origin = nullptr;
+        iter->second->closure = nullptr;
+        iter->second->version = QueryClause::oldest_version(iter->second->version, op->metagraph_version());
+        delete op;
+      }
+    }
+    operands.swap(kept);
+  }
+
+  // fold any/none, and remove duplicates
+  std::vector<std::string> keys;
+  std::unordered_set<std::string> key_set;
+  {
+    std::vector<QueryClause*> kept;
+    for(size_t i = 0; i < operands.size(); i++) {
+      auto op = operands[i];
+      if(is_absorbing(op)) {
+        kept.insert(kept.end(), operands.begin() + i, operands.end());
+        return replace_all(kept, absorbing());
+      }
+
+      auto key = clause_key(op);
+      if(is_identity(op) || !key_set.insert(key).second) {
+        delete op;
+        continue;
+      }
+      kept.push_back(op);
+      keys.push_back(key);
+    }
+    operands.swap(kept);
+  }
+
+  // a & !a is a contradiction, a | !a is a tautology
+  for(auto op : operands) {
+    auto not_ = dynamic_cast<QueryClauseNot*>(op);
+    if(not_ && key_set.count(clause_key(not_->c))) {
+      return replace_all(operands, absorbing());
+    }
+  }
+
+  // absorption: a & (a | b) -> a, a | (a & b) -> a
+  {
+    std::vector<QueryClause*> kept;
+    std::vector<std::string> kept_keys;
+    for(size_t i = 0; i < operands.size(); i++) {
+      auto op = operands[i];
+      bool absorbed = false;
+
+      auto op_bin = dynamic_cast<QueryClauseBin*>(op);
+      if(op_bin && op_bin->type == other) {
+        std::vector<const QueryClause*> inner;
+        collect_operands(op_bin, other, inner);
+        for(auto in : inner) {
+          if(key_set.count(clause_key(in))) {
+            absorbed = true;
+            break;
+          }
+        }
+      }
+
+      if(absorbed) {
+        delete op;
+      }
+      else {
+        kept.push_back(op);
+        kept_keys.push_back(keys[i]);
+      }
+    }
+    operands.swap(kept);
+    keys.swap(kept_keys);
+  }
+
+  // implication between siblings:
+  //  - drop an 'and' operand that's implied by a sibling (child & parent -> child)
+  //  - drop an 'or' operand that implies a sibling (child | parent -> parent)
+  //  - x & !y is empty if x implies y, x | !y is everything if y implies x
+  {
+    std::vector<bool> dropped(operands.size(), false);
+
+    for(size_t i = 0; i < operands.size(); i++) {
+      auto not_ = dynamic_cast<QueryClauseNot*>(operands[i]);
+      if(!not_) continue;
+
+      for(size_t j = 0; j < operands.size(); j++) {
+        if(i == j) continue;
+        bool empty = (type == QueryClauseAnd) ?
+          clause_implies(operands[j], not_->c) :
+          clause_implies(not_->c, operands[j]);
+        if(empty) {
+          return replace_all(operands, absorbing());
+        }
+      }
+    }
+
+    for(size_t i = 0; i < operands.size(); i++) {
+      for(size_t j = 0; j < operands.size(); j++) {
+        if(i == j || dropped[j]) continue;
+        bool redundant = (type == QueryClauseAnd) ?
+          clause_implies(operands[j], operands[i]) :
+          clause_implies(operands[i], operands[j]);
+        if(redundant) {
+          dropped[i] = true;
+          break;
+        }
+      }
+    }
+
+    std::vector<QueryClause*> kept;
+    for(size_t i = 0; i < operands.size(); i++) {
+      if(dropped[i]) delete operands[i];
+      else           kept.push_back(operands[i]);
+    }
+    operands.swap(kept);
+  }
+
+  // factoring: (a & b) | (a & c) -> a & (b | c)
+  if(type == QueryClauseOr) {
+    // which operands each common term appears in
+    std::vector<std::string> order;
+    std::unordered_map<std::string, std::vector<size_t>> appears_in;
+
+    for(size_t i = 0; i < operands.size(); i++) {
+      auto op_bin = dynamic_cast<QueryClauseBin*>(operands[i]);
+      if(!op_bin || op_bin->type != QueryClauseAnd) continue;
+
+      std::vector<const QueryClause*> inner;
+      collect_operands(op_bin, QueryClauseAnd, inner);
+
+      std::unordered_set<std::string> seen;
+      for(auto in : inner) {
+        auto key = clause_key(in);
+        if(!seen.insert(key).second) continue;
+        auto& list = appears_in[key];
+        if(list.empty()) order.push_back(key);
+        list.push_back(i);
+      }
+    }
+
+    std::string best;
+    size_t best_count = 1;
+    for(auto&& key : order) {
+      if(appears_in[key].size() > best_count) {
+        best = key;
+        best_count = appears_in[key].size();
+      }
+    }
+
+    if(best_count > 1) {
+      const auto& group = appears_in[best];
+      std::unordered_set<size_t> in_group(group.begin(), group.end());
+
+      QueryClause *common = nullptr;
+      std::vector<QueryClause*> remainders;
+      for(auto i : group) {
+        std::vector<QueryClause*> inner;
+        take_operands(operands[i], QueryClauseAnd, inner);
+        operands[i] = nullptr;
+
+        std::vector<QueryClause*> rest;
+        for(auto in : inner) {
+          if(clause_key(in) == best) {
+            if(!common) common = in;
+            else        delete in;
+          }
+          else {
+            rest.push_back(in);
+          }
+        }
+        assert(rest.size());
+        remainders.push_back(chain(QueryClauseAnd, rest));
+      }
+
+      std::vector<QueryClause*> factored;
+      for(size_t i = 0; i < operands.size(); i++) {
+        if(i == group[0]) {
+          factored.push_back(new QueryClauseBin(QueryClauseAnd, common, chain(QueryClauseOr, remainders)));
+        }
+        else if(!in_group.count(i)) {
+          factored.push_back(operands[i]);
+        }
+      }
+
+      // the factored terms may simplify further
+      return simplify(chain(QueryClauseOr, factored));
+    }
+  }
+
+  if(operands.empty()) {
+    return identity();
+  }
+  return chain(type, operands);
+}
+
+QueryClause *simplify(QueryClause *clause) {
+  if(auto not_ = dynamic_cast<QueryClauseNot*>(clause)) {
+    return simplify_not(not_);
+  }
+  if(auto bin = dynamic_cast<QueryClauseBin*>(clause)) {
+    return simplify_bin(bin);
+  }
+  return clause;
+}
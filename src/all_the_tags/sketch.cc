@@ -0,0 +1,224 @@
+#include "all_the_tags/sketch.h"
+#include "all_the_tags/context.h"
+
+#include <list>
+
+// sketch of the entities in 'entities'
+template<class Container>
+static void sketch_entities(const Container& entities, EntitySketch& out) {
+  out.clear();
+  for(auto e : entities) {
+    out.insert(e, e->id);
+  }
+}
+
+static void sketch_all(const std::unordered_map<id_type, Tag*>& id_to_tag, EntitySketch& out) {
+  out.clear();
+  for(auto&& iter : id_to_tag) {
+    out.insert(iter.second, iter.first);
+  }
+}
+
+// the sketch of the union of the sets sketched by 'inputs'. the result is
+// only a bottom-k of the union up to the smallest k of any input that
+// isn't exact
+static void merge_sketches(const std::vector<const EntitySketch*>& inputs, EntitySketch& out) {
+  size_t k = SKETCH_K;
+  bool exact = true;
+  std::vector<EntitySketch::entry> entries;
+  for(auto in : inputs) {
+    if(!in->exact) {
+      k = std::min(k, in->entries.size());
+      exact = false;
+    }
+    entries.insert(entries.end(), in->entries.begin(), in->entries.end());
+  }
+
+  std::sort(entries.begin(), entries.end());
+  entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+  if(entries.size() > k) {
+    entries.resize(k);
+    exact = false;
+  }
+
+  out.entries.swap(entries);
+  out.exact = exact;
+}
+
+// the tag's own sketch, or one made up on the spot if it has too few
+// entities to keep one
+static const EntitySketch& tag_sketch(const Tag *t, std::list<EntitySketch>& temps) {
+  if(t->sketch) return *(t->sketch);
+  temps.emplace_back();
+  sketch_entities(t->entities, temps.back());
+  return temps.back();
+}
+
+static bool entity_in_node(const Tag *entity, const SCCMetaNode *node) {
+  for(auto&& tagging : entity->tags) {
+    if(tagging.first->meta_node() == node) return true;
+  }
+  return false;
+}
+
+void Context::sketch_tagging_changed(Tag *entity, Tag *tag) {
+  const bool has = entity->tags.count(tag);
+
+  auto node = tag->meta_node();
+  if(node && (!node->sketch || node->sketch_version != metagraph_version_)) {
+    // built again from the tags when it's next needed
+    node = nullptr;
+  }
+
+  if(has) {
+    if(tag->sketch) {
+      tag->sketch->insert(entity, entity->id);
+    }
+    else if(tag->entities.size() > SKETCH_K) {
+      tag->sketch = new EntitySketch();
+      sketch_entities(tag->entities, *(tag->sketch));
+    }
+
+    if(node) node->sketch->insert(entity, entity->id);
+  }
+  else {
+    if(tag->sketch && tag->entities.size() <= SKETCH_K / 2) {
+      // few enough to go back to using the entities themselves
+      delete tag->sketch;
+      tag->sketch = nullptr;
+    }
+    else if(tag->sketch && tag->sketch->erase(entity, entity->id) && tag->sketch->needs_rebuild()) {
+      sketch_entities(tag->entities, *(tag->sketch));
+    }
+
+    if(node && !entity_in_node(entity, node) && node->sketch->erase(entity, entity->id)) {
+      if(node->sketch->needs_rebuild()) node->sketch_version = 0;
+    }
+  }
+}
+
+const EntitySketch& Context::node_sketch(const SCCMetaNode *node) const {
+  if(node->sketch && node->sketch_version == metagraph_version_) {
+    return *(node->sketch);
+  }
+
+  if(!node->sketch) node->sketch = new EntitySketch();
+
+  std::list<EntitySketch> temps;
+  std::vector<const EntitySketch*> inputs;
+  for(auto t : node->tags) {
+    inputs.push_back(&tag_sketch(t, temps));
+  }
+  merge_sketches(inputs, *(node->sketch));
+  node->sketch_version = metagraph_version_;
+
+  return *(node->sketch);
+}
+
+// a sketch of a set of entities that includes every entity matching
+// 'clause', if one can be made from the sketches of its leafs. the smaller
+// the set, the more of the sampled entities match the clause, and the
+// better the estimate
+bool Context::sketch_of(const QueryClause *clause, EntitySketch& out) const {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    std::list<EntitySketch> temps;
+    out = tag_sketch(lit->t, temps);
+    return true;
+  }
+  if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    out = node_sketch(meta->node);
+    return true;
+  }
+  if(auto metaset = dynamic_cast<const QueryClauseMetaSet*>(clause)) {
+    std::vector<const EntitySketch*> inputs;
+    for(auto node : metaset->nodes) {
+      inputs.push_back(&node_sketch(node));
+    }
+    merge_sketches(inputs, out);
+    return true;
+  }
+  if(dynamic_cast<const QueryClauseNone*>(clause)) {
+    out.clear();
+    return true;
+  }
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    EntitySketch l, r;
+    const bool has_l = sketch_of(bin->l, l);
+    const bool has_r = sketch_of(bin->r, r);
+
+    if(bin->type == QueryClauseOr) {
+      if(!has_l || !has_r) return false;
+      merge_sketches({&l, &r}, out);
+      return true;
+    }
+
+    // either side bounds an and
+    if(!has_l && !has_r) return false;
+    if(has_l && (!has_r || l.estimate() <= r.estimate())) {
+      out.entries.swap(l.entries);
+      out.exact = l.exact;
+    }
+    else {
+      out.entries.swap(r.entries);
+      out.exact = r.exact;
+    }
+    return true;
+  }
+
+  // nots, any, and whatever else can match any entity
+  return false;
+}
+
+// estimated number of the entities sketched by 'sample' that match all of
+// 'clauses'
+static double estimate_matching(const EntitySketch& sample, const std::vector<const QueryClause*>& clauses) {
+  if(sample.entries.empty()) return 0;
+
+  size_t matched = 0;
+  for(auto&& entry : sample.entries) {
+    bool all = true;
+    for(auto clause : clauses) {
+      if(!clause->matches_set(entry.second->tags)) {
+        all = false;
+        break;
+      }
+    }
+    if(all) matched++;
+  }
+
+  if(sample.exact) return matched;
+  return sample.estimate() * matched / sample.entries.size();
+}
+
+double Context::approx_count(const QueryClause *clause) const {
+  EntitySketch sample;
+  if(!sketch_of(clause, sample)) {
+    return estimate_matching(all_sketch_, {clause});
+  }
+  return estimate_matching(sample, {clause});
+}
+
+double Context::approx_and_count(const QueryClause *l, const QueryClause *r) const {
+  EntitySketch l_sample, r_sample;
+  const bool has_l = sketch_of(l, l_sample);
+  const bool has_r = sketch_of(r, r_sample);
+
+  const EntitySketch *sample = &all_sketch_;
+  if(has_l && (!has_r || l_sample.estimate() <= r_sample.estimate())) {
+    sample = &l_sample;
+  }
+  else if(has_r) {
+    sample = &r_sample;
+  }
+  return estimate_matching(*sample, {l, r});
+}
+
+void Context::sketch_entity_added(Tag *entity) {
+  all_sketch_.insert(entity, entity->id);
+}
+
+void Context::sketch_entity_removed(Tag *entity) {
+  if(all_sketch_.erase(entity, entity->id) && all_sketch_.needs_rebuild()) {
+    sketch_all(id_to_tag, all_sketch_);
+  }
+}
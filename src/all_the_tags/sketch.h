@@ -0,0 +1,95 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+#include "all_the_tags/id.h"
+
+struct Tag;
+
+// number of entities kept by a sketch. estimates from a full sketch are
+// within a few percent (the standard error is about 1/sqrt(SKETCH_K))
+static const size_t SKETCH_K = 1024;
+
+// hash of an entity, the same for every sketch the entity is in, so
+// sketches of different sets can be combined
+inline uint64_t entity_hash(id_type id) {
+  // splitmix64 finalizer
+  uint64_t x = id + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// bottom-k sketch of a set of entities: the (up to) SKETCH_K entities of
+// the set with the smallest hashes. the kept entities are a uniform
+// sample of the set, and the k-th smallest hash tells how big the set is.
+// sketches of different sets can be merged into the sketch of their
+// union, and testing the sampled entities against a clause estimates how
+// many entities of the set match it
+struct EntitySketch {
+  using entry = std::pair<uint64_t, Tag*>;
+
+  // sorted by hash
+  std::vector<entry> entries;
+
+  // true if 'entries' holds the whole set
+  bool exact;
+
+  EntitySketch() : exact(true) {}
+
+  void insert(Tag *e, id_type id) {
+    const entry ent(entity_hash(id), e);
+    if(!exact && entries.size() && ent.first > entries.back().first) {
+      // bigger than everything kept; it's not known what else was dropped
+      // from between the last entry and this one
+      return;
+    }
+
+    auto iter = std::lower_bound(entries.begin(), entries.end(), ent);
+    if(iter != entries.end() && *iter == ent) return;
+    entries.insert(iter, ent);
+
+    if(entries.size() > SKETCH_K) {
+      entries.pop_back();
+      exact = false;
+    }
+  }
+
+  // removing a kept entity leaves one fewer entry, rather than bringing
+  // back one that was dropped. returns true if the entity was kept
+  bool erase(Tag *e, id_type id) {
+    const entry ent(entity_hash(id), e);
+    auto iter = std::lower_bound(entries.begin(), entries.end(), ent);
+    if(iter == entries.end() || *iter != ent) return false;
+    entries.erase(iter);
+    return true;
+  }
+
+  // too few entries left to estimate from, after removals
+  bool needs_rebuild() const {
+    return !exact && entries.size() < SKETCH_K / 2;
+  }
+
+  void clear() {
+    entries.clear();
+    exact = true;
+  }
+
+  // estimated number of entities in the set
+  double estimate() const {
+    if(exact) return entries.size();
+    return estimate_from(entries.size(), entries.back().first);
+  }
+
+  // estimated size of a set whose sketch's 'k'th smallest hash is 'kth'
+  static double estimate_from(size_t k, uint64_t kth) {
+    // (k - 1) / (kth / 2^64), the unbiased estimator
+    return (k - 1) * (18446744073709551616.0 / ((double)kth + 1.0));
+  }
+};
+
+#endif /* __SKETCH_H__ */
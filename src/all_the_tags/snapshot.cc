@@ -0,0 +1,178 @@
+#include "all_the_tags/snapshot.h"
+#include "all_the_tags/context.h"
+
+#include <thread>
+
+// readers pin the epoch before loading the root, and the writer stamps
+// what it retires with the epoch after publishing the root that replaces
+// it. so a reader pinned at a later epoch than something was retired at
+// loaded a root that can't reach it, and once every open snapshot is
+// pinned later than that, it can be freed
+
+SnapshotStore::SnapshotStore() :
+  epoch_(1),
+  next_slot_(0),
+  next_reclaim_(SNAPSHOT_RECLAIM_BATCH) {
+  for(auto& reader : readers_) {
+    reader.epoch.store(0, std::memory_order_relaxed);
+  }
+  root_.store(new SnapshotRoot{nullptr, 1, 0, 1}, std::memory_order_seq_cst);
+}
+
+SnapshotStore::~SnapshotStore() {
+  for(auto& reader : readers_) {
+    assert(reader.epoch.load() == 0 && "snapshot open while its context is destroyed");
+    (void)reader;
+  }
+  for(auto&& retired : retired_) {
+    free_retired(retired);
+  }
+
+  auto root = root_.load();
+  free_page(root->page, root->depth);
+  delete root;
+}
+
+void SnapshotStore::add(Tag *entity) {
+  uint32_t slot;
+  if(free_slots_.size()) {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  else {
+    slot = next_slot_++;
+  }
+  entity->snapshot_slot = slot;
+  set(slot, new EntityVersion{entity, entity->tags}, 1);
+}
+
+void SnapshotStore::update(Tag *entity) {
+  set(entity->snapshot_slot, new EntityVersion{entity, entity->tags}, 0);
+}
+
+void SnapshotStore::remove(Tag *entity) {
+  set(entity->snapshot_slot, nullptr, -1);
+  free_slots_.push_back(entity->snapshot_slot);
+}
+
+void SnapshotStore::set(uint32_t slot, EntityVersion *version, int delta) {
+  auto old_root = root_.load(std::memory_order_relaxed);
+  auto root = new SnapshotRoot(*old_root);
+  root->version++;
+  root->num_entities += delta;
+
+  // grow the tree until the slot fits in it. the old tree goes under the
+  // first slot of the new top page
+  auto capacity = [](unsigned depth) {
+    return (size_t) 1 << (depth * SNAPSHOT_PAGE_BITS);
+  };
+  SnapshotPage *grown = nullptr;
+  while(capacity(root->depth) <= slot) {
+    grown = new SnapshotPage();
+    grown->slots[0] = root->page;
+    root->page = grown;
+    root->depth++;
+  }
+
+  // copy the pages on the path down to the slot, leaving the rest shared
+  // with the old tree
+  std::vector<void*> replaced;
+  auto copy_page = [&](void *page) {
+    if(grown && page == grown) return grown;
+    if(!page) return new SnapshotPage();
+    replaced.push_back(page);
+    return new SnapshotPage(*static_cast<SnapshotPage*>(page));
+  };
+  auto index = [slot](unsigned level) {
+    return (slot >> (level * SNAPSHOT_PAGE_BITS)) & (SNAPSHOT_PAGE_SIZE - 1);
+  };
+
+  SnapshotPage *page = copy_page(root->page);
+  root->page = page;
+  for(unsigned level = root->depth - 1; level > 0; level--) {
+    auto& next = page->slots[index(level)];
+    page = copy_page(next);
+    next = page;
+  }
+  auto& leaf = page->slots[index(0)];
+  EntityVersion *old_version = static_cast<EntityVersion*>(leaf);
+  leaf = version;
+
+  root_.store(root, std::memory_order_seq_cst);
+
+  // only retired once they can't be reached from the published root
+  for(auto old_page : replaced) {
+    retire(RETIRED_PAGE, old_page);
+  }
+  if(old_version) retire(RETIRED_VERSION, old_version);
+  retire(RETIRED_ROOT, const_cast<SnapshotRoot*>(old_root));
+}
+
+void SnapshotStore::retire(RetiredKind kind, void *ptr) {
+  retired_.push_back(Retired{epoch_.load(std::memory_order_seq_cst), kind, ptr});
+
+  // a snapshot held open keeps everything since from being freed, so wait
+  // for more to pile up each time nothing much could be
+  if(retired_.size() >= next_reclaim_) {
+    next_reclaim_ = std::max(SNAPSHOT_RECLAIM_BATCH, reclaim() * 2);
+  }
+}
+
+size_t SnapshotStore::reclaim() {
+  epoch_.fetch_add(1, std::memory_order_seq_cst);
+
+  uint64_t oldest = UINT64_MAX;
+  for(auto& reader : readers_) {
+    const auto pinned = reader.epoch.load(std::memory_order_seq_cst);
+    if(pinned) oldest = std::min(oldest, pinned);
+  }
+
+  size_t kept = 0;
+  for(auto&& retired : retired_) {
+    if(retired.epoch < oldest) free_retired(retired);
+    else                       retired_[kept++] = retired;
+  }
+  retired_.resize(kept);
+  return kept;
+}
+
+size_t SnapshotStore::pin(const SnapshotRoot *& root) {
+  // an epoch that's out of date by the time it's stored only keeps more
+  // from being freed
+  const uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+  while(true) {
+    for(size_t i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+      uint64_t expected = 0;
+      if(readers_[i].epoch.compare_exchange_strong(expected, epoch, std::memory_order_seq_cst)) {
+        root = root_.load(std::memory_order_seq_cst);
+        return i;
+      }
+    }
+    std::this_thread::yield();
+  }
+}
+
+void SnapshotStore::free_retired(const Retired& retired) {
+  switch(retired.kind) {
+  case RETIRED_ROOT:    delete static_cast<SnapshotRoot*>(retired.ptr);  break;
+  case RETIRED_PAGE:    delete static_cast<SnapshotPage*>(retired.ptr);  break;
+  case RETIRED_VERSION: delete static_cast<EntityVersion*>(retired.ptr); break;
+  case RETIRED_ENTITY:  delete static_cast<Tag*>(retired.ptr);           break;
+  }
+}
+
+void SnapshotStore::free_page(SnapshotPage *page, unsigned depth) {
+  if(!page) return;
+  for(auto slot : page->slots) {
+    if(!slot) continue;
+    if(depth == 1) delete static_cast<EntityVersion*>(slot);
+    else           free_page(static_cast<SnapshotPage*>(slot), depth - 1);
+  }
+  delete page;
+}
+
+ContextSnapshot::ContextSnapshot(const Context& ctx) :
+  store_(ctx.snapshot_store()) {
+  assert(store_ && "snapshots aren't enabled on the context");
+  reader_ = store_->pin(root_);
+}
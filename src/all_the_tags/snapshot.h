@@ -0,0 +1,184 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+
+#include "all_the_tags/tag.h"
+#include "all_the_tags/query.h"
+
+struct Context;
+
+// pages of the snapshot store hold this many slots, and are indexed by
+// this many bits of a slot's index at each level
+static const unsigned SNAPSHOT_PAGE_BITS = 6;
+static const size_t SNAPSHOT_PAGE_SIZE = 1 << SNAPSHOT_PAGE_BITS;
+
+// snapshots that can be open at once. more wait for one to close
+static const size_t SNAPSHOT_MAX_READERS = 64;
+
+// retired objects the writer lets pile up before trying to free them
+static const size_t SNAPSHOT_RECLAIM_BATCH = 256;
+
+// an entity's tags as of some version of the context. never changed once
+// published, so readers can test clauses against it without locking
+struct EntityVersion {
+  Tag *entity;
+  Tag::tagging_map tags;
+};
+
+// a node of the radix tree of slots. the pages at the bottom of the tree
+// hold EntityVersions, and the rest hold pages
+struct SnapshotPage {
+  void *slots[SNAPSHOT_PAGE_SIZE];
+
+  SnapshotPage() {
+    std::fill(slots, slots + SNAPSHOT_PAGE_SIZE, nullptr);
+  }
+};
+
+// one version of the whole store: the tree, with room for
+// SNAPSHOT_PAGE_SIZE ^ 'depth' slots
+struct SnapshotRoot {
+  SnapshotPage *page;
+  unsigned depth;
+  size_t num_entities;
+  uint64_t version;
+};
+
+// every entity's tags, versioned so that readers on other threads can
+// scan a consistent snapshot of them while the context goes on changing.
+// changing an entity copies the pages on the path to its slot and
+// publishes a new root (copy on write), so a snapshot is just the root it
+// started with. what the writer replaces is retired, and freed once every
+// snapshot that could still see it has closed (epoch based reclamation)
+struct SnapshotStore {
+  SnapshotStore();
+  SnapshotStore(const SnapshotStore&) = delete;
+
+  // frees everything: no snapshot may be open
+  ~SnapshotStore();
+
+  // writer side: called by the context as entities come and go or are
+  // tagged. an entity is given a slot when it's added
+  void add(Tag *entity);
+  void update(Tag *entity);
+  void remove(Tag *entity);
+
+  // deletes 'entity' once no open snapshot could still be using it
+  void retire_entity(Tag *entity) {
+    retire(RETIRED_ENTITY, entity);
+  }
+
+  // reader side: pin the current version (see `ContextSnapshot`)
+  size_t pin(const SnapshotRoot *& root);
+  void unpin(size_t reader) {
+    readers_[reader].epoch.store(0, std::memory_order_seq_cst);
+  }
+
+  // tries to free what's been retired. returns how much is still waiting
+  size_t reclaim();
+
+  uint64_t version() const {
+    return root_.load(std::memory_order_acquire)->version;
+  }
+
+private:
+  std::atomic<const SnapshotRoot*> root_;
+
+  // the epoch, and the epoch each open snapshot was pinned at (0 if the
+  // reader's slot is free). padded out to a cache line each, so readers
+  // don't share one wherever the store is allocated (which plain new
+  // doesn't align beyond 16 bytes before C++17)
+  std::atomic<uint64_t> epoch_;
+  char epoch_pad_[64 - sizeof(std::atomic<uint64_t>)];
+  struct Reader {
+    std::atomic<uint64_t> epoch;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  Reader readers_[SNAPSHOT_MAX_READERS];
+
+  // slots given up by removed entities, to use again
+  std::vector<uint32_t> free_slots_;
+  uint32_t next_slot_;
+
+  enum RetiredKind {
+    RETIRED_ROOT,
+    RETIRED_PAGE,
+    RETIRED_VERSION,
+    RETIRED_ENTITY
+  };
+  struct Retired {
+    uint64_t epoch;
+    RetiredKind kind;
+    void *ptr;
+  };
+  std::vector<Retired> retired_;
+  size_t next_reclaim_;
+
+  void set(uint32_t slot, EntityVersion *version, int delta);
+  void retire(RetiredKind kind, void *ptr);
+  static void free_retired(const Retired& retired);
+  static void free_page(SnapshotPage *page, unsigned depth);
+};
+
+// a consistent view of every entity's tags, as of when it was opened.
+// any number can be open at once, on any threads, while the context's
+// thread goes on changing it; reading one takes no locks. clauses have to
+// be built on the context's thread, and the entities passed to 'match'
+// stay allocated while the snapshot is open, but only their ids may be
+// read. tags are tested against the metagraph as it is while scanning, so
+// implications that change mid-scan may or may not apply
+struct ContextSnapshot {
+  // the context must have snapshots enabled (see `Context::enable_snapshots`)
+  ContextSnapshot(const Context& ctx);
+  ContextSnapshot(const ContextSnapshot&) = delete;
+  ~ContextSnapshot() {
+    store_->unpin(reader_);
+  }
+
+  // the context's snapshot version this is a view of
+  uint64_t version() const {
+    return root_->version;
+  }
+
+  size_t num_tags() const {
+    return root_->num_entities;
+  }
+
+  // calls 'match' with every entity matching 'q', as `Context::query`
+  // does, and returns the number of entities tested
+  template<class UnaryFunction>
+  long query(const QueryClause *q, UnaryFunction match) const {
+    long i = 0;
+    each(root_->page, root_->depth, [&](const EntityVersion *v) {
+      i++;
+      if(q->matches_set(v->tags)) {
+        match(v->entity);
+      }
+    });
+    return i;
+  }
+
+  // calls 'fn' with every entity's version in the snapshot
+  template<class Function>
+  static void each(const SnapshotPage *page, unsigned depth, Function&& fn) {
+    if(!page) return;
+    for(auto slot : page->slots) {
+      if(!slot) continue;
+      if(depth == 1) fn(static_cast<const EntityVersion*>(slot));
+      else           each(static_cast<const SnapshotPage*>(slot), depth - 1, fn);
+    }
+  }
+
+private:
+  SnapshotStore *store_;
+  size_t reader_;
+  const SnapshotRoot *root_;
+};
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,139 @@
+#include "all_the_tags/standing.h"
+#include "all_the_tags/context.h"
+
+static QueryClause *or_of_tags(const QueryClauseMetaSet::node_set& nodes, rel_type rel) {
+  QueryClause *clause = nullptr;
+  for(auto node : nodes) {
+    for(auto t : node->tags) {
+      QueryClause *lit = new QueryClauseLit(t, rel);
+      clause = clause ? build_or(clause, lit) : lit;
+    }
+  }
+  return clause ? clause : new QueryClauseNone();
+}
+
+QueryClause *StandingQuery::to_source(const QueryClause *clause) {
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    return new QueryClauseBin(bin->type, to_source(bin->l), to_source(bin->r));
+  }
+  if(auto not_clause = dynamic_cast<const QueryClauseNot*>(clause)) {
+    return build_not(to_source(not_clause->c));
+  }
+  if(auto metaset = dynamic_cast<const QueryClauseMetaSet*>(clause)) {
+    if(metaset->origin) {
+      return new QueryClauseLit(metaset->origin, metaset->rel);
+    }
+    // not built for a single tag, so stick to the tags it has now
+    return or_of_tags(metaset->nodes, metaset->rel);
+  }
+  if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    return or_of_tags(QueryClauseMetaSet::node_set({meta->node}), meta->rel);
+  }
+
+  // literals, any and none stay as they are
+  return clause->dup();
+}
+
+// 'source' with each literal expanded by build_lit, recording the tags
+// each leaf tests for
+static QueryClause *expand(const QueryClause *source, std::vector<std::unordered_set<Tag*>>& leaf_tags) {
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(source)) {
+    auto l = expand(bin->l, leaf_tags);
+    auto r = expand(bin->r, leaf_tags);
+    return new QueryClauseBin(bin->type, l, r);
+  }
+  if(auto not_clause = dynamic_cast<const QueryClauseNot*>(source)) {
+    return build_not(expand(not_clause->c, leaf_tags));
+  }
+
+  leaf_tags.emplace_back();
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(source)) {
+    auto clause = build_lit(lit->t, lit->rel_mask);
+    if(auto metaset = dynamic_cast<QueryClauseMetaSet*>(clause)) {
+      for(auto node : metaset->nodes) {
+        leaf_tags.back().insert(node->tags.begin(), node->tags.end());
+      }
+    }
+    else {
+      leaf_tags.back().insert(lit->t);
+    }
+    return clause;
+  }
+
+  assert(dynamic_cast<const QueryClauseAny*>(source) || dynamic_cast<const QueryClauseNone*>(source));
+  return source->dup();
+}
+
+bool StandingQuery::derive(std::unordered_set<Tag*>& candidates) {
+  std::vector<std::unordered_set<Tag*>> new_leaf_tags;
+  auto expanded = expand(source, new_leaf_tags);
+
+  delete clause;
+  clause = optimize(expanded);
+
+  bool was_empty_match = matches_empty;
+  matches_empty = clause->matches_set(Tag::tagging_map());
+
+  bool known = !needs_derive &&
+    matches_empty == was_empty_match &&
+    new_leaf_tags.size() == leaf_tags.size();
+
+  if(known) {
+    // a leaf's result can only change for entities with a tag it used to
+    // test for and doesn't now, or the other way around
+    for(size_t i = 0; i < leaf_tags.size(); i++) {
+      for(auto t : leaf_tags[i]) {
+        if(!new_leaf_tags[i].count(t)) candidates.insert(t->entities.begin(), t->entities.end());
+      }
+      for(auto t : new_leaf_tags[i]) {
+        if(!leaf_tags[i].count(t)) candidates.insert(t->entities.begin(), t->entities.end());
+      }
+    }
+  }
+
+  leaf_tags.swap(new_leaf_tags);
+  covered.clear();
+  for(auto&& tags : leaf_tags) {
+    covered.insert(tags.begin(), tags.end());
+  }
+  needs_derive = false;
+
+  return known;
+}
+
+// replaces literals for 'tag' in 'clause' with none, setting 'replaced'
+// if there were any
+static QueryClause *replace_tag(QueryClause *clause, Tag *tag, bool& replaced) {
+  if(auto bin = dynamic_cast<QueryClauseBin*>(clause)) {
+    bin->l = replace_tag(bin->l, tag, replaced);
+    bin->r = replace_tag(bin->r, tag, replaced);
+  }
+  else if(auto not_clause = dynamic_cast<QueryClauseNot*>(clause)) {
+    not_clause->c = replace_tag(not_clause->c, tag, replaced);
+  }
+  else if(auto lit = dynamic_cast<QueryClauseLit*>(clause)) {
+    if(lit->t == tag) {
+      replaced = true;
+      delete clause;
+      return new QueryClauseNone();
+    }
+  }
+  return clause;
+}
+
+bool StandingQuery::forget(Tag *tag) {
+  if(matches.erase(tag)) {
+    callback(StandingQuery_Leave, tag);
+  }
+
+  bool replaced = false;
+  source = replace_tag(source, tag, replaced);
+
+  if(covered.erase(tag)) {
+    for(auto&& tags : leaf_tags) {
+      tags.erase(tag);
+    }
+    return true;
+  }
+  return replaced;
+}
@@ -0,0 +1,88 @@
+#ifndef __STANDING_H__
+#define __STANDING_H__
+
+#include <vector>
+#include <unordered_set>
+#include <functional>
+
+#include "all_the_tags/query.h"
+
+enum StandingQueryEvent {
+  StandingQuery_Enter, // the entity started matching the query
+  StandingQuery_Leave  // the entity stopped matching the query
+};
+
+// a query registered on the context with `Context::add_standing_query`,
+// whose matches are kept up to date as entities are tagged and untagged
+// and implications change
+struct StandingQuery {
+  using callback_type = std::function<void(StandingQueryEvent, Tag*)>;
+
+  int id;
+
+  // the query as given, with every leaf turned back into the tags it was
+  // built for, so it can be re-derived when the metagraph changes
+  QueryClause *source;
+
+  // 'source' with the tags' implications expanded, as of the metagraph
+  // it was last derived at
+  QueryClause *clause;
+
+  // the tags each leaf of 'clause' (in the order of the leafs of
+  // 'source') tests for, and all of them together. an entity's match can
+  // only change when it gains or loses one of the 'covered' tags
+  std::vector<std::unordered_set<Tag*>> leaf_tags;
+  std::unordered_set<Tag*> covered;
+
+  // does an entity without any tags match
+  bool matches_empty;
+
+  std::unordered_set<Tag*> matches;
+  callback_type callback;
+
+  // 'clause' is still to be derived (it was registered while the context
+  // was dirty)
+  bool needs_derive;
+
+  StandingQuery(int id_, QueryClause *source_, callback_type callback_) :
+    id(id_),
+    source(source_),
+    clause(nullptr),
+    matches_empty(false),
+    callback(callback_),
+    needs_derive(true)
+    {}
+  StandingQuery(const StandingQuery&) = delete;
+  ~StandingQuery() {
+    delete source;
+    delete clause;
+  }
+
+  // turn a clause built with build_lit & co into the form kept in
+  // 'source'. 'clause' must not be JIT compiled
+  static QueryClause *to_source(const QueryClause *clause);
+
+  // rebuild 'clause' against the current metagraph. entities whose match
+  // may have changed are added to 'candidates'. returns false if that
+  // couldn't be worked out, and every entity has to be re-evaluated
+  bool derive(std::unordered_set<Tag*>& candidates);
+
+  // re-evaluate an entity, calling back if it entered or left the matches
+  void update(Tag *entity) {
+    if(clause->matches_set(entity->tags)) {
+      if(matches.insert(entity).second) {
+        callback(StandingQuery_Enter, entity);
+      }
+    }
+    else if(matches.erase(entity)) {
+      callback(StandingQuery_Leave, entity);
+    }
+  }
+
+  // 'tag' is about to be destroyed: it stops matching, and leafs testing
+  // for it are replaced with ones that can't match. returns true if the
+  // query tested for the tag, and has to be derived again
+  bool forget(Tag *tag);
+};
+
+#endif /* __STANDING_H__ */
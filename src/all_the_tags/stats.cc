@@ -0,0 +1,138 @@
+#include "all_the_tags/stats.h"
+#include "all_the_tags/context.h"
+#include "all_the_tags/tag.h"
+
+#include <chrono>
+#include <vector>
+
+// average time (in ns) of calling 'fn' for every element of 'sample',
+// repeating the pass until there's enough time measured to be meaningful
+template<class T, class Fn>
+static double time_per_call(const std::vector<T>& sample, Fn fn) {
+  typedef std::chrono::steady_clock clock;
+
+  if(sample.empty()) return 0;
+
+  volatile long sink = 0;
+  long calls = 0;
+  const auto start = clock::now();
+  auto elapsed = clock::duration::zero();
+
+  for(int round = 0; round < 64; round++) {
+    for(auto&& elem : sample) {
+      sink = sink + fn(elem);
+    }
+    calls += sample.size();
+
+    elapsed = clock::now() - start;
+    if(elapsed > std::chrono::microseconds(500)) break;
+  }
+
+  (void)sink;
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / calls;
+}
+
+void Context::analyze(size_t sample_size, size_t num_frequent) {
+  auto stats = new ContextStats();
+  stats->num_entities = id_to_tag.size();
+  stats->sketches = this;
+
+  // take an evenly spaced sample of the entities
+  std::vector<Tag*> sample;
+  {
+    size_t stride = std::max<size_t>(1, id_to_tag.size() / std::max<size_t>(1, sample_size));
+    size_t i = 0;
+    for(auto&& iter : id_to_tag) {
+      if((i++ % stride) == 0) sample.push_back(iter.second);
+    }
+  }
+  stats->sample_size = sample.size();
+
+  size_t sampled_taggings = 0;
+  for(auto e : sample) { sampled_taggings += e->tags.size(); }
+  if(sample.size()) {
+    stats->avg_tags_per_entity = std::max(1.0, (double)sampled_taggings / sample.size());
+  }
+
+  // the most frequently used tags get their pairwise co-occurrence sampled
+  std::vector<Tag*> by_count;
+  for(auto&& iter : id_to_tag) {
+    if(iter.second->entity_count() > 0) by_count.push_back(iter.second);
+  }
+  num_frequent = std::min(num_frequent, by_count.size());
+  std::partial_sort(by_count.begin(), by_count.begin() + num_frequent, by_count.end(),
+    [](const Tag *a, const Tag *b) {
+      return a->entity_count() > b->entity_count();
+    });
+  by_count.resize(num_frequent);
+  stats->frequent_tags.insert(by_count.begin(), by_count.end());
+
+  {
+    std::unordered_map<std::pair<const Tag*, const Tag*>, size_t, ContextStats::tag_pair_hash> pair_counts;
+    std::vector<const Tag*> frequent_on;
+
+    for(auto e : sample) {
+      frequent_on.clear();
+      for(auto&& tagging : e->tags) {
+        if(stats->frequent_tags.count(tagging.first)) {
+          frequent_on.push_back(tagging.first);
+        }
+      }
+
+      for(size_t i = 0; i < frequent_on.size(); i++) {
+        for(size_t j = i + 1; j < frequent_on.size(); j++) {
+          auto a = frequent_on[i], b = frequent_on[j];
+          if(b < a) std::swap(a, b);
+          pair_counts[std::make_pair(a, b)]++;
+        }
+      }
+    }
+
+    for(auto&& pair : pair_counts) {
+      stats->pair_freq[pair.first] = (double)pair.second / sample.size();
+    }
+  }
+
+  // measure the cost of evaluating each of the leaf types against
+  // the sampled entities
+  if(sample.size()) {
+    Tag *probe = by_count.empty() ? sample[0] : by_count[0];
+
+    QueryClauseLit lit(probe, ALL_REL_MASK);
+    const QueryClause *lit_clause = &lit;
+    stats->lit_cost = time_per_call(sample, [&](const Tag *e) {
+      return lit_clause->matches_set(e->tags);
+    });
+
+    // a metanode that no tag belongs to, so every tag on the entity is checked
+    SCCMetaNode empty_node;
+    QueryClauseMetaNode meta(&empty_node, ALL_REL_MASK);
+    const QueryClause *meta_clause = &meta;
+    stats->meta_cost_per_tag = time_per_call(sample, [&](const Tag *e) {
+      return meta_clause->matches_set(e->tags);
+    }) / stats->avg_tags_per_entity;
+
+    QueryClauseMetaSet metaset(QueryClauseMetaSet::node_set({&empty_node}), ALL_REL_MASK);
+    const QueryClause *metaset_clause = &metaset;
+    stats->metaset_cost_per_tag = time_per_call(sample, [&](const Tag *e) {
+      return metaset_clause->matches_set(e->tags);
+    }) / stats->avg_tags_per_entity;
+
+    QueryClauseAny any;
+    const QueryClause *any_clause = &any;
+    stats->node_cost = time_per_call(sample, [&](const Tag *e) {
+      return any_clause->matches_set(e->tags);
+    });
+
+    if(probe->entities.size()) {
+      std::vector<Tag*> candidates(probe->entities.begin(), probe->entities.end());
+      stats->index_cost = time_per_call(candidates, [&](const Tag *e) {
+        return e->tags.size();
+      });
+    }
+  }
+
+  delete stats_;
+  stats_ = stats;
+  plan_version_++;
+}
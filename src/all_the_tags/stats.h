@@ -0,0 +1,85 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <unordered_map>
+#include <algorithm>
+#include <unordered_set>
+#include <utility>
+#include <functional>
+
+#include "all_the_tags/tag.h"
+
+struct Context;
+
+// statistics about the entities in a context, gathered by
+// `Context::analyze` and used by the cost based optimizer
+struct ContextStats {
+  // number of entities in the context, and how many of them were
+  // sampled to build the co-occurrence table
+  size_t num_entities;
+  size_t sample_size;
+  double avg_tags_per_entity;
+
+  // cost (in nanoseconds) of evaluating each clause type against a
+  // single entity. defaults are used until `Context::analyze` measures them
+  double lit_cost;          // probe of a QueryClauseLit
+  double meta_cost_per_tag; // QueryClauseMetaNode, per tag on the entity
+  double metaset_cost_per_tag; // QueryClauseMetaSet, per tag on the entity
+  double node_cost;         // dispatch through an interior (and/or/not) node
+  double index_cost;        // visiting one candidate from a posting list
+  double jit_node_factor;   // fraction of node_cost left once JIT compiled
+  double jit_compile_cost;  // one off cost of compiling a query
+
+  // sampled frequency of entities that have both tags of a pair,
+  // for pairs of the most frequent tags
+  struct tag_pair_hash {
+    std::size_t operator()(const std::pair<const Tag*, const Tag*>& p) const {
+      return std::hash<const Tag*>()(p.first) ^ (std::hash<const Tag*>()(p.second) << 1);
+    }
+  };
+  std::unordered_set<const Tag*> frequent_tags;
+  std::unordered_map<std::pair<const Tag*, const Tag*>, double, tag_pair_hash> pair_freq;
+
+  // if set, metanode and pair estimates come from the context's sketches
+  // (see `Context::approx_count`)
+  const Context *sketches;
+
+  ContextStats() :
+    num_entities(0),
+    sample_size(0),
+    avg_tags_per_entity(1),
+    lit_cost(20),
+    meta_cost_per_tag(5),
+    metaset_cost_per_tag(8),
+    node_cost(3),
+    index_cost(10),
+    jit_node_factor(0.3),
+    jit_compile_cost(50000),
+    sketches(nullptr)
+    {}
+
+  // fraction of entities tagged with 't'
+  double tag_freq(const Tag *t) const {
+    if(num_entities == 0) return 0;
+    return std::min(1.0, (double)t->entity_count() / num_entities);
+  }
+
+  // fraction of entities tagged with both 'a' and 'b', or -1 if the pair
+  // wasn't sampled (either tag isn't one of the frequent tags)
+  double pair_frequency(const Tag *a, const Tag *b) const {
+    if(a == b) return tag_freq(a);
+    if(!frequent_tags.count(a) || !frequent_tags.count(b)) return -1;
+
+    if(b < a) std::swap(a, b);
+    auto iter = pair_freq.find(std::make_pair(a, b));
+    if(iter != pair_freq.end()) {
+      return iter->second;
+    }
+
+    // never seen together in the sample; bound it by what the sample
+    // could have missed
+    return std::min(tag_freq(a) * tag_freq(b), 1.0 / (2 * sample_size + 1));
+  }
+};
+
+#endif /* __STATS_H__ */
@@ -10,10 +10,14 @@ bool Tag::imply(Tag *other) {
   auto b = implies.insert(other).second;
   assert(a == b);
 
-  if(a) context->dirty_tag_imply_dag(this, true, other);
+  if(a) {
+    context->dirty_tag_imply_dag(this, true, other);
+    context->standing_implication_changed(other);
+  }
 
-  assert(this->meta_node());
-  assert(other->meta_node());
+  // while the context is dirty, the metanodes are left for make_clean
+  assert(context->is_dirty() || this->meta_node());
+  assert(context->is_dirty() || other->meta_node());
   return a;
 }
 bool Tag::unimply(Tag *other) {
@@ -28,7 +32,17 @@ bool Tag::unimply(Tag *other) {
     assert(false);
   }
 
-  if(a) context->dirty_tag_imply_dag(this, false, other);
+  if(a) {
+    context->dirty_tag_imply_dag(this, false, other);
+    context->standing_implication_changed(other);
+  }
 
   return a;
 }
+
+void Tag::tagging_changed(Tag *t) {
+  context->sketch_tagging_changed(this, t);
+  context->closure_tagging_changed(this, t);
+  context->snapshot_tagging_changed(this);
+  context->standing_tagging_changed(this, t);
+}
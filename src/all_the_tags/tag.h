@@ -3,10 +3,12 @@
 
 #include <unordered_set>
 #include <unordered_map>
+#include <atomic>
 #include <cassert>
 #include <iostream>
 
 #include "all_the_tags/id.h"
+#include "all_the_tags/sketch.h"
 
 // needs forward declaration because C++ uses goddamn textual inclusion
 struct Context;
@@ -18,6 +20,11 @@ struct Tag {
   using tagging_map = std::unordered_map<Tag*, rel_type>;
   tagging_map tags;
 
+  // inverse of 'tags': the entities that have been tagged with this tag
+  // (used as the posting list when a query is run against the index)
+  using entity_set = std::unordered_set<Tag*>;
+  entity_set entities;
+
   using implied_set = std::unordered_set<
     Tag*,
     std::hash<Tag*>,
@@ -30,38 +37,63 @@ struct Tag {
 
   Context *context;
 
-  // DAG SCC meta node that the tag belongs to
+  // index of the tag in the graph Context::make_clean finds the SCCs of
+  uint32_t scc_index;
+
+  // the tag's slot in the context's snapshots (see `SnapshotStore`)
+  uint32_t snapshot_slot;
+
+  // DAG SCC meta node that the tag belongs to. atomic so that snapshots
+  // can be queried while the metagraph changes (see `ContextSnapshot`),
+  // which costs nothing over a plain pointer when relaxed
 private:
-  SCCMetaNode *meta_node_;
+  std::atomic<SCCMetaNode*> meta_node_;
 
 public:
   SCCMetaNode* meta_node() const {
-    return meta_node_;
+    return meta_node_.load(std::memory_order_relaxed);
   }
   SCCMetaNode* set_meta_node(SCCMetaNode* node) {
     assert(node);
-    this->meta_node_ = node;
+    this->meta_node_.store(node, std::memory_order_relaxed);
     return node;
   }
   void clear_meta_node() {
-    this->meta_node_ = nullptr;
+    this->meta_node_.store(nullptr, std::memory_order_relaxed);
   }
 
   // how many entities have this particular tag
   int _entity_count;
 
+  // sketch of 'entities', made once there are more than SKETCH_K of them
+  // and kept until there are SKETCH_K / 2 (see `Context::approx_count`)
+  EntitySketch *sketch;
+
 public:
   Tag(Context *context_, id_type _id) :
     id(_id),
     context(context_),
+    scc_index(0),
+    snapshot_slot(0),
     meta_node_(nullptr),
-    _entity_count(0) {}
+    _entity_count(0),
+    sketch(nullptr) {}
+  ~Tag() {
+    delete sketch;
+  }
 
   // tag imply/unimply
   // this tag implies -> other tag
   bool imply(Tag *other);
   bool unimply(Tag *other);
 
+  // called once this entity has gained or lost 't' (or some of its rel
+  // bits). tells the context, which updates the sketches of 't' and its
+  // metanode, the closure sets holding it and the snapshots of this
+  // entity, in that order, and only then the standing queries, so their
+  // callbacks see all of those up to date
+  void tagging_changed(Tag *t);
+
   int entity_count() const {
     return _entity_count;
   }
@@ -96,9 +128,13 @@ public:
     }
     else {
       success = tags.insert(std::make_pair(t, rel)).second;
-      if(success) t->inc_entity_count();
+      if(success) {
+        t->entities.insert(this);
+        t->inc_entity_count();
+      }
     }
 
+    if(success) tagging_changed(t);
     return success;
   }
 
@@ -115,7 +151,9 @@ public:
       // would clear all relationship tags on it
       const auto _erased = tags.erase(t);
       assert(_erased == 1);
+      t->entities.erase(this);
       t->dec_entity_count();
+      tagging_changed(t);
       return true;
     }
     else {
@@ -126,6 +164,7 @@ public:
       }
       else {
         (*twr).second = rels_removed;
+        tagging_changed(t);
         return true;
       }
     }
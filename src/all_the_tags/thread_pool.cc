@@ -0,0 +1,222 @@
+#include "all_the_tags/thread_pool.h"
+
+#include <cassert>
+#include <algorithm>
+
+// the pool, and the worker in it, the calling thread belongs to
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local unsigned current_index = 0;
+
+ThreadPool::ThreadPool(unsigned num_threads) :
+  queued_(0),
+  sleeping_(0),
+  pending_(0),
+  stopping_(false) {
+  for(unsigned i = 0; i < num_threads; i++) {
+    workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+  }
+  // only started once every deque is there to steal from
+  for(unsigned i = 0; i < num_threads; i++) {
+    workers_[i]->thread = std::thread([this, i]() { worker(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for(auto&& w : workers_) {
+    w->thread.join();
+  }
+  assert(queue_.empty() && queued_ == 0);
+}
+
+ThreadPool& ThreadPool::shared() {
+  static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+  return pool;
+}
+
+ThreadPool::Worker *ThreadPool::current_worker() {
+  return current_pool == this ? workers_[current_index].get() : nullptr;
+}
+
+void ThreadPool::submit(task_type task) {
+  pending_++;
+
+  // a task's tasks go on its worker's own deque, to be run by it (or
+  // stolen) before those from outside
+  auto self = current_worker();
+  if(self) {
+    std::unique_lock<std::mutex> lock(self->mutex);
+    self->tasks.push_back(std::move(task));
+    queued_++;
+  }
+  else {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(task));
+    queued_++;
+  }
+
+  // sleepers count themselves before checking 'queued_', so one of the
+  // two sees the other
+  if(sleeping_.load()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.notify_one();
+  }
+}
+
+bool ThreadPool::take(task_type& task) {
+  if(!queued_.load()) return false;
+
+  auto self = current_worker();
+  if(self) {
+    std::unique_lock<std::mutex> lock(self->mutex);
+    if(self->tasks.size()) {
+      task = std::move(self->tasks.back());
+      self->tasks.pop_back();
+      queued_--;
+      return true;
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if(queue_.size()) {
+      task = std::move(queue_.front());
+      queue_.pop_front();
+      queued_--;
+      return true;
+    }
+  }
+
+  // steal the oldest task of another worker, which is likely to be the
+  // biggest: tasks split their work in halves, newest last
+  const unsigned n = workers_.size();
+  const unsigned first = self ? current_index + 1 : 0;
+  for(unsigned i = 0; i < n; i++) {
+    auto& victim = *workers_[(first + i) % n];
+    if(&victim == self) continue;
+
+    std::unique_lock<std::mutex> lock(victim.mutex);
+    if(victim.tasks.size()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::run(task_type& task) {
+  task();
+  task = nullptr;
+
+  if(--pending_ == 0) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.notify_all();
+  }
+}
+
+void ThreadPool::help_until(const std::function<bool()>& done) {
+  while(!done()) {
+    task_type task;
+    if(take(task)) {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_++;
+    work_cv_.wait(lock, [&]() { return queued_.load() || done(); });
+    sleeping_--;
+  }
+
+  // don't keep a wakeup meant for a worker to ourselves
+  if(queued_.load() && sleeping_.load()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.notify_one();
+  }
+}
+
+void ThreadPool::worker(unsigned index) {
+  current_pool = this;
+  current_index = index;
+
+  while(true) {
+    task_type task;
+    if(take(task)) {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_++;
+    work_cv_.wait(lock, [this]() { return stopping_ || queued_.load(); });
+    sleeping_--;
+    if(stopping_ && !queued_.load()) return;
+  }
+}
+
+void ThreadPool::wait() {
+  assert(!current_worker() && "ThreadPool::wait called from a task");
+  help_until([this]() { return pending_.load() == 0; });
+}
+
+void TaskGroup::run(ThreadPool::task_type task) {
+  if(!pool_) {
+    task();
+    return;
+  }
+
+  pending_++;
+  auto pool = pool_;
+  pool->submit([this, pool, task]() {
+    task();
+    // the group may be gone as soon as the count drops
+    if(--pending_ == 0) {
+      std::unique_lock<std::mutex> lock(pool->mutex_);
+      pool->work_cv_.notify_all();
+    }
+  });
+}
+
+void TaskGroup::wait() {
+  if(!pool_) return;
+  pool_->help_until([this]() { return pending_.load() == 0; });
+}
+
+void parallel_for(ThreadPool *pool, size_t n, size_t parts,
+  const std::function<void(size_t, size_t, size_t)>& fn) {
+  TaskGroup group(pool);
+  for(size_t part = 0; part < parts; part++) {
+    const size_t begin = n * part / parts, end = n * (part + 1) / parts;
+    group.run([&fn, part, begin, end]() { fn(part, begin, end); });
+  }
+  group.wait();
+}
+
+void parallel_morsels(ThreadPool *pool, size_t n, size_t grain,
+  const std::function<void(size_t, size_t, size_t)>& fn) {
+  assert(grain > 0);
+  const size_t num_morsels = (n + grain - 1) / grain;
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    size_t morsel;
+    while((morsel = next++) < num_morsels) {
+      fn(morsel, morsel * grain, std::min(n, (morsel + 1) * grain));
+    }
+  };
+
+  // a task per thread that could help, each taking morsels until they've
+  // run out. the calling thread takes them too
+  TaskGroup group(pool);
+  const size_t helpers = pool ? std::min<size_t>(pool->size(), num_morsels ? num_morsels - 1 : 0) : 0;
+  for(size_t i = 0; i < helpers; i++) {
+    group.run(work);
+  }
+  work();
+  group.wait();
+}
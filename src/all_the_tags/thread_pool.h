@@ -0,0 +1,113 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// a fixed set of worker threads running queued tasks, by work stealing:
+// each worker has a deque of its own, taking the tasks it submitted from
+// the back (newest first, while what they touch is still in cache), and
+// when it runs out, tasks submitted from outside the pool in the order
+// they came, then the oldest tasks of the other workers. threads waiting
+// on tasks (see `TaskGroup`) run queued tasks rather than sit idle, so
+// nested parallel work never needs more threads than the pool has, and
+// any number of callers can share one pool without oversubscribing it.
+//
+// a pool of one worker runs the tasks submitted from outside it in order,
+// as long as nothing calls `wait`
+struct ThreadPool {
+  using task_type = std::function<void()>;
+
+  ThreadPool(unsigned num_threads);
+  ThreadPool(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  unsigned size() const {
+    return workers_.size();
+  }
+
+  void submit(task_type task);
+
+  // runs queued tasks on the calling thread too, until all have finished.
+  // must not be called from a task
+  void wait();
+
+  // a pool for the whole process, with a worker for each core but the
+  // calling thread's, made on first use. on a single core it has none,
+  // and those waiting on its tasks run them
+  static ThreadPool& shared();
+
+private:
+  friend struct TaskGroup;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<task_type> tasks;
+    std::thread thread;
+  };
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // tasks submitted from outside the pool
+  std::mutex mutex_;
+  std::deque<task_type> queue_;
+
+  // workers, and threads waiting on tasks, sleep on 'work_cv_' while
+  // nothing is queued. 'queued_' counts the tasks in every deque
+  std::condition_variable work_cv_;
+  std::atomic<size_t> queued_;
+  std::atomic<unsigned> sleeping_;
+
+  // tasks submitted and not yet finished
+  std::atomic<size_t> pending_;
+  bool stopping_;
+
+  void worker(unsigned index);
+  // the calling thread's worker, if it's one of this pool's
+  Worker *current_worker();
+  // take a task to run, from the calling thread's worker first
+  bool take(task_type& task);
+  void run(task_type& task);
+  // run queued tasks until 'done' returns true
+  void help_until(const std::function<bool()>& done);
+};
+
+// tasks run on a pool (or one after the other, on the calling thread, if
+// the pool is null) that can be waited on apart from the pool's others.
+// tasks may add more tasks to their group, or wait on groups of their own
+struct TaskGroup {
+  TaskGroup(ThreadPool *pool) : pool_(pool), pending_(0) {}
+  TaskGroup(const TaskGroup&) = delete;
+  ~TaskGroup() {
+    wait();
+  }
+
+  void run(ThreadPool::task_type task);
+
+  // runs the pool's queued tasks until the group's have finished
+  void wait();
+
+private:
+  ThreadPool *pool_;
+  std::atomic<size_t> pending_;
+};
+
+// calls fn(part, begin, end) for each of 'parts' ranges splitting [0, n),
+// on the pool's threads, or one after the other if 'pool' is null
+void parallel_for(ThreadPool *pool, size_t n, size_t parts,
+  const std::function<void(size_t, size_t, size_t)>& fn);
+
+// calls fn(morsel, begin, end) for each range of 'grain' splitting [0, n)
+// (the last may be shorter). rather than each thread getting an equal
+// share up front, every thread takes the next morsel as it finishes the
+// last, so the threads finish together however uneven the work in the
+// morsels is. runs on the calling thread if 'pool' is null
+void parallel_morsels(ThreadPool *pool, size_t n, size_t grain,
+  const std::function<void(size_t, size_t, size_t)>& fn);
+
+#endif /* __THREAD_POOL_H__ */
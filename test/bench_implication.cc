@@ -0,0 +1,299 @@
+#include <hayai.hpp>
+#include "test_helper.h"
+
+#include <algorithm>
+#include <thread>
+
+class DiamondLatticeBench : public ::hayai::Fixture
+{
+public:
+  Context c;
+  std::vector<std::vector<Tag*>> lattice;
+
+  virtual void SetUp() {
+    // 40 levels of 16 tags, each implying two tags on the level below:
+    // the number of paths to the bottom doubles every level
+    const int levels = 40, width = 16;
+
+    lattice.resize(levels);
+    for(auto&& level : lattice) {
+      for(int i = 0; i < width; i++) { level.push_back(c.new_tag()); }
+    }
+    for(int l = 0; l + 1 < levels; l++) {
+      for(int i = 0; i < width; i++) {
+        lattice[l][i]->imply(lattice[l + 1][i]);
+        lattice[l][i]->imply(lattice[l + 1][(i + 1) % width]);
+      }
+    }
+  }
+};
+
+BENCHMARK_F(DiamondLatticeBench, BuildLitBottom, 10, 100) {
+  auto q = build_lit(lattice.back()[0]);
+  delete q;
+}
+
+BENCHMARK_F(DiamondLatticeBench, BuildLitEveryLevel, 10, 10) {
+  // closures computed for the levels above are reused on the way down
+  for(auto&& level : lattice) {
+    auto q = build_lit(level[0]);
+    delete q;
+  }
+}
+
+class ImportBench : public ::hayai::Fixture
+{
+public:
+  const int n = 2000;
+  std::vector<std::pair<int, int>> edges;
+
+  virtual void SetUp() {
+    // a random DAG over n tags, its edges added in random order
+    srand(39);
+    edges.clear();
+    for(int i = 0; i < 4 * n; i++) {
+      int from = rand() % (n - 1);
+      int to = from + 1 + rand() % (n - 1 - from);
+      edges.push_back(std::make_pair(from, to));
+    }
+    std::random_shuffle(edges.begin(), edges.end());
+  }
+};
+
+BENCHMARK_F(ImportBench, ShuffledDagEdges, 5, 5) {
+  Context c;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < n; i++) { tags.push_back(c.new_tag()); }
+  for(auto&& edge : edges) {
+    tags[edge.first]->imply(tags[edge.second]);
+  }
+}
+
+BENCHMARK_F(ImportBench, ShuffledDagEdgesImplyMany, 5, 5) {
+  Context c;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < n; i++) { tags.push_back(c.new_tag()); }
+  std::vector<Context::imply_edge> batch;
+  for(auto&& edge : edges) {
+    batch.push_back(std::make_pair(tags[edge.first], tags[edge.second]));
+  }
+  c.imply_many(batch);
+}
+
+BENCHMARK_F(ImportBench, ChainThenCycle, 5, 5) {
+  // every edge but the last goes forward; the last collapses the chain
+  Context c;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < n; i++) { tags.push_back(c.new_tag()); }
+  for(int i = 0; i + 1 < n; i++) {
+    tags[i]->imply(tags[i + 1]);
+  }
+  tags.back()->imply(tags.front());
+}
+
+// rebuilds the metagraph from scratch with make_clean
+class RebuildBench : public ::hayai::Fixture
+{
+public:
+  Context c;
+  std::vector<Tag*> tags;
+
+  void make_tags(int n) {
+    for(int i = 0; i < n; i++) { tags.push_back(c.new_tag()); }
+    // the implications are added all at once, then the metagraph built
+    c.mark_dirty();
+  }
+
+  void rebuild() {
+    c.mark_dirty();
+    c.make_clean();
+  }
+};
+
+class ChainRebuildBench : public RebuildBench {
+public:
+  virtual void SetUp() {
+    make_tags(100000);
+    for(size_t i = 0; i + 1 < tags.size(); i++) {
+      tags[i]->imply(tags[i + 1]);
+    }
+    c.make_clean();
+  }
+};
+
+BENCHMARK_F(ChainRebuildBench, Chain100k, 5, 5) {
+  rebuild();
+}
+
+class WideDagRebuildBench : public RebuildBench {
+public:
+  virtual void SetUp() {
+    // 100 roots each implying the same 1000 tags, each implying one of 10
+    make_tags(100 + 1000 + 10);
+    for(int r = 0; r < 100; r++) {
+      for(int m = 0; m < 1000; m++) {
+        tags[r]->imply(tags[100 + m]);
+      }
+    }
+    for(int m = 0; m < 1000; m++) {
+      tags[100 + m]->imply(tags[1100 + m % 10]);
+    }
+    c.make_clean();
+  }
+};
+
+BENCHMARK_F(WideDagRebuildBench, WideDag100k, 5, 5) {
+  rebuild();
+}
+
+class CycleRebuildBench : public RebuildBench {
+public:
+  virtual void SetUp() {
+    make_tags(100000);
+    for(size_t i = 0; i < tags.size(); i++) {
+      tags[i]->imply(tags[(i + 1) % tags.size()]);
+    }
+    c.make_clean();
+  }
+};
+
+BENCHMARK_F(CycleRebuildBench, Cycle100k, 5, 5) {
+  rebuild();
+}
+
+// a big random graph: mostly forward edges, and some back edges making
+// components of all sizes. rebuilt on the calling thread, then on a pool
+class RandomRebuildBench : public RebuildBench {
+public:
+  void make_graph(unsigned threads) {
+    const int n = 200000;
+    make_tags(n);
+    srand(41);
+    for(int i = 0; i < 4 * n; i++) {
+      int from = rand() % n, to = rand() % n;
+      if(rand() % 1000 && from > to) std::swap(from, to);
+      if(from != to) tags[from]->imply(tags[to]);
+    }
+    c.set_rebuild_threads(threads, 0);
+    c.make_clean();
+  }
+};
+
+class SerialRebuildBench : public RandomRebuildBench {
+public:
+  virtual void SetUp() {
+    make_graph(1);
+  }
+};
+
+BENCHMARK_F(SerialRebuildBench, Random200k, 3, 3) {
+  rebuild();
+}
+
+class ParallelRebuildBench : public RandomRebuildBench {
+public:
+  virtual void SetUp() {
+    make_graph(std::max(2u, std::thread::hardware_concurrency()));
+  }
+};
+
+BENCHMARK_F(ParallelRebuildBench, Random200k, 3, 3) {
+  rebuild();
+}
+
+// reachability between random metanodes of a big random DAG
+class ReachBench : public ::hayai::Fixture
+{
+public:
+  Context c;
+  std::vector<Tag*> tags;
+
+  virtual void SetUp() {
+    const int n = 100000;
+    for(int i = 0; i < n; i++) { tags.push_back(c.new_tag()); }
+    srand(43);
+    std::vector<Context::imply_edge> edges;
+    for(int i = 0; i < 3 * n; i++) {
+      int from = rand() % n, to = rand() % n;
+      if(from > to) std::swap(from, to);
+      if(from != to) edges.push_back(std::make_pair(tags[from], tags[to]));
+    }
+    c.imply_many(edges);
+    c.reaches(tags[0]->meta_node(), tags[1]->meta_node());
+  }
+};
+
+BENCHMARK_F(ReachBench, RandomPairs, 5, 5) {
+  for(int i = 0; i < 10000; i++) {
+    c.implies(tags[rand() % tags.size()], tags[rand() % tags.size()]);
+  }
+}
+
+BENCHMARK_F(ReachBench, Descendants, 5, 5) {
+  std::vector<SCCMetaNode*> out;
+  for(int i = 0; i < 10; i++) {
+    out.clear();
+    c.descendants(tags[rand() % 1000]->meta_node(), out);
+  }
+}
+
+// a taxonomy where every tag implies all of the tags above it, not just
+// its parent: most of the edges are redundant
+class TaxonomyBench : public ::hayai::Fixture
+{
+public:
+  Context c;
+  Tag *root, *x, *y;
+
+  void make_taxonomy(bool reduce) {
+    c.set_transitive_reduction(reduce);
+    c.mark_dirty();
+    root = c.new_tag();
+    std::vector<std::vector<Tag*>> above = {{root}};
+    std::vector<std::vector<Tag*>> level = above;
+    for(int depth = 0; depth < 5; depth++) {
+      std::vector<std::vector<Tag*>> next;
+      for(auto&& path : level) {
+        for(int i = 0; i < 8; i++) {
+          auto tag = c.new_tag();
+          for(auto t : path) { tag->imply(t); }
+          next.push_back(path);
+          next.back().push_back(tag);
+        }
+      }
+      level = next;
+    }
+    c.make_clean();
+    x = c.new_tag();
+    y = c.new_tag();
+  }
+
+  // walks every metanode, after a change to what reaches what
+  void closure_of_root() {
+    x->imply(y);
+    x->unimply(y);
+    delete build_lit(root);
+  }
+};
+
+class FullTaxonomyBench : public TaxonomyBench {
+public:
+  virtual void SetUp() {
+    make_taxonomy(false);
+  }
+};
+
+BENCHMARK_F(FullTaxonomyBench, RootClosure, 10, 10) {
+  closure_of_root();
+}
+
+class ReducedTaxonomyBench : public TaxonomyBench {
+public:
+  virtual void SetUp() {
+    make_taxonomy(true);
+  }
+};
+
+BENCHMARK_F(ReducedTaxonomyBench, RootClosure, 10, 10) {
+  closure_of_root();
+}
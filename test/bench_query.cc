@@ -1,5 +1,7 @@
 #include <hayai.hpp>
 #include "test_helper.h"
+#include "all_the_tags/plan_cache.h"
+#include "all_the_tags/sharded.h"
 
 class BenchQuery : public ::hayai::Fixture
 {
@@ -97,6 +99,30 @@ BENCHMARK_F(BenchQuery, QueryForQux, 10, 100) {
   assert(count == 2000);
 }
 
+BENCHMARK_F(BenchQuery, ApproxCountQux, 10, 100) {
+  // from the sketches of qux and baz, instead of visiting the matches
+  double count = c.approx_count(q_qux);
+  assert(count > 1800 && count < 2200);
+}
+
+BENCHMARK_F(BenchQuery, ParseAndPlan1000, 10, 20) {
+  std::vector<id_type> params = {foo->id, bar->id, qux->id};
+  for(int i = 0; i < 1000; i++) {
+    auto plan = plan_query(c, parse_query(c, "($0 & $1:1) | !$2", params));
+    delete plan;
+  }
+}
+
+BENCHMARK_F(BenchQuery, CachedPlan1000, 10, 20) {
+  // the same query as ParseAndPlan1000, only parsed and planned once
+  PlanCache cache(c);
+  std::vector<id_type> params = {foo->id, bar->id, qux->id};
+  for(int i = 0; i < 1000; i++) {
+    auto plan = cache.get("($0 & $1:1) | !$2", params);
+    assert(plan);
+  }
+}
+
 class DeepBenchQuery : public ::hayai::Fixture
 {
 public:
@@ -208,3 +234,211 @@ BENCHMARK_F(DeepBenchQuery, OptQueryC, 10, 100) {
   // matches all posts
   assert(count == 2200);
 }
+
+class WideImplicationBenchQuery : public ::hayai::Fixture
+{
+public:
+  Context c;
+  Tag *top;
+  QueryClause *query_set, *query_or_chain;
+
+  virtual void SetUp() {
+    top = c.new_tag();
+
+    // 64 tags all implying 'top', each its own metanode
+    for(int i = 0; i < 64; i++) {
+      auto t = c.new_tag();
+      t->imply(top);
+      for(int j = 0; j < 20; j++) {
+        auto e = c.new_tag();
+        e->add_tag(t);
+        e->add_tag(c.new_tag());
+      }
+    }
+    for(int i = 0; i < 2000; i++) { c.new_tag()->add_tag(c.new_tag()); }
+
+    // a single metanode set leaf, and the equivalent 'or' of every metanode
+    query_set = build_lit(top);
+    query_or_chain = nullptr;
+    for(auto node : c.meta_nodes) {
+      auto leaf = new QueryClauseMetaNode(node, ALL_REL_MASK);
+      query_or_chain = query_or_chain ? build_or(query_or_chain, leaf) : (QueryClause*)leaf;
+    }
+  }
+
+  virtual void TearDown() {
+    delete query_set;
+    delete query_or_chain;
+  }
+};
+
+BENCHMARK_F(WideImplicationBenchQuery, QueryMetaSet, 10, 100) {
+  int count = 0;
+  c.query(query_set, [&](Tag const* e) {
+    count++;
+  });
+
+  assert(count == 64 * 20);
+}
+
+BENCHMARK_F(WideImplicationBenchQuery, QueryMetaNodeOrChain, 10, 100) {
+  int count = 0;
+  c.query(query_or_chain, [&](Tag const* e) {
+    count++;
+  });
+
+  assert(count == 64 * 20);
+}
+
+class BatchBenchQuery : public ::hayai::Fixture
+{
+public:
+  Context c;
+  std::vector<Tag*> tags;
+  std::vector<QueryClause*> queries;
+
+  virtual void SetUp() {
+    for(int i = 0; i < 20; i++) { tags.push_back(c.new_tag()); }
+
+    // entities with a few of the tags each
+    for(int i = 0; i < 10000; i++) {
+      auto e = c.new_tag();
+      for(int j = 0; j < 3; j++) {
+        e->add_tag(tags[(i * 7 + j * 13) % tags.size()]);
+      }
+    }
+
+    // 50 queries over the same handful of tags, like a dashboard
+    for(int i = 0; i < 50; i++) {
+      auto t1 = tags[i % 5], t2 = tags[5 + i % 3], t3 = tags[10 + i % 7];
+      queries.push_back(build_or(build_and(build_lit(t1), build_lit(t2)), build_not(build_lit(t3))));
+    }
+  }
+
+  virtual void TearDown() {
+    for(auto q : queries) {
+      delete q;
+    }
+  }
+};
+
+BENCHMARK_F(BatchBenchQuery, SeparateScans50, 10, 10) {
+  long count = 0;
+  for(auto q : queries) {
+    c.query(q, [&](Tag *e) {
+      (void)e;
+      count++;
+    });
+  }
+  assert(count > 0);
+}
+
+BENCHMARK_F(BatchBenchQuery, SharedScan50, 10, 10) {
+  QueryBatch batch;
+  for(auto q : queries) {
+    batch.add(q);
+  }
+
+  std::vector<long> counts;
+  c.count(&batch, counts);
+  assert(counts.size() == queries.size());
+}
+
+// a mix of writes and queries, routed to one shard or spread over four
+class ShardedBenchQuery : public ::hayai::Fixture
+{
+public:
+  std::unique_ptr<ShardedContext> sharded;
+  id_type next_write;
+
+  virtual size_t num_shards() const = 0;
+
+  virtual void SetUp() {
+    sharded.reset(new ShardedContext(num_shards()));
+    for(id_type t = 0; t < 20; t++) { sharded->new_tag(t); }
+    sharded->imply(1, 2);
+    sharded->imply(2, 3);
+    for(id_type e = 100; e < 40100; e++) {
+      sharded->new_entity(e);
+      sharded->add_tag(e, e % 20);
+    }
+    sharded->flush();
+    next_write = 100;
+  }
+
+  virtual void TearDown() {
+    sharded.reset();
+  }
+
+  void mixed() {
+    // 20 writes to each query
+    for(int q = 0; q < 10; q++) {
+      for(int w = 0; w < 200; w++) {
+        const id_type e = 100 + (next_write++ * 7919) % 40000;
+        sharded->add_tag(e, (e / 20) % 20);
+      }
+      ShardedQueryOptions options;
+      options.limit = 20;
+      ShardedQueryResult result;
+      sharded->query("3 & !5", result, options);
+      assert(result.ids.size() == 20);
+    }
+  }
+};
+
+class OneShardBenchQuery : public ShardedBenchQuery
+{
+public:
+  virtual size_t num_shards() const { return 1; }
+};
+
+class FourShardBenchQuery : public ShardedBenchQuery
+{
+public:
+  virtual size_t num_shards() const { return 4; }
+};
+
+BENCHMARK_F(OneShardBenchQuery, Mixed, 5, 10) {
+  mixed();
+}
+
+BENCHMARK_F(FourShardBenchQuery, Mixed, 5, 10) {
+  mixed();
+}
+
+// a scan where the matches cluster: ids hash to consecutive buckets, and
+// only the first quarter of the entities have tags to test
+class ParallelBenchQuery : public ::hayai::Fixture
+{
+public:
+  Context c;
+  QueryPlan *plan;
+  std::vector<Tag*> matches;
+
+  virtual void SetUp() {
+    std::vector<Tag*> tags;
+    for(int t = 0; t < 16; t++) { tags.push_back(c.new_tag()); }
+    for(int i = 0; i < 200000; i++) {
+      auto e = c.new_tag();
+      if(i < 50000) {
+        for(int t = 0; t < 8; t++) { e->add_tag(tags[(i + t * 3) % 16]); }
+      }
+    }
+    plan = plan_query(c, build_or(build_and(build_lit(tags[0]), build_not(build_lit(tags[5]))),
+      build_and(build_lit(tags[7]), build_lit(tags[9]))));
+    c.set_query_pool(&ThreadPool::shared());
+  }
+
+  virtual void TearDown() {
+    delete plan;
+  }
+};
+
+BENCHMARK_F(ParallelBenchQuery, Serial, 5, 10) {
+  matches.clear();
+  c.query(plan, [&](Tag *e) { matches.push_back(e); });
+}
+
+BENCHMARK_F(ParallelBenchQuery, Morsels, 5, 10) {
+  c.query_parallel(plan, matches);
+}
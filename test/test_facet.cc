@@ -0,0 +1,155 @@
+#include "test_helper.h"
+
+#include <map>
+
+class FacetTest : public ::testing::Test {
+public:
+  Context ctx;
+  std::vector<Tag*> tags;
+  Tag *common, *rare;
+
+  void SetUp() {
+    for(int i = 0; i < 10; i++) { tags.push_back(ctx.new_tag()); }
+    common = tags[0];
+    rare = tags[1];
+
+    for(int i = 0; i < 2000; i++) {
+      auto e = ctx.new_tag();
+      e->add_tag(common, 1 + (i % 3));
+      if(i % 100 == 0) e->add_tag(rare);
+      for(int j = 2; j < 10; j++) {
+        if(i % j == 0) e->add_tag(tags[j], (rel_type)1 << (i % 4));
+      }
+    }
+  }
+
+  // facet counts worked out by hand: tag -> (count, rel bit counts)
+  std::map<Tag*, std::pair<long, std::vector<long>>> expected(const QueryClause *q) {
+    std::map<Tag*, std::pair<long, std::vector<long>>> counts;
+    ctx.query(q, [&](Tag *e) {
+      for(auto&& tagging : e->tags) {
+        auto& count = counts[tagging.first];
+        count.first++;
+        count.second.resize(NUM_REL_BITS);
+        for(int bit = 0; bit < NUM_REL_BITS; bit++) {
+          if(tagging.second & ((rel_type)1 << bit)) count.second[bit]++;
+        }
+      }
+    });
+    return counts;
+  }
+
+  void check(const QueryPlan *plan, const FacetOptions& options) {
+    FacetResult result;
+    ASSERT_GT(ctx.facet(plan, result, options), 0);
+    ASSERT_EQ(query(ctx, *plan->clause).size(), result.matches);
+
+    auto counts = expected(plan->clause);
+    if(options.candidates.empty() && !options.top_k) {
+      ASSERT_EQ(counts.size(), result.counts.size());
+    }
+
+    for(size_t i = 0; i < result.counts.size(); i++) {
+      auto& count = result.counts[i];
+      ASSERT_EQ(counts[count.tag].first, count.count);
+      if(options.per_rel) {
+        ASSERT_EQ(counts[count.tag].second, count.rel_counts);
+      }
+      else {
+        ASSERT_TRUE(count.rel_counts.empty());
+      }
+      if(i) { ASSERT_GE(result.counts[i - 1].count, count.count); }
+    }
+  }
+};
+
+TEST_F(FacetTest, CountsEveryTag) {
+  auto plan = plan_query(ctx, build_not(build_lit(rare)));
+  ASSERT_EQ(QueryEngine_Scan, plan->engine);
+
+  FacetOptions options;
+  check(plan, options);
+  options.per_rel = true;
+  check(plan, options);
+
+  FacetResult result;
+  ctx.facet(plan, result, options);
+  ASSERT_EQ(common, result.counts[0].tag);
+  ASSERT_EQ(1980, result.counts[0].count);
+  delete plan;
+}
+
+TEST_F(FacetTest, UsesIndex) {
+  auto plan = plan_query(ctx, build_or(build_lit(rare), build_lit(tags[9])));
+  ASSERT_EQ(QueryEngine_Index, plan->engine);
+
+  FacetOptions options;
+  options.per_rel = true;
+  FacetResult result;
+  // only the posting lists are visited
+  ASSERT_LT(ctx.facet(plan, result, options), 300);
+  check(plan, options);
+  delete plan;
+}
+
+TEST_F(FacetTest, CandidatesAndTopK) {
+  auto plan = plan_query(ctx, build_not(build_lit(tags[3])));
+
+  FacetOptions options;
+  options.candidates = {tags[2], rare, tags[3]};
+  check(plan, options);
+
+  FacetResult result;
+  ctx.facet(plan, result, options);
+  ASSERT_EQ(3, result.counts.size());
+  // reported, even though nothing matching has it
+  ASSERT_EQ(tags[3], result.counts.back().tag);
+  ASSERT_EQ(0, result.counts.back().count);
+
+  options.candidates.clear();
+  options.top_k = 2;
+  check(plan, options);
+  ctx.facet(plan, result, options);
+  ASSERT_EQ(2, result.counts.size());
+  ASSERT_EQ(common, result.counts[0].tag);
+  ASSERT_EQ(tags[2], result.counts[1].tag);
+  delete plan;
+}
+
+TEST_F(FacetTest, Threaded) {
+  ThreadPool pool(3);
+  ctx.set_query_pool(&pool, 0);
+
+  for(QueryClause *q : std::vector<QueryClause*>{build_lit(tags[2]), build_or(build_lit(rare), build_lit(tags[9])), build_lit(rare)}) {
+    auto plan = plan_query(ctx, q);
+
+    FacetOptions options;
+    options.per_rel = true;
+    FacetResult serial;
+    long visited = ctx.facet(plan, serial, options);
+
+    for(unsigned threads : {2, 3, 8}) {
+      options.num_threads = threads;
+      FacetResult parallel;
+      ASSERT_EQ(visited, ctx.facet(plan, parallel, options));
+      ASSERT_EQ(serial.matches, parallel.matches);
+      ASSERT_EQ(serial.counts.size(), parallel.counts.size());
+      for(size_t i = 0; i < serial.counts.size(); i++) {
+        ASSERT_EQ(serial.counts[i].tag, parallel.counts[i].tag);
+        ASSERT_EQ(serial.counts[i].count, parallel.counts[i].count);
+        ASSERT_EQ(serial.counts[i].rel_counts, parallel.counts[i].rel_counts);
+      }
+    }
+    delete plan;
+  }
+
+  // a dirty context is still faceted, until the metagraph is rebuilt
+  auto plan = plan_query(ctx, build_lit(rare));
+  ctx.mark_dirty();
+  FacetResult result;
+  ASSERT_LE(0, ctx.facet(plan, result));
+  ctx.make_clean();
+  ASSERT_EQ(ERR_PLAN_STALE, ctx.facet(plan, result));
+  delete plan;
+  ctx.set_query_pool(nullptr);
+}
@@ -0,0 +1,165 @@
+#include "test_helper.h"
+#include "all_the_tags/mutation_queue.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <map>
+
+class MutationQueueTest : public ::testing::Test {
+public:
+  Context ctx;
+
+  // holds the applier in a `call` until released, so what's queued
+  // meanwhile is applied as one batch
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool held, released;
+
+  MutationQueueTest() : held(false), released(false) {}
+
+  void hold(MutationQueue& queue) {
+    queue.call([this](Context&) {
+      std::unique_lock<std::mutex> lock(mutex);
+      held = true;
+      cv.notify_all();
+      cv.wait(lock, [this]() { return released; });
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]() { return held; });
+  }
+
+  void release() {
+    std::unique_lock<std::mutex> lock(mutex);
+    released = true;
+    cv.notify_all();
+  }
+};
+
+TEST_F(MutationQueueTest, ConcurrentProducers) {
+  const id_type num_tags = 8, per_thread = 50;
+  const int num_threads = 4, num_ops = 2000;
+  for(id_type id = 0; id < num_tags; id++) {
+    ctx.new_tag(id);
+  }
+
+  // each thread owns its own entities, and keeps what they should end up
+  // tagged with
+  std::vector<std::map<std::pair<id_type, id_type>, rel_type>> expected(num_threads);
+  {
+    MutationQueue queue(ctx);
+    std::vector<std::thread> producers;
+    for(int t = 0; t < num_threads; t++) {
+      producers.push_back(std::thread([&, t]() {
+        std::mt19937 rng(49 + t);
+        const id_type first = 100 + t * per_thread;
+        for(id_type id = first; id < first + per_thread; id++) {
+          queue.new_tag(id);
+        }
+        auto& mine = expected[t];
+        for(int op = 0; op < num_ops; op++) {
+          const id_type e = first + rng() % per_thread, tag = rng() % num_tags;
+          const rel_type rel = 1 << (rng() % 3);
+          auto& has = mine[std::make_pair(e, tag)];
+          if(rng() % 3) {
+            queue.add_tag(e, tag, rel);
+            has |= rel;
+          }
+          else {
+            queue.remove_tag(e, tag, rel);
+            has &= ~rel;
+          }
+        }
+      }));
+    }
+    for(auto&& producer : producers) {
+      producer.join();
+    }
+    queue.flush();
+    ASSERT_EQ(queue.next_seq() - 1, queue.applied());
+    ASSERT_EQ((uint64_t) num_threads * (per_thread + num_ops), queue.num_mutations.load());
+  }
+
+  for(auto&& mine : expected) {
+    for(auto&& iter : mine) {
+      auto e = ctx.tag_by_id(iter.first.first), tag = ctx.tag_by_id(iter.first.second);
+      auto tagged = e->tags.find(tag);
+      const rel_type has = tagged == e->tags.end() ? 0 : tagged->second;
+      ASSERT_EQ(iter.second, has);
+    }
+  }
+  ASSERT_EQ(num_tags + num_threads * per_thread, ctx.num_tags());
+}
+
+TEST_F(MutationQueueTest, CoalescesBatch) {
+  auto animal = ctx.new_tag(1), dog = ctx.new_tag(2);
+  auto fido = ctx.new_tag(10), rex = ctx.new_tag(11);
+  rex->add_tag(dog, 4);
+
+  MutationQueue queue(ctx);
+  hold(queue);
+  const uint64_t batches = queue.num_batches;
+  queue.add_tag(10, 2, 1);
+  queue.add_tag(10, 2, 2);
+  queue.remove_tag(10, 2, 1);
+  queue.add_tag(11, 2, 1);
+  queue.remove_tag(11, 2);
+  queue.imply(2, 1);
+  queue.unimply(2, 1);
+  queue.imply(2, 1);
+
+  // everything for an entity destroyed in the batch is dropped, and it
+  // isn't there to be tagged after
+  queue.new_tag(12);
+  queue.add_tag(12, 2);
+  queue.destroy_tag(12);
+  const uint64_t last = queue.add_tag(12, 1);
+  release();
+  queue.wait(last);
+
+  // the one held, and then the rest at once
+  ASSERT_EQ(batches + 2, queue.num_batches.load());
+  ASSERT_LE(6, queue.num_coalesced.load());
+
+  ASSERT_EQ(1, fido->tags.size());
+  ASSERT_EQ(2, fido->tags[dog]);
+  ASSERT_EQ(0, rex->tags.size());
+  ASSERT_EQ(1, dog->implies.count(animal));
+  ASSERT_EQ(nullptr, ctx.tag_by_id(12));
+
+  std::unique_ptr<QueryClause> q(build_lit(animal));
+  ASSERT_EQ(std::unordered_set<Tag*>({fido}), query(ctx, *q));
+}
+
+TEST_F(MutationQueueTest, WaitSeesWrite) {
+  auto animal = ctx.new_tag(1);
+  ctx.new_tag(2);
+  ctx.enable_snapshots();
+
+  MutationQueue queue(ctx);
+  for(id_type id = 100; id < 200; id++) {
+    queue.new_tag(id);
+    queue.add_tag(id, id % 2 ? 1 : 2);
+  }
+  const uint64_t seq = queue.imply(2, 1);
+  ASSERT_LE(seq, queue.next_seq() - 1);
+  queue.wait(seq);
+  ASSERT_LE(seq, queue.applied());
+
+  // a query is built against the implications as they are, so after
+  std::unique_ptr<QueryClause> q(build_lit(animal));
+
+  // readers go through a snapshot while the queue runs
+  ContextSnapshot snap(ctx);
+  size_t seen = 0;
+  snap.query(q.get(), [&](Tag *e) { if(e->id >= 100) seen++; });
+  ASSERT_EQ(100, seen);
+
+  // or through the applier
+  long count = 0;
+  queue.wait(queue.call([&](Context& c) {
+    count = query(c, *q).size();
+  }));
+  ASSERT_EQ(100, count);
+}
@@ -0,0 +1,179 @@
+#include "test_helper.h"
+#include "all_the_tags/parser.h"
+#include "all_the_tags/plan_cache.h"
+
+class ParserTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b, *c;
+  Tag *e_a, *e_b, *e_ab, *e_c, *e_none;
+
+  void SetUp() {
+    ASSERT_NE(nullptr, a = ctx.new_tag());
+    ASSERT_NE(nullptr, b = ctx.new_tag());
+    ASSERT_NE(nullptr, c = ctx.new_tag());
+
+    e_a  = ctx.new_tag(); e_a->add_tag(a, 1);
+    e_b  = ctx.new_tag(); e_b->add_tag(b, 2);
+    e_ab = ctx.new_tag(); e_ab->add_tag(a, 2); e_ab->add_tag(b, 1);
+    e_c  = ctx.new_tag(); e_c->add_tag(c);
+    e_none = ctx.new_tag();
+  }
+
+  std::unordered_set<Tag*> parse_and_query(const std::string& text, const std::vector<id_type>& params = {}) {
+    ParseError err;
+    auto q = parse_query(ctx, text, params, &err);
+    EXPECT_TRUE(q) << text << ": " << err.message;
+    if(!q) return {};
+    EXPECT_EQ(0, err.code);
+
+    auto matched = query(ctx, *q);
+    delete q;
+    return matched;
+  }
+
+  std::string id(Tag *t) {
+    return std::to_string(t->id);
+  }
+};
+
+TEST_F(ParserTest, Precedence) {
+  // '&' binds tighter than '|'
+  ASSERT_EQ(SET(Tag*, {e_ab, e_c}), parse_and_query(id(a) + " & " + id(b) + " | " + id(c)));
+  ASSERT_EQ(SET(Tag*, {e_ab, e_c}), parse_and_query(id(c) + " | " + id(a) + " + " + id(b)));
+  ASSERT_EQ(SET(Tag*, {e_ab}), parse_and_query(id(a) + " & (" + id(b) + " | " + id(c) + ")"));
+
+  // '!' binds tighter than '&'
+  ASSERT_EQ(SET(Tag*, {e_a}), parse_and_query("!" + id(b) + " & " + id(a)));
+  auto not_ab = query(ctx, QueryClauseAny());
+  not_ab.erase(e_ab);
+  ASSERT_EQ(not_ab, parse_and_query("!(" + id(a) + " & " + id(b) + ")"));
+  ASSERT_EQ(SET(Tag*, {e_ab}), parse_and_query("!!(" + id(a) + "&" + id(b) + ")"));
+
+  ASSERT_EQ(query(ctx, QueryClauseAny()), parse_and_query("*"));
+}
+
+TEST_F(ParserTest, RelMasks) {
+  ASSERT_EQ(SET(Tag*, {e_a}),  parse_and_query(id(a) + ":1"));
+  ASSERT_EQ(SET(Tag*, {e_ab}), parse_and_query(id(a) + ":2"));
+  ASSERT_EQ(SET(Tag*, {e_a, e_ab}), parse_and_query(id(a) + ":0x3"));
+  ASSERT_EQ(SET(Tag*, {e_ab}), parse_and_query(id(a) + ":2 & " + id(b) + ":1"));
+  ASSERT_EQ(SET(Tag*, {}), parse_and_query(id(a) + ":1 & " + id(b)));
+}
+
+TEST_F(ParserTest, Params) {
+  ASSERT_EQ(SET(Tag*, {e_ab}), parse_and_query("$0 & $1", {a->id, b->id}));
+  ASSERT_EQ(SET(Tag*, {e_a}),  parse_and_query("$1:1 & !$0", {b->id, a->id}));
+
+  ParseError err;
+  ASSERT_EQ(nullptr, parse_query(ctx, "$0 & $1", {a->id}, &err));
+  ASSERT_EQ(ERR_PARSE_PARAM, err.code);
+  ASSERT_EQ(5, err.pos);
+}
+
+TEST_F(ParserTest, Errors) {
+  struct { std::string text; int code; size_t pos; } cases[] = {
+    {"",             ERR_PARSE_SYNTAX, 0},
+    {id(a) + " &",   ERR_PARSE_SYNTAX, 3},
+    {"(" + id(a),    ERR_PARSE_SYNTAX, 2},
+    {id(a) + ")",    ERR_PARSE_SYNTAX, 1},
+    {id(a) + " " + id(b), ERR_PARSE_SYNTAX, 2},
+    {id(a) + ":",    ERR_PARSE_SYNTAX, 2},
+    {id(a) + ":0",   ERR_PARSE_SYNTAX, 2},
+    {"a",            ERR_PARSE_SYNTAX, 0},
+    {"99999999999",  ERR_PARSE_SYNTAX, 0},
+    {"12345",        ERR_PARSE_UNKNOWN_TAG, 0},
+    {std::string(10000, '('), ERR_PARSE_SYNTAX, 512},
+  };
+
+  for(auto&& test : cases) {
+    ParseError err;
+    ASSERT_EQ(nullptr, parse_query(ctx, test.text, {}, &err)) << test.text.substr(0, 20);
+    ASSERT_EQ(test.code, err.code) << test.text.substr(0, 20);
+    ASSERT_EQ(test.pos, err.pos) << test.text.substr(0, 20);
+    ASSERT_FALSE(err.message.empty());
+  }
+
+  // errors can be ignored
+  ASSERT_EQ(nullptr, parse_query(ctx, "&"));
+}
+
+TEST_F(ParserTest, Normalize) {
+  std::string x, y;
+  ASSERT_TRUE(normalize_query(" 1 +  (2|!0x3:4)", {}, x));
+  ASSERT_EQ("1&(2|!3:4)", x);
+
+  ASSERT_TRUE(normalize_query("$1 & $0", {7, 8}, y));
+  ASSERT_EQ("8&7", y);
+
+  // numbers that were apart stay apart
+  ASSERT_TRUE(normalize_query("1 2", {}, x));
+  ASSERT_TRUE(normalize_query("12", {}, y));
+  ASSERT_NE(x, y);
+
+  ParseError err;
+  ASSERT_FALSE(normalize_query("$2", {1}, x, &err));
+  ASSERT_EQ(ERR_PARSE_PARAM, err.code);
+}
+
+TEST_F(ParserTest, PlanCache) {
+  PlanCache cache(ctx, 2);
+
+  auto text = id(a) + " & " + id(b);
+  auto plan = cache.get(text);
+  ASSERT_TRUE(plan);
+  ASSERT_EQ(1, cache.misses);
+
+  // the same query, written differently
+  ASSERT_EQ(plan, cache.get(" " + id(a) + "+" + id(b)));
+  ASSERT_EQ(plan, cache.get("$0 & $1", {a->id, b->id}));
+  ASSERT_EQ(2, cache.hits);
+  ASSERT_EQ(1, cache.size());
+
+  std::unordered_set<Tag*> matched;
+  ctx.query(plan, [&](Tag *e) { matched.insert(e); });
+  ASSERT_EQ(SET(Tag*, {e_ab}), matched);
+
+  ParseError err;
+  ASSERT_EQ(nullptr, cache.get("(", {}, &err));
+  ASSERT_EQ(ERR_PARSE_SYNTAX, err.code);
+  ASSERT_EQ(1, cache.size());
+
+  // least recently used is evicted
+  ASSERT_TRUE(cache.get(id(c)));
+  ASSERT_EQ(plan, cache.get(text));
+  ASSERT_TRUE(cache.get(id(a)));
+  ASSERT_EQ(2, cache.size());
+  ASSERT_EQ(3, cache.misses);
+  cache.get(id(c));
+  ASSERT_EQ(4, cache.misses);
+}
+
+TEST_F(ParserTest, PlanCacheInvalidated) {
+  PlanCache cache(ctx);
+  auto text = id(c);
+  cache.get(text);
+  cache.get(text);
+  ASSERT_EQ(1, cache.misses);
+
+  // 'a' implying 'c' changes what the query has to match
+  a->imply(c);
+  auto plan = cache.get(text);
+  ASSERT_EQ(2, cache.misses);
+
+  std::unordered_set<Tag*> matched;
+  ctx.query(plan, [&](Tag *e) { matched.insert(e); });
+  ASSERT_EQ(SET(Tag*, {e_a, e_ab, e_c}), matched);
+
+  // destroying a tag leaves plans pointing at it
+  cache.get(id(a));
+  ASSERT_EQ(2, cache.size());
+  ctx.destroy_tag(b);
+  cache.get(text);
+  ASSERT_EQ(1, cache.size());
+  ASSERT_EQ(4, cache.misses);
+
+  ctx.analyze();
+  cache.get(text);
+  ASSERT_EQ(5, cache.misses);
+}
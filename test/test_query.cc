@@ -170,10 +170,15 @@ TEST_F(QueryTest, Implication1) {
         build_lit(c)));
 
   if(debug) query->debug_print();
-  query = OPTIM_AND_CAST(query);
-  if(debug) query->debug_print();
+  auto optimized = optimize(query);
+  if(debug) optimized->debug_print();
 
-  delete query;
+  // {a, b} implies c, so the clause is absorbed into the {a, b} metanode
+  auto meta = dynamic_cast<QueryClauseMetaSet*>(optimized);
+  ASSERT_TRUE(meta);
+  ASSERT_EQ(QueryClauseMetaSet::node_set({a->meta_node()}), meta->nodes);
+
+  delete optimized;
 }
 
 TEST_F(QueryTest, QueryOptimJITLit) {
@@ -204,6 +209,21 @@ TEST_F(QueryTest, QueryOptimJITLit_Ands) {
   TEST_TRUE(build_and(build_lit(a), build_lit(b)), e1);
 }
 
+TEST_F(QueryTest, QueryOptimJITImpliedLit) {
+  // a literal over a tag implied by others becomes a metanode set, which
+  // the compiled code refers to after optimize has deleted the clause
+  ASSERT_TRUE(a->imply(c));
+  ASSERT_TRUE(b->imply(c));
+  e1->add_tag(a);
+  ctx.make_clean();
+
+  QueryClause *query = optimize(build_lit(c), QueryOptFlags_JIT);
+  ASSERT_TRUE(query->matches_set(e1->tags));
+  ASSERT_FALSE(query->matches_set(e2->tags));
+  ASSERT_EQ(SET(Tag*, {e1}), ::query(ctx, *query));
+  delete query;
+}
+
 TEST_F(QueryTest, TestQueryRels) {
   ASSERT_TRUE(a->imply(b));
   ASSERT_TRUE(b->imply(c));
@@ -267,3 +287,302 @@ TEST_F(QueryTest, TestQueryRels) {
   TEST_FALS(build_and(build_lit(c, 1), build_lit(c, 4)), e1);
   TEST_FALS(build_and(build_lit(c, 1), build_lit(c, 4)), e2);
 }
+
+TEST_F(QueryTest, SimplifyFolds) {
+  QueryClause *q = simplify(build_and(build_lit(a), new QueryClauseAny()));
+  ASSERT_TRUE(dynamic_cast<QueryClauseLit*>(q));
+  ASSERT_EQ(a, ((QueryClauseLit*)q)->t);
+  delete q;
+
+  q = simplify(build_not(build_not(build_lit(a))));
+  ASSERT_TRUE(dynamic_cast<QueryClauseLit*>(q));
+  delete q;
+
+  q = simplify(build_or(build_lit(a), build_not(new QueryClauseAny())));
+  ASSERT_TRUE(dynamic_cast<QueryClauseLit*>(q));
+  delete q;
+}
+
+TEST_F(QueryTest, SimplifyContradictions) {
+  QueryClause *q = simplify(build_and(build_lit(a), build_and(build_lit(b), build_not(build_lit(a)))));
+  ASSERT_TRUE(dynamic_cast<QueryClauseNone*>(q));
+  delete q;
+
+  q = simplify(build_or(build_not(build_lit(a)), build_lit(a)));
+  ASSERT_TRUE(dynamic_cast<QueryClauseAny*>(q));
+  delete q;
+}
+
+TEST_F(QueryTest, SimplifyAbsorption) {
+  QueryClause *q = simplify(build_and(build_lit(a), build_or(build_lit(b), build_lit(a))));
+  if(debug) q->debug_print();
+  ASSERT_TRUE(dynamic_cast<QueryClauseLit*>(q));
+  delete q;
+
+  q = simplify(build_or(build_and(build_lit(a), build_lit(b)), build_lit(a)));
+  ASSERT_TRUE(dynamic_cast<QueryClauseLit*>(q));
+  delete q;
+}
+
+TEST_F(QueryTest, SimplifyDeMorgan) {
+  // negation is pushed through the 'or' so the 'and' can drive from 'c'
+  QueryClause *q = simplify(build_and(build_lit(c), build_not(build_or(build_lit(a), build_lit(b)))));
+  if(debug) q->debug_print();
+  auto expected = build_and(build_lit(c), build_and(build_not(build_lit(a)), build_not(build_lit(b))));
+  ASSERT_EQ(clause_key(expected), clause_key(q));
+  delete q;
+  delete expected;
+
+  // !(!a & !b) -> a | b
+  q = simplify(build_not(build_and(build_not(build_lit(a)), build_not(build_lit(b)))));
+  expected = build_or(build_lit(a), build_lit(b));
+  ASSERT_EQ(clause_key(expected), clause_key(q));
+  delete q;
+  delete expected;
+}
+
+TEST_F(QueryTest, SimplifyFactors) {
+  QueryClause *q = simplify(
+    build_or(
+      build_and(build_lit(a), build_lit(b)),
+      build_or(
+        build_and(build_lit(c), build_lit(a)),
+        build_lit(d))));
+  if(debug) q->debug_print();
+
+  auto expected = build_or(
+    build_and(build_lit(a), build_or(build_lit(b), build_lit(c))),
+    build_lit(d));
+  ASSERT_EQ(clause_key(expected), clause_key(q));
+  delete q;
+  delete expected;
+}
+
+TEST_F(QueryTest, SimplifyKeepsMatches) {
+  // every combination of a, b, c, d on an entity
+  std::vector<Tag*> ents;
+  for(int mask = 0; mask < 16; mask++) {
+    auto ent = ctx.new_tag();
+    if(mask & 1) ent->add_tag(a);
+    if(mask & 2) ent->add_tag(b);
+    if(mask & 4) ent->add_tag(c);
+    if(mask & 8) ent->add_tag(d);
+    ents.push_back(ent);
+  }
+
+  unsigned seed = 1;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+  };
+
+  Tag *lits[] = {a, b, c, d};
+  std::function<QueryClause*(int)> random_clause = [&](int depth) -> QueryClause* {
+    int pick = depth ? rand() % 7 : rand() % 5;
+    switch(pick) {
+      case 0: case 1: case 2: case 3: return build_lit(lits[rand() % 4]);
+      case 4: return (rand() % 4) ? build_lit(lits[rand() % 4]) : new QueryClauseAny();
+      case 5: return build_not(random_clause(depth - 1));
+      default:
+        if(rand() % 2) return build_and(random_clause(depth - 1), random_clause(depth - 1));
+        return build_or(random_clause(depth - 1), random_clause(depth - 1));
+    }
+  };
+
+  for(int i = 0; i < 500; i++) {
+    auto original = random_clause(5);
+    auto simplified = simplify(original->dup());
+    for(auto ent : ents) {
+      ASSERT_EQ(original->matches_set(ent->tags), simplified->matches_set(ent->tags));
+    }
+    delete original;
+    delete simplified;
+  }
+}
+
+TEST_F(QueryTest, ImplicationRewrites) {
+  // a implies b, b implies c
+  a->imply(b);
+  b->imply(c);
+  e1->add_tag(a);
+  e2->add_tag(b);
+
+  // a & b -> a
+  QueryClause *q = optimize(build_and(build_lit(b), build_lit(a)));
+  if(debug) q->debug_print();
+  auto expected = build_lit(a);
+  ASSERT_EQ(clause_key(expected), clause_key(q));
+  delete q;
+  delete expected;
+
+  // a | b | c -> c
+  q = optimize(build_or(build_lit(a), build_or(build_lit(c), build_lit(b))));
+  if(debug) q->debug_print();
+  expected = build_lit(c);
+  ASSERT_EQ(clause_key(expected), clause_key(q));
+  delete q;
+  delete expected;
+
+  // a & !c -> none
+  q = optimize(build_and(build_lit(a), build_not(build_lit(c))));
+  ASSERT_TRUE(dynamic_cast<QueryClauseNone*>(q));
+  delete q;
+
+  // but b & !a can still match
+  q = optimize(build_and(build_lit(b), build_not(build_lit(a))));
+  ASSERT_EQ(SET(Tag*, {e2}), query(ctx, *q));
+  delete q;
+
+  // a literal restricted to some relationships doesn't imply one
+  // restricted to others
+  q = optimize(build_and(build_lit(a), build_lit(b, 2)));
+  ASSERT_TRUE(dynamic_cast<QueryClauseBin*>(q));
+  delete q;
+
+  q = optimize(build_and(build_lit(a, 2), build_lit(b)));
+  expected = build_lit(a, 2);
+  ASSERT_EQ(clause_key(expected), clause_key(q));
+  delete q;
+  delete expected;
+}
+
+TEST_F(QueryTest, MetaSetLeaf) {
+  // a -> b -> c, d -> c
+  a->imply(b);
+  b->imply(c);
+  d->imply(c);
+  e1->add_tag(a, 1);
+  e2->add_tag(d, 2);
+
+  // every metanode implying 'c' is in a single leaf
+  auto q = build_lit(c);
+  if(debug) q->debug_print();
+  auto set = dynamic_cast<QueryClauseMetaSet*>(q);
+  ASSERT_TRUE(set);
+  ASSERT_EQ(QueryClauseMetaSet::node_set({a->meta_node(), b->meta_node(), c->meta_node(), d->meta_node()}), set->nodes);
+  ASSERT_EQ(SET(Tag*, {e1, e2}), query(ctx, *q));
+  delete q;
+
+  q = build_lit(c, 1);
+  ASSERT_EQ(SET(Tag*, {e1}), query(ctx, *q));
+  delete q;
+
+  q = build_lit(b);
+  ASSERT_EQ(SET(Tag*, {e1}), query(ctx, *q));
+  delete q;
+
+  // an 'or' of leafs with the same rel mask is merged into one set
+  q = optimize(build_or(build_lit(b, 1), build_or(build_lit(d, 1), build_lit(e))));
+  if(debug) q->debug_print();
+  auto bin = dynamic_cast<QueryClauseBin*>(q);
+  ASSERT_TRUE(bin);
+  auto merged = dynamic_cast<QueryClauseMetaSet*>(bin->l) ?
+    dynamic_cast<QueryClauseMetaSet*>(bin->l) :
+    dynamic_cast<QueryClauseMetaSet*>(bin->r);
+  ASSERT_TRUE(merged);
+  ASSERT_EQ(QueryClauseMetaSet::node_set({a->meta_node(), b->meta_node(), d->meta_node()}), merged->nodes);
+  ASSERT_EQ(SET(Tag*, {e1}), query(ctx, *q));
+  delete q;
+}
+
+TEST_F(QueryTest, ReorderNestedImpliedOr) {
+  // reordering alone leaves the 'or' of sets as it is, so the counts the
+  // outer 'and' was ordered by still hold
+  a->imply(e);
+  b->imply(e);
+  e1->add_tag(a);
+  e1->add_tag(c);
+  e2->add_tag(b);
+  ctx.make_clean();
+
+  auto q = optimize(build_and(build_lit(c), build_or(build_lit(a), build_lit(b))), QueryOptFlags_Reorder);
+  if(debug) q->debug_print();
+  ASSERT_EQ(SET(Tag*, {e1}), query(ctx, *q));
+  delete q;
+}
+
+TEST_F(QueryTest, BatchSharesClauses) {
+  e1->add_tag(a);
+  e1->add_tag(b);
+  e2->add_tag(b);
+
+  auto q_a   = build_lit(a);
+  auto q_ab  = build_and(build_lit(a), build_lit(b));
+  auto q_ba  = build_and(build_lit(b), build_lit(a));
+  auto q_nab = build_not(build_and(build_lit(a), build_lit(b)));
+
+  QueryBatch batch;
+  ASSERT_EQ(0, batch.add(q_a));
+  ASSERT_EQ(1, batch.add(q_ab));
+  ASSERT_EQ(2, batch.add(q_ba));
+  ASSERT_EQ(3, batch.add(q_nab));
+  ASSERT_EQ(4, batch.size());
+  // a, b, a & b and !(a & b)
+  ASSERT_EQ(4, batch.num_shared());
+
+  std::vector<std::unordered_set<Tag*>> matched(batch.size());
+  ASSERT_EQ(ctx.num_tags(), ctx.query(&batch, [&](size_t query, Tag *e) {
+    matched[query].insert(e);
+  }));
+  ASSERT_EQ(query(ctx, *q_a),   matched[0]);
+  ASSERT_EQ(query(ctx, *q_ab),  matched[1]);
+  ASSERT_EQ(query(ctx, *q_ba),  matched[2]);
+  ASSERT_EQ(query(ctx, *q_nab), matched[3]);
+
+  std::vector<long> counts;
+  ctx.count(&batch, counts);
+  ASSERT_EQ(std::vector<long>({1, 1, 1, (long)ctx.num_tags() - 1}), counts);
+
+  // a dirty context answers from the metagraph it had
+  ctx.mark_dirty();
+  ASSERT_EQ(ctx.num_tags(), ctx.count(&batch, counts));
+  ASSERT_EQ(std::vector<long>({1, 1, 1, (long)ctx.num_tags() - 1}), counts);
+  ctx.make_clean();
+
+  delete q_a;
+  delete q_ab;
+  delete q_ba;
+  delete q_nab;
+}
+
+TEST_F(QueryTest, BatchKeepsMatches) {
+  // every combination of a, b, c on an entity, with a implying d
+  a->imply(d);
+  for(int mask = 0; mask < 8; mask++) {
+    auto ent = ctx.new_tag();
+    if(mask & 1) ent->add_tag(a);
+    if(mask & 2) ent->add_tag(b);
+    if(mask & 4) ent->add_tag(c);
+  }
+
+  unsigned seed = 1;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+  };
+
+  Tag *lits[] = {a, b, c, d};
+  std::function<QueryClause*(int)> random_clause = [&](int depth) -> QueryClause* {
+    switch(depth ? rand() % 6 : 0) {
+      case 0: case 1: case 2: return build_lit(lits[rand() % 4]);
+      case 3: return build_not(random_clause(depth - 1));
+      case 4: return build_and(random_clause(depth - 1), random_clause(depth - 1));
+      default: return build_or(random_clause(depth - 1), random_clause(depth - 1));
+    }
+  };
+
+  std::vector<QueryClause*> clauses;
+  QueryBatch batch;
+  for(int i = 0; i < 200; i++) {
+    clauses.push_back(random_clause(4));
+    batch.add(clauses.back());
+  }
+  ASSERT_LT(batch.num_shared(), 200 * 4);
+
+  std::vector<long> counts;
+  ctx.count(&batch, counts);
+  for(size_t i = 0; i < clauses.size(); i++) {
+    ASSERT_EQ(query(ctx, *clauses[i]).size(), counts[i]);
+    delete clauses[i];
+  }
+}
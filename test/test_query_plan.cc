@@ -0,0 +1,345 @@
+#include "test_helper.h"
+#include "all_the_tags/explain.h"
+
+#include <sstream>
+#include <thread>
+#include <atomic>
+
+class QueryPlanTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *rare, *common, *x, *y;
+
+  void SetUp() {
+    ASSERT_NE(nullptr, rare   = ctx.new_tag());
+    ASSERT_NE(nullptr, common = ctx.new_tag());
+    ASSERT_NE(nullptr, x      = ctx.new_tag());
+    ASSERT_NE(nullptr, y      = ctx.new_tag());
+
+    // x and y are perfectly correlated
+    for(int i = 0; i < 500; i++) {
+      auto e = ctx.new_tag();
+      e->add_tag(common);
+      if(i < 5) e->add_tag(rare);
+      if(i < 200) {
+        e->add_tag(x);
+        e->add_tag(y);
+      }
+    }
+    for(int i = 0; i < 500; i++) { ctx.new_tag(); }
+  }
+};
+
+TEST_F(QueryPlanTest, CorrelatedSelectivity) {
+  ctx.analyze();
+  auto stats = ctx.stats();
+  ASSERT_TRUE(stats);
+  ASSERT_EQ(ctx.num_tags(), stats->num_entities);
+
+  auto q = build_and(build_lit(x), build_lit(y));
+  double estimated = q->estimate_count(*stats);
+  ASSERT_NEAR(200.0, estimated, 20.0);
+
+  // without the pair statistics they'd be assumed independent
+  ContextStats independent;
+  independent.num_entities = stats->num_entities;
+  ASSERT_LT(q->estimate_count(independent), 100.0);
+  delete q;
+}
+
+TEST_F(QueryPlanTest, OrdersByCostPerEliminated) {
+  ctx.analyze();
+
+  // 'rare' eliminates the most entities, so it's evaluated first
+  auto q = optimize(
+    build_and(build_lit(common), build_and(build_lit(x), build_lit(rare))),
+    QueryOptFlags_Reorder, ctx.stats());
+  auto bin = dynamic_cast<QueryClauseBin*>(q);
+  ASSERT_TRUE(bin);
+  auto first = dynamic_cast<QueryClauseBin*>(bin->l);
+  ASSERT_TRUE(first);
+  ASSERT_EQ(rare,   ((QueryClauseLit*)first->l)->t);
+  ASSERT_EQ(x,      ((QueryClauseLit*)first->r)->t);
+  ASSERT_EQ(common, ((QueryClauseLit*)bin->r)->t);
+  delete q;
+}
+
+TEST_F(QueryPlanTest, ChoosesEngine) {
+  ctx.analyze();
+
+  // a rare tag is cheaper to look up through its posting list
+  auto plan = plan_query(ctx, build_and(build_lit(common), build_lit(rare)));
+  plan->debug_print();
+  ASSERT_EQ(QueryEngine_Index, plan->engine);
+  ASSERT_EQ(5, query(ctx, *plan->clause).size());
+
+  std::unordered_set<Tag*> matched;
+  ctx.query(plan, [&](Tag* e) { matched.insert(e); });
+  ASSERT_EQ(query(ctx, *plan->clause), matched);
+  delete plan;
+
+  // nothing to drive a negation from
+  plan = plan_query(ctx, build_not(build_lit(rare)));
+  plan->debug_print();
+  ASSERT_EQ(QueryEngine_Scan, plan->engine);
+  ASSERT_LT(plan->index_cost, 0);
+
+  matched.clear();
+  ctx.query(plan, [&](Tag* e) { matched.insert(e); });
+  ASSERT_EQ(ctx.num_tags() - 5, matched.size());
+  delete plan;
+}
+
+TEST_F(QueryPlanTest, IndexedOrVisitsEachEntityOnce) {
+  auto plan = plan_query(ctx, build_or(build_lit(x), build_lit(y)));
+  ASSERT_EQ(QueryEngine_Index, plan->engine);
+
+  int matches = 0;
+  ASSERT_EQ(200, ctx.query(plan, [&](Tag* e) { matches++; }));
+  ASSERT_EQ(200, matches);
+  delete plan;
+}
+
+TEST_F(QueryPlanTest, IndexSubtractsNots) {
+  ctx.analyze();
+
+  // driven from x, with the entities tagged with rare or common subtracted
+  auto plan = plan_query(ctx,
+    build_and(build_lit(x), build_not(build_or(build_lit(rare), build_lit(common)))));
+  ASSERT_EQ(QueryEngine_Index, plan->engine);
+  ASSERT_EQ(2, plan->excluded.size());
+  ASSERT_TRUE(plan->residual);
+  ASSERT_TRUE(dynamic_cast<const QueryClauseLit*>(plan->residual));
+
+  std::unordered_set<Tag*> matched;
+  ASSERT_EQ(200, ctx.query(plan, [&](Tag* e) { matched.insert(e); }));
+  ASSERT_EQ(query(ctx, *plan->clause), matched);
+  ASSERT_EQ(0, matched.size());
+  delete plan;
+
+  plan = plan_query(ctx, build_and(build_lit(common), build_not(build_lit(x))));
+  ASSERT_EQ(1, plan->excluded.size());
+  matched.clear();
+  ctx.query(plan, [&](Tag* e) { matched.insert(e); });
+  ASSERT_EQ(query(ctx, *plan->clause), matched);
+  ASSERT_EQ(300, matched.size());
+  delete plan;
+
+  // a rel mask leaves some of the tagged entities matching the 'not', so
+  // it has to be tested
+  plan = plan_query(ctx, build_and(build_lit(x), build_not(build_lit(rare, 2))));
+  ASSERT_EQ(0, plan->excluded.size());
+  ASSERT_FALSE(plan->residual);
+  matched.clear();
+  ctx.query(plan, [&](Tag* e) { matched.insert(e); });
+  ASSERT_EQ(200, matched.size());
+  delete plan;
+}
+
+TEST_F(QueryPlanTest, NotNeverFirst) {
+  // without statistics, the 'not' of a rare tag would otherwise be taken
+  // for a rare clause
+  auto q = optimize(
+    build_and(build_not(build_lit(rare)), build_and(build_lit(common), build_lit(x))),
+    QueryOptFlags_Reorder);
+  std::vector<const QueryClause*> order;
+  std::function<void(const QueryClause*)> walk = [&](const QueryClause *c) {
+    auto bin = dynamic_cast<const QueryClauseBin*>(c);
+    if(bin) {
+      walk(bin->l);
+      walk(bin->r);
+    }
+    else {
+      order.push_back(c);
+    }
+  };
+  walk(q);
+  ASSERT_EQ(3, order.size());
+  ASSERT_TRUE(dynamic_cast<const QueryClauseNot*>(order.back()));
+  delete q;
+}
+
+TEST_F(QueryPlanTest, Explain) {
+  ctx.analyze();
+
+  auto plan = plan_query(ctx, build_and(build_lit(common), build_not(build_lit(x))));
+  auto explain = explain_query(ctx, plan);
+  ASSERT_EQ(plan->engine, explain->engine);
+  ASSERT_FALSE(explain->analyzed);
+
+  auto root = explain->root;
+  ASSERT_EQ("and", root->type);
+  ASSERT_EQ(2, root->children.size());
+  ASSERT_NEAR(plan->est_matches, root->est_count, 1.0);
+  ASSERT_EQ(0, root->evaluated);
+
+  std::ostringstream text;
+  explain->print(text);
+  ASSERT_NE(std::string::npos, text.str().find("not"));
+  delete explain;
+  delete plan;
+}
+
+TEST_F(QueryPlanTest, ExplainAnalyze) {
+  ctx.analyze();
+
+  // a rel mask keeps the 'not' from being subtracted, so the whole clause
+  // is tested
+  auto plan = plan_query(ctx, build_and(build_lit(common), build_not(build_lit(x, 1))));
+  ASSERT_EQ(0, plan->excluded.size());
+  auto explain = explain_analyze(ctx, plan);
+  ASSERT_TRUE(explain);
+  ASSERT_TRUE(explain->analyzed);
+  ASSERT_FALSE(explain->residual);
+  explain->debug_print();
+
+  // 300 entities have 'common' but not 'x'
+  ASSERT_EQ(300, explain->matches);
+  auto root = explain->root;
+  ASSERT_EQ(explain->candidates, root->evaluated);
+  ASSERT_EQ(300, root->matched);
+
+  // the right side is only evaluated when the left side doesn't short circuit
+  auto l = root->children[0], r = root->children[1];
+  ASSERT_EQ(root->evaluated, l->evaluated);
+  ASSERT_EQ(l->matched, r->evaluated);
+  ASSERT_EQ(root->matched, r->matched);
+  ASSERT_EQ(r->evaluated, r->children[0]->evaluated);
+  ASSERT_EQ(r->evaluated - r->matched, r->children[0]->matched);
+  ASSERT_GE(root->time_ns, l->time_ns);
+  delete explain;
+  delete plan;
+
+  // with x's entities subtracted, the rest are tested against 'common'
+  // alone, as `Context::query` would
+  plan = plan_query(ctx, build_and(build_lit(common), build_not(build_lit(x))));
+  ASSERT_EQ(1, plan->excluded.size());
+  explain = explain_analyze(ctx, plan);
+  ASSERT_TRUE(explain);
+  explain->debug_print();
+  ASSERT_EQ(1, explain->num_excluded);
+  ASSERT_TRUE(explain->residual);
+  ASSERT_EQ(500, explain->candidates);
+  ASSERT_EQ(200, explain->subtracted);
+  ASSERT_EQ(300, explain->matches);
+  ASSERT_EQ(0, explain->root->evaluated);
+  ASSERT_EQ("lit", explain->residual->type);
+  ASSERT_EQ(300, explain->residual->evaluated);
+  ASSERT_EQ(300, explain->residual->matched);
+
+  std::ostringstream out;
+  explain->print(out);
+  ASSERT_NE(std::string::npos, out.str().find("subtracting 1 lists (200 candidates)"));
+  delete explain;
+  delete plan;
+
+  // analyzing a plan that can't be run
+  plan = plan_query(ctx, build_lit(rare));
+  ctx.mark_dirty();
+  ctx.make_clean();
+  ASSERT_EQ(nullptr, explain_analyze(ctx, plan));
+  delete plan;
+}
+
+TEST_F(QueryPlanTest, ClosureSetIsOnePostingList) {
+  // x is implied by a dozen tags, each on a few of the entities
+  ctx.set_closure_sets(true);
+  std::vector<Tag*> kinds;
+  for(int i = 0; i < 12; i++) {
+    auto kind = ctx.new_tag();
+    kind->imply(x);
+    kinds.push_back(kind);
+  }
+  Tag *only_first = nullptr;
+  for(int i = 0; i < 120; i++) {
+    auto e = ctx.new_tag();
+    e->add_tag(kinds[i % kinds.size()]);
+    if(i % 2) e->add_tag(kinds[(i + 1) % kinds.size()]);
+    if(i == 0) only_first = e;
+  }
+  auto spare = ctx.new_tag();
+
+  auto plan = plan_query(ctx, build_lit(x));
+  ASSERT_EQ(QueryEngine_Index, plan->engine);
+  ASSERT_EQ(1, plan->postings.size());
+  ASSERT_EQ(320, plan->postings[0]->size());
+
+  std::unordered_set<Tag*> matched;
+  ASSERT_EQ(320, ctx.query(plan, [&](Tag* e) { matched.insert(e); }));
+  ASSERT_EQ(query(ctx, *plan->clause), matched);
+
+  // plans from before the context went dirty are still run, so the sets
+  // are kept up to date meanwhile
+  ctx.mark_dirty();
+  spare->add_tag(kinds[3]);
+  only_first->remove_tag(kinds[0]);
+  ASSERT_TRUE(ctx.is_current(plan));
+  matched.clear();
+  ctx.query(plan, [&](Tag* e) { matched.insert(e); });
+  ASSERT_EQ(query(ctx, *plan->clause), matched);
+  ASSERT_EQ(320, matched.size());
+  ASSERT_TRUE(matched.count(spare));
+  ASSERT_FALSE(matched.count(only_first));
+  delete plan;
+
+  ctx.make_clean();
+  plan = plan_query(ctx, build_lit(x));
+  ASSERT_EQ(1, plan->postings.size());
+  ASSERT_EQ(320, plan->postings[0]->size());
+  delete plan;
+}
+
+TEST_F(QueryPlanTest, ParallelQueryMatchesSerial) {
+  ThreadPool pool(3);
+  ctx.set_query_pool(&pool, 0);
+  ctx.analyze();
+
+  // scanned, driven from one list, and from an 'or' of lists
+  std::vector<QueryClause*> clauses = {
+    build_not(build_lit(rare)),
+    build_and(build_lit(common), build_lit(rare)),
+    build_and(build_lit(x), build_not(build_lit(rare))),
+    build_or(build_lit(x), build_or(build_lit(rare), build_lit(y)))
+  };
+  std::vector<QueryPlan*> plans;
+  for(auto clause : clauses) {
+    plans.push_back(plan_query(ctx, clause));
+  }
+  ASSERT_EQ(QueryEngine_Scan, plans[0]->engine);
+  ASSERT_EQ(QueryEngine_Index, plans[3]->engine);
+  ASSERT_LT(1, plans[3]->postings.size());
+
+  // queries from several threads at once share the pool
+  std::vector<std::thread> threads;
+  std::atomic<int> wrong(0);
+  for(int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&]() {
+      for(int round = 0; round < 20; round++) {
+        for(auto plan : plans) {
+          std::unordered_set<Tag*> serial;
+          const long tested = ctx.query(plan, [&](Tag* e) { serial.insert(e); });
+
+          std::vector<Tag*> matches;
+          if(ctx.query_parallel(plan, matches) != tested) wrong++;
+          if(matches.size() != serial.size()) wrong++;
+          if(std::unordered_set<Tag*>(matches.begin(), matches.end()) != serial) wrong++;
+        }
+      }
+    }));
+  }
+  for(auto&& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(0, wrong.load());
+
+  for(auto plan : plans) {
+    delete plan;
+  }
+
+  // a plan from before the metagraph changed is turned away
+  auto plan = plan_query(ctx, build_lit(x));
+  x->imply(y);
+  std::vector<Tag*> matches;
+  ASSERT_EQ(ERR_PLAN_STALE, ctx.query_parallel(plan, matches));
+  delete plan;
+}
@@ -0,0 +1,113 @@
+#include "test_helper.h"
+#include "all_the_tags/sharded.h"
+#include "all_the_tags/parser.h"
+
+#include <set>
+
+class ShardedTest : public ::testing::Test {
+public:
+  ShardedContext sharded;
+  Context single;
+  std::vector<id_type> tags, entities;
+
+  ShardedTest() : sharded(4) {}
+
+  void SetUp() {
+    for(id_type id = 0; id < 10; id++) {
+      ASSERT_TRUE(sharded.new_tag(id));
+      single.new_tag(id);
+      tags.push_back(id);
+    }
+    for(id_type id = 100; id < 400; id++) {
+      ASSERT_TRUE(sharded.new_entity(id));
+      single.new_tag(id);
+      entities.push_back(id);
+    }
+  }
+
+  void imply(id_type tag, id_type other) {
+    ASSERT_TRUE(sharded.imply(tag, other));
+    single.tag_by_id(tag)->imply(single.tag_by_id(other));
+  }
+
+  void add_tag(id_type entity, id_type tag) {
+    ASSERT_TRUE(sharded.add_tag(entity, tag));
+    single.tag_by_id(entity)->add_tag(single.tag_by_id(tag));
+  }
+
+  // the entities matching a query on the unsharded context, in order
+  std::vector<id_type> expected(const std::string& text) {
+    std::unique_ptr<QueryClause> q(parse_query(single, text));
+    std::set<id_type> ids;
+    for(auto e : query(single, *q)) {
+      if(e->id >= 100) ids.insert(e->id);
+    }
+    return std::vector<id_type>(ids.begin(), ids.end());
+  }
+};
+
+TEST_F(ShardedTest, MatchesUnsharded) {
+  srand(48);
+  for(int i = 0; i < 600; i++) {
+    add_tag(entities[rand() % entities.size()], tags[rand() % tags.size()]);
+  }
+  imply(1, 2);
+  imply(2, 3);
+  imply(5, 3);
+
+  for(auto text : {"3", "1 & !5", "2 | 7", "!3", "*"}) {
+    ShardedQueryResult result;
+    ASSERT_TRUE(sharded.query(text, result)) << text;
+    auto all = expected(text);
+    ASSERT_EQ(all, result.ids) << text;
+    ASSERT_EQ((long) all.size(), result.count) << text;
+    ASSERT_EQ((long) all.size(), sharded.count(text)) << text;
+
+    // a page from the middle, both ways
+    ShardedQueryOptions options;
+    options.offset = 5;
+    options.limit = 10;
+    ASSERT_TRUE(sharded.query(text, result, options));
+    std::vector<id_type> page(all.begin() + std::min<size_t>(5, all.size()),
+      all.begin() + std::min<size_t>(15, all.size()));
+    ASSERT_EQ(page, result.ids) << text;
+    ASSERT_EQ((long) all.size(), result.count) << text;
+
+    options.descending = true;
+    ASSERT_TRUE(sharded.query(text, result, options));
+    std::reverse(all.begin(), all.end());
+    page.assign(all.begin() + std::min<size_t>(5, all.size()),
+      all.begin() + std::min<size_t>(15, all.size()));
+    ASSERT_EQ(page, result.ids) << text;
+  }
+}
+
+TEST_F(ShardedTest, RoutesWrites) {
+  // unknown and repeated ids are turned away before they're queued
+  ASSERT_FALSE(sharded.new_tag(3));
+  ASSERT_FALSE(sharded.new_entity(3));
+  ASSERT_FALSE(sharded.new_entity(100));
+  ASSERT_FALSE(sharded.add_tag(1000, 3));
+  ASSERT_FALSE(sharded.add_tag(100, 1000));
+  ASSERT_FALSE(sharded.imply(3, 100));
+
+  add_tag(100, 3);
+  add_tag(101, 3);
+  add_tag(102, 3);
+  sharded.flush();
+  for(size_t i = 0; i < sharded.num_shards(); i++) {
+    auto e = sharded.shard(i).tag_by_id(100);
+    ASSERT_EQ(i == sharded.shard_of(100), e != nullptr);
+  }
+  ASSERT_EQ(3, sharded.count("3"));
+
+  // a destroyed entity leaves its shard, and a destroyed tag every shard
+  ASSERT_TRUE(sharded.destroy_entity(101));
+  ASSERT_EQ(2, sharded.count("3"));
+  ASSERT_TRUE(sharded.destroy_tag(3));
+  ASSERT_EQ(ERR_PARSE_UNKNOWN_TAG, sharded.count("3"));
+
+  ShardedQueryResult result;
+  ASSERT_FALSE(sharded.query("4 &", result));
+  ASSERT_EQ(ERR_PARSE_SYNTAX, result.err.code);
+}
@@ -0,0 +1,118 @@
+#include "test_helper.h"
+#include "all_the_tags/plan.h"
+
+#include <cmath>
+
+class SketchTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b, *small;
+
+  void SetUp() {
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    small = ctx.new_tag();
+
+    for(int i = 0; i < 20000; i++) {
+      auto e = ctx.new_tag();
+      if(i % 2 == 0) e->add_tag(a);
+      if(i % 3 == 0) e->add_tag(b);
+      if(i % 400 == 0) e->add_tag(small);
+    }
+  }
+
+  // asserts the estimate for 'q' is within 'tolerance' of the real count
+  void check(QueryClause *q, double tolerance = 0.1) {
+    std::unique_ptr<QueryClause> owned(q);
+    double actual = query(ctx, *q).size();
+    double approx = ctx.approx_count(q);
+    ASSERT_LE(std::fabs(approx - actual), actual * tolerance) <<
+      "approx: " << approx << " actual: " << actual;
+  }
+};
+
+TEST_F(SketchTest, ExactForSmallSets) {
+  std::unique_ptr<QueryClause> q(build_lit(small));
+  ASSERT_EQ(50, ctx.approx_count(q.get()));
+
+  // a is sampled through small's sketch, which holds all of its entities
+  std::unique_ptr<QueryClause> q2(build_and(build_lit(small), build_lit(a)));
+  ASSERT_EQ(query(ctx, *q2).size(), ctx.approx_count(q2.get()));
+
+  std::unique_ptr<QueryClause> none(new QueryClauseNone());
+  ASSERT_EQ(0, ctx.approx_count(none.get()));
+}
+
+TEST_F(SketchTest, LargeSets) {
+  check(build_lit(a));
+  check(build_lit(b));
+  check(build_or(build_lit(a), build_lit(b)));
+  check(build_and(build_lit(a), build_lit(b)));
+  check(build_and(build_lit(a), build_not(build_lit(b))));
+  check(build_not(build_lit(a)));
+  check(new QueryClauseAny());
+}
+
+TEST_F(SketchTest, MaintainedOnRemove) {
+  std::vector<Tag*> entities(a->entities.begin(), a->entities.end());
+  for(size_t i = 0; i < entities.size(); i++) {
+    if(i % 10) entities[i]->remove_tag(a);
+  }
+  ASSERT_EQ(1000, a->entities.size());
+  check(build_lit(a));
+
+  // few enough to be counted exactly again
+  for(size_t i = 0; i < entities.size(); i++) {
+    if(i % 20 == 0) entities[i]->remove_tag(a);
+  }
+  check(build_lit(a), 0.0);
+
+  for(int i = 0; i < 5000; i++) {
+    ctx.destroy_tag(*(b->entities.begin()));
+  }
+  check(build_lit(b));
+  check(new QueryClauseAny());
+}
+
+TEST_F(SketchTest, MetaNodes) {
+  // entities tagged with both a and b count once
+  a->imply(b);
+  b->imply(a);
+  ASSERT_FALSE(ctx.is_dirty());
+
+  std::unique_ptr<QueryClause> q(build_lit(a));
+  double before = ctx.approx_count(q.get());
+  check(build_lit(a));
+
+  // the metanode's sketch is kept up to date from then on
+  auto c = ctx.new_tag();
+  c->imply(a);
+  for(int i = 0; i < 3000; i++) {
+    auto e = ctx.new_tag();
+    e->add_tag(i % 2 ? a : c);
+  }
+  check(build_lit(a));
+  check(build_lit(c));
+  ASSERT_GT(ctx.approx_count(q.get()), before);
+}
+
+TEST_F(SketchTest, PlannerEstimates) {
+  a->imply(b);
+  b->imply(a);
+
+  // the metanode's entity count would count the 3334 entities with both
+  // tags twice
+  auto plan = plan_query(ctx, build_lit(a));
+  double actual = query(ctx, *plan->clause).size();
+  ASSERT_LE(std::fabs(plan->est_matches - actual), actual * 0.1);
+  delete plan;
+
+  // correlated tags are estimated without pair statistics
+  auto d = ctx.new_tag();
+  for(auto e : small->entities) {
+    e->add_tag(d);
+  }
+  plan = plan_query(ctx, build_and(build_lit(small), build_lit(d)));
+  ASSERT_EQ(50, plan->est_matches);
+  delete plan;
+}
@@ -0,0 +1,109 @@
+#include "test_helper.h"
+
+#include <thread>
+#include <atomic>
+
+class SnapshotTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *animal, *dog;
+  std::vector<Tag*> entities;
+
+  void SetUp() {
+    animal = ctx.new_tag();
+    dog = ctx.new_tag();
+    dog->imply(animal);
+    for(int i = 0; i < 200; i++) {
+      auto e = ctx.new_tag();
+      if(i % 4 == 0) e->add_tag(dog);
+      entities.push_back(e);
+    }
+    ctx.enable_snapshots();
+  }
+
+  std::unordered_set<Tag*> matches(const ContextSnapshot& snap, const QueryClause *q) {
+    std::unordered_set<Tag*> matched;
+    snap.query(q, [&](Tag *e) { matched.insert(e); });
+    return matched;
+  }
+};
+
+TEST_F(SnapshotTest, SeesVersionItWasOpenedAt) {
+  std::unique_ptr<QueryClause> q(build_lit(animal));
+  const auto before = query(ctx, *q);
+  const size_t num_tags = ctx.num_tags();
+
+  ContextSnapshot snap(ctx);
+  ASSERT_EQ(num_tags, snap.num_tags());
+  ASSERT_EQ(before, matches(snap, q.get()));
+
+  // changes after it was opened aren't seen
+  entities[1]->add_tag(dog);
+  entities[0]->remove_tag(dog);
+  ctx.destroy_tag(entities[4]);
+  ctx.new_tag()->add_tag(animal);
+  ASSERT_EQ(before, matches(snap, q.get()));
+  ASSERT_EQ(num_tags, snap.num_tags());
+  ASSERT_LT(snap.version(), ctx.snapshot_store()->version());
+
+  ContextSnapshot after(ctx);
+  ASSERT_EQ(query(ctx, *q), matches(after, q.get()));
+  ASSERT_EQ(ctx.num_tags(), after.num_tags());
+  ASSERT_NE(before, matches(after, q.get()));
+}
+
+TEST_F(SnapshotTest, ConcurrentReaders) {
+  std::unique_ptr<QueryClause> q(build_lit(animal));
+
+  // the writer toggles dog on the entities, publishing a version each
+  // time, so the count each version should see is known up front
+  const int num_ops = 5000;
+  std::vector<size_t> expected;
+  std::vector<bool> has(entities.size());
+  size_t count = 0;
+  for(size_t i = 0; i < entities.size(); i++) {
+    has[i] = entities[i]->tags.count(dog);
+    count += has[i];
+  }
+  expected.push_back(count);
+  for(int op = 0; op < num_ops; op++) {
+    const size_t i = (op * 7) % entities.size();
+    count += has[i] ? -1 : 1;
+    has[i] = !has[i];
+    expected.push_back(count);
+  }
+
+  const uint64_t first = ctx.snapshot_store()->version();
+  std::atomic<bool> done(false);
+  std::atomic<long> checked(0), wrong(0);
+  std::vector<std::thread> readers;
+  for(int r = 0; r < 3; r++) {
+    readers.push_back(std::thread([&]() {
+      while(!done.load()) {
+        ContextSnapshot snap(ctx);
+        size_t seen = 0;
+        snap.query(q.get(), [&](Tag *) { seen++; });
+        if(seen != expected[snap.version() - first]) wrong++;
+        checked++;
+      }
+    }));
+  }
+
+  for(int op = 0; op < num_ops; op++) {
+    auto e = entities[(op * 7) % entities.size()];
+    if(e->tags.count(dog)) e->remove_tag(dog);
+    else                   e->add_tag(dog);
+    if(op % 64 == 0) std::this_thread::yield();
+  }
+  done = true;
+  for(auto&& reader : readers) {
+    reader.join();
+  }
+
+  ASSERT_EQ(0, wrong.load());
+  ASSERT_LT(0, checked.load());
+  ASSERT_EQ(first + num_ops, ctx.snapshot_store()->version());
+
+  // with no snapshot open, everything retired can be freed
+  ASSERT_EQ(0, ctx.snapshot_store()->reclaim());
+}
@@ -0,0 +1,226 @@
+#include "test_helper.h"
+
+class StandingQueryTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b, *c;
+  Tag *e1, *e2, *e3;
+
+  // matches as followed through the callbacks
+  std::unordered_set<Tag*> followed;
+  int enters, leaves;
+
+  void SetUp() {
+    ASSERT_NE(nullptr, a = ctx.new_tag());
+    ASSERT_NE(nullptr, b = ctx.new_tag());
+    ASSERT_NE(nullptr, c = ctx.new_tag());
+    ASSERT_NE(nullptr, e1 = ctx.new_tag());
+    ASSERT_NE(nullptr, e2 = ctx.new_tag());
+    ASSERT_NE(nullptr, e3 = ctx.new_tag());
+    enters = leaves = 0;
+  }
+
+  int watch(QueryClause *clause) {
+    return ctx.add_standing_query(clause, [&](StandingQueryEvent event, Tag *e) {
+      if(event == StandingQuery_Enter) {
+        enters++;
+        ASSERT_TRUE(followed.insert(e).second);
+      }
+      else {
+        leaves++;
+        ASSERT_EQ(1, followed.erase(e));
+      }
+    });
+  }
+
+  // the standing query's matches agree with running it from scratch
+  void expect_matches(int id, QueryClause *fresh) {
+    auto sq = ctx.standing_query(id);
+    ASSERT_TRUE(sq);
+    auto expected = query(ctx, *fresh);
+    delete fresh;
+    ASSERT_EQ(expected, sq->matches);
+  }
+};
+
+TEST_F(StandingQueryTest, EnterAndLeave) {
+  e1->add_tag(a);
+  followed = SET(Tag*, {e1});
+  int id = watch(build_and(build_lit(a), build_not(build_lit(b))));
+  ASSERT_EQ(SET(Tag*, {e1}), ctx.standing_query(id)->matches);
+  ASSERT_EQ(0, enters);
+
+  e2->add_tag(a);
+  ASSERT_EQ(1, enters);
+  ASSERT_EQ(SET(Tag*, {e1, e2}), followed);
+
+  e1->add_tag(b);
+  ASSERT_EQ(1, leaves);
+  ASSERT_EQ(SET(Tag*, {e2}), followed);
+
+  // a tag the query doesn't test for changes nothing
+  e2->add_tag(c);
+  ASSERT_EQ(1, enters);
+  ASSERT_EQ(1, leaves);
+
+  e1->remove_tag(b);
+  ASSERT_EQ(2, enters);
+  ctx.destroy_tag(e2);
+  ASSERT_EQ(2, leaves);
+  ASSERT_EQ(SET(Tag*, {e1}), followed);
+  expect_matches(id, build_and(build_lit(a), build_not(build_lit(b))));
+
+  ASSERT_TRUE(ctx.remove_standing_query(id));
+  ASSERT_FALSE(ctx.remove_standing_query(id));
+  ASSERT_EQ(nullptr, ctx.standing_query(id));
+  e3->add_tag(a);
+  ASSERT_EQ(2, enters);
+}
+
+TEST_F(StandingQueryTest, RelMasks) {
+  int id = watch(build_lit(a, 2));
+  e1->add_tag(a, 1);
+  ASSERT_EQ(0, enters);
+  e1->add_tag(a, 2);
+  ASSERT_EQ(1, enters);
+  e1->remove_tag(a, 2);
+  ASSERT_EQ(1, leaves);
+  expect_matches(id, build_lit(a, 2));
+}
+
+TEST_F(StandingQueryTest, NewEntities) {
+  int id = watch(build_not(build_lit(a)));
+  followed = ctx.standing_query(id)->matches;
+
+  auto e4 = ctx.new_tag();
+  ASSERT_EQ(1, enters);
+  ASSERT_TRUE(followed.count(e4));
+  e4->add_tag(a);
+  ASSERT_EQ(1, leaves);
+  expect_matches(id, build_not(build_lit(a)));
+}
+
+TEST_F(StandingQueryTest, Implications) {
+  e1->add_tag(a);
+  e2->add_tag(b);
+  int id = watch(build_lit(c));
+  ASSERT_TRUE(ctx.standing_query(id)->matches.empty());
+
+  // a -> b -> c, so everything tagged a or b is now tagged c too
+  b->imply(c);
+  ASSERT_EQ(SET(Tag*, {e2}), followed);
+  a->imply(b);
+  ASSERT_EQ(SET(Tag*, {e1, e2}), followed);
+  expect_matches(id, build_lit(c));
+
+  e3->add_tag(a);
+  ASSERT_EQ(SET(Tag*, {e1, e2, e3}), followed);
+
+  // removing an implication updates the metagraph in place
+  b->unimply(c);
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(SET(Tag*, {}), followed);
+  ASSERT_EQ(3, leaves);
+  expect_matches(id, build_lit(c));
+}
+
+TEST_F(StandingQueryTest, BulkImplications) {
+  e1->add_tag(a);
+  e2->add_tag(b);
+  int id = watch(build_lit(c));
+
+  // big enough next to the graph to rebuild the metagraph
+  ASSERT_EQ(2, ctx.imply_many({{a, b}, {b, c}, {a, b}}));
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(SET(Tag*, {e1, e2}), followed);
+  expect_matches(id, build_lit(c));
+
+  ASSERT_EQ(1, ctx.unimply_many({{b, c}, {c, a}}));
+  ASSERT_EQ(SET(Tag*, {}), followed);
+  expect_matches(id, build_lit(c));
+}
+
+TEST_F(StandingQueryTest, DirtyContext) {
+  a->imply(b);
+  e1->add_tag(a);
+  int id = watch(build_lit(b));
+  ASSERT_EQ(SET(Tag*, {e1}), ctx.standing_query(id)->matches);
+  followed = SET(Tag*, {e1});
+
+  // nothing is reported until the metagraph is rebuilt
+  ctx.mark_dirty();
+  e2->add_tag(b);
+  a->unimply(b);
+  ASSERT_EQ(0, enters);
+  ASSERT_EQ(0, leaves);
+
+  ctx.make_clean();
+  ASSERT_EQ(SET(Tag*, {e2}), followed);
+  expect_matches(id, build_lit(b));
+
+  // registered while dirty, the matches are found by make_clean
+  ctx.mark_dirty();
+  int dirty_id = watch(build_lit(b));
+  ctx.make_clean();
+  expect_matches(dirty_id, build_lit(b));
+}
+
+TEST_F(StandingQueryTest, DestroyQueriedTag) {
+  e1->add_tag(a);
+  e2->add_tag(b);
+  int id = watch(build_or(build_lit(a), build_lit(b)));
+  followed = SET(Tag*, {e1, e2});
+
+  ctx.destroy_tag(a);
+  ASSERT_EQ(SET(Tag*, {e2}), followed);
+  expect_matches(id, build_lit(b));
+
+  // still follows the tags that are left
+  e3->add_tag(b);
+  ASSERT_EQ(SET(Tag*, {e2, e3}), followed);
+}
+
+TEST_F(StandingQueryTest, RandomOperations) {
+  std::vector<Tag*> tags = {a, b, c};
+  for(int i = 0; i < 3; i++) { tags.push_back(ctx.new_tag()); }
+  std::vector<Tag*> ents = {e1, e2, e3};
+  for(int i = 0; i < 20; i++) { ents.push_back(ctx.new_tag()); }
+
+  auto make_query = [&]() {
+    return build_or(
+      build_and(build_lit(tags[0]), build_not(build_lit(tags[1], 1))),
+      build_and(build_lit(tags[2]), build_lit(tags[3])));
+  };
+  int id = watch(make_query());
+  followed = ctx.standing_query(id)->matches;
+
+  unsigned seed = 7;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+  };
+
+  for(int i = 0; i < 2000; i++) {
+    auto t1 = tags[rand() % tags.size()];
+    auto t2 = tags[rand() % tags.size()];
+    auto e  = ents[rand() % ents.size()];
+    switch(rand() % 6) {
+      case 0: case 1: e->add_tag(t1, 1 + rand() % 3); break;
+      case 2: e->remove_tag(t1, 1 + rand() % 3); break;
+      case 3: t1->imply(t2); break;
+      case 4: t1->unimply(t2); break;
+      case 5:
+        ctx.mark_dirty();
+        e->add_tag(t1);
+        t2->unimply(t1);
+        break;
+    }
+    ctx.make_clean();
+
+    ASSERT_EQ(ctx.standing_query(id)->matches, followed) << i;
+    if(i % 50 == 0) {
+      expect_matches(id, make_query());
+    }
+  }
+  expect_matches(id, make_query());
+}
@@ -1,4 +1,6 @@
 #include "test_helper.h"
+#include <set>
+#include <algorithm>
 
 class TagImplicationTest : public ::testing::Test {
 public:
@@ -317,9 +319,8 @@ TEST_F(TagImplicationTest, ImplyCycleRemove) {
     ASSERT_EQ(tag->meta_node(), *(ctx.sink_meta_nodes.begin()));
   }
 
+  // the cycle is split up without a rebuild
   ASSERT_TRUE(c->unimply(a));
-  ASSERT_TRUE(ctx.is_dirty());
-  ctx.make_clean();
   ASSERT_FALSE(ctx.is_dirty());
 
   ASSERT_NE(a->meta_node(), b->meta_node());
@@ -494,3 +495,635 @@ TEST(SimpleTagImplicationTest, AFLTestCase3) {
   ASSERT_TRUE(ctx.query(clause, [](Tag const* e){}) >= 0);
   delete clause;
 }
+
+TEST_F(TagImplicationTest, AncestorClosureCached) {
+  // a -> b -> d, a -> c -> d
+  a->imply(b);
+  a->imply(c);
+  b->imply(d);
+  c->imply(d);
+
+  auto closure = ctx.ancestors(d->meta_node());
+  ASSERT_EQ(SCCMetaNode::node_set({a->meta_node(), b->meta_node(), c->meta_node(), d->meta_node()}), closure);
+  ASSERT_EQ(ctx.reach_version(), d->meta_node()->ancestors_version);
+  ASSERT_EQ(SCCMetaNode::node_set({a->meta_node(), b->meta_node()}), ctx.ancestors(b->meta_node()));
+
+  // an implication that was already implied keeps them
+  ASSERT_TRUE(ctx.reaches(a->meta_node(), d->meta_node()));
+  a->imply(d);
+  ASSERT_EQ(ctx.reach_version(), d->meta_node()->ancestors_version);
+  a->unimply(d);
+  ASSERT_EQ(ctx.reach_version(), d->meta_node()->ancestors_version);
+
+  // changing what implies what invalidates the cached closures
+  e->imply(c);
+  ASSERT_NE(ctx.reach_version(), d->meta_node()->ancestors_version);
+  ASSERT_EQ(SCCMetaNode::node_set({a->meta_node(), b->meta_node(), c->meta_node(), d->meta_node(), e->meta_node()}),
+    ctx.ancestors(d->meta_node()));
+
+  a->unimply(b);
+  ctx.make_clean();
+  ASSERT_EQ(SCCMetaNode::node_set({b->meta_node()}), ctx.ancestors(b->meta_node()));
+}
+
+TEST(SimpleTagImplicationTest, DiamondLatticeClosure) {
+  Context ctx;
+
+  // 40 levels of 4 tags, each implying two tags on the level below: the
+  // number of paths from the top to the bottom doubles every level
+  const int levels = 40, width = 4;
+  std::vector<std::vector<Tag*>> lattice(levels);
+  for(auto&& level : lattice) {
+    for(int i = 0; i < width; i++) { level.push_back(ctx.new_tag()); }
+  }
+  for(int l = 0; l + 1 < levels; l++) {
+    for(int i = 0; i < width; i++) {
+      lattice[l][i]->imply(lattice[l + 1][i]);
+      lattice[l][i]->imply(lattice[l + 1][(i + 1) % width]);
+    }
+  }
+
+  auto e = ctx.new_tag();
+  e->add_tag(lattice[0][0]);
+
+  auto q = build_lit(lattice[levels - 1][0]);
+  auto set = dynamic_cast<QueryClauseMetaSet*>(q);
+  ASSERT_TRUE(set);
+  // the bottom tag is implied by 1, 2, 3 and then all 4 tags of the
+  // levels above it
+  ASSERT_EQ(1 + 2 + 3 + (levels - 3) * width, set->nodes.size());
+  for(auto top : lattice[0]) {
+    ASSERT_TRUE(set->nodes.count(top->meta_node()));
+  }
+  ASSERT_EQ(SET(Tag*, {e}), query(ctx, *q));
+  delete q;
+}
+
+TEST_F(TagImplicationTest, UnimplySplitsCycle) {
+  // e -> {a, b, c} -> d, with the cycle a -> b -> c -> a
+  a->imply(b);
+  b->imply(c);
+  c->imply(a);
+  e->imply(a);
+  c->imply(d);
+  ASSERT_EQ(3, ctx.meta_nodes.size());
+
+  // now e -> a -> b -> c -> d
+  ASSERT_TRUE(c->unimply(a));
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(5, ctx.meta_nodes.size());
+  ASSERT_EQ(SET(SCCMetaNode*, {a->meta_node()}), e->meta_node()->children);
+  ASSERT_EQ(SET(SCCMetaNode*, {b->meta_node()}), a->meta_node()->children);
+  ASSERT_EQ(SET(SCCMetaNode*, {c->meta_node()}), b->meta_node()->children);
+  ASSERT_EQ(SET(SCCMetaNode*, {d->meta_node()}), c->meta_node()->children);
+  ASSERT_EQ(SET(SCCMetaNode*, {d->meta_node()}), ctx.sink_meta_nodes);
+
+  // dropping the last edge from e takes it out of the metagraph
+  ASSERT_TRUE(e->unimply(a));
+  ASSERT_EQ(nullptr, e->meta_node());
+  ASSERT_EQ(4, ctx.meta_nodes.size());
+  ASSERT_TRUE(a->meta_node()->parents.empty());
+}
+
+TEST_F(TagImplicationTest, UnimplyKeepsSupportedEdge) {
+  // {a, b} -> {c}, through both a -> c and b -> c
+  a->imply(b);
+  b->imply(a);
+  a->imply(c);
+  b->imply(c);
+
+  ASSERT_TRUE(b->unimply(c));
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(SET(SCCMetaNode*, {c->meta_node()}), a->meta_node()->children);
+
+  ASSERT_TRUE(a->unimply(c));
+  ASSERT_EQ(nullptr, c->meta_node());
+  ASSERT_TRUE(a->meta_node()->children.empty());
+  ASSERT_EQ(SET(SCCMetaNode*, {a->meta_node()}), ctx.sink_meta_nodes);
+}
+
+// the metagraph as sets of tag ids, so the one kept up to date can be
+// compared with the one make_clean builds
+struct MetagraphShape {
+  std::set<std::set<id_type>> nodes;
+  std::set<std::pair<id_type, id_type>> edges; // by the lowest tag id of each
+  std::set<id_type> sinks;
+
+  static id_type key(const SCCMetaNode *node) {
+    id_type lowest = (*(node->tags.begin()))->id;
+    for(auto t : node->tags) { lowest = std::min(lowest, t->id); }
+    return lowest;
+  }
+
+  MetagraphShape(const Context& ctx) {
+    for(auto node : ctx.meta_nodes) {
+      std::set<id_type> ids;
+      for(auto t : node->tags) { ids.insert(t->id); }
+      nodes.insert(ids);
+      for(auto child : node->children) {
+        edges.insert(std::make_pair(key(node), key(child)));
+      }
+    }
+    for(auto node : ctx.sink_meta_nodes) {
+      sinks.insert(key(node));
+    }
+  }
+
+  bool operator==(const MetagraphShape& other) const {
+    return nodes == other.nodes && edges == other.edges && sinks == other.sinks;
+  }
+};
+
+// every metanode comes after its parents in the maintained order
+static bool in_topological_order(const Context& ctx) {
+  for(auto node : ctx.meta_nodes) {
+    for(auto child : node->children) {
+      if(child->order <= node->order) return false;
+    }
+  }
+  return true;
+}
+
+TEST(SimpleTagImplicationTest, IncrementalMatchesRebuild) {
+  Context ctx;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < 12; i++) { tags.push_back(ctx.new_tag()); }
+
+  srand(38);
+  for(int i = 0; i < 2000; i++) {
+    auto t1 = tags[rand() % tags.size()];
+    auto t2 = tags[rand() % tags.size()];
+    if(rand() % 5 < 3) t1->imply(t2);
+    else               t1->unimply(t2);
+    ASSERT_FALSE(ctx.is_dirty());
+    ASSERT_TRUE(in_topological_order(ctx)) << "after op " << i;
+
+    MetagraphShape incremental(ctx);
+    if(i % 2) {
+      // also carry on from a rebuilt metagraph
+      ctx.mark_dirty();
+      ctx.make_clean();
+      ASSERT_TRUE(in_topological_order(ctx));
+      ASSERT_TRUE(incremental == MetagraphShape(ctx)) << "after op " << i;
+    }
+  }
+}
+
+TEST(SimpleTagImplicationTest, ShuffledImportKeepsOrder) {
+  Context ctx;
+  const int n = 300;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < n; i++) { tags.push_back(ctx.new_tag()); }
+
+  // edges only go from lower to higher indexes, added in random order
+  std::vector<std::pair<int, int>> edges;
+  srand(39);
+  for(int i = 0; i < 4 * n; i++) {
+    int from = rand() % (n - 1);
+    int to = from + 1 + rand() % (n - 1 - from);
+    edges.push_back(std::make_pair(from, to));
+  }
+  for(int i = 0; i + 1 < n; i++) {
+    edges.push_back(std::make_pair(i, i + 1));
+  }
+  std::random_shuffle(edges.begin(), edges.end());
+
+  for(auto&& edge : edges) {
+    tags[edge.first]->imply(tags[edge.second]);
+  }
+  ASSERT_TRUE(in_topological_order(ctx));
+  ASSERT_EQ(n, ctx.meta_nodes.size());
+  ASSERT_EQ(SET(SCCMetaNode*, {tags.back()->meta_node()}), ctx.sink_meta_nodes);
+
+  // closing the chain into a cycle collapses everything
+  tags.back()->imply(tags.front());
+  ASSERT_EQ(1, ctx.meta_nodes.size());
+  ASSERT_TRUE(ctx.sink_meta_nodes.count(tags[n / 2]->meta_node()));
+
+  // and breaking it again orders the split metanodes among themselves
+  tags.back()->unimply(tags.front());
+  ASSERT_EQ(n, ctx.meta_nodes.size());
+  ASSERT_TRUE(in_topological_order(ctx));
+}
+
+TEST(SimpleTagImplicationTest, LongChainAndCycle) {
+  // deep enough to overflow the stack if the SCCs were found recursively
+  Context ctx;
+  const int n = 100000;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < n; i++) { tags.push_back(ctx.new_tag()); }
+
+  ctx.mark_dirty();
+  for(int i = 0; i + 1 < n; i++) {
+    tags[i]->imply(tags[i + 1]);
+  }
+  ctx.make_clean();
+  ASSERT_EQ(n, ctx.meta_nodes.size());
+  ASSERT_EQ(SET(SCCMetaNode*, {tags.back()->meta_node()}), ctx.sink_meta_nodes);
+  ASSERT_TRUE(in_topological_order(ctx));
+
+  ctx.mark_dirty();
+  tags.back()->imply(tags.front());
+  ctx.make_clean();
+  ASSERT_EQ(1, ctx.meta_nodes.size());
+  ASSERT_EQ(n, tags.front()->meta_node()->tags.size());
+
+  // splitting the cycle again
+  tags[n / 2]->unimply(tags[n / 2 + 1]);
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(n, ctx.meta_nodes.size());
+  ASSERT_EQ(SET(SCCMetaNode*, {tags[n / 2]->meta_node()}), ctx.sink_meta_nodes);
+  ASSERT_TRUE(in_topological_order(ctx));
+}
+
+TEST(SimpleTagImplicationTest, ParallelRebuildMatchesSerial) {
+  Context ctx;
+  const int n = 6000;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < n; i++) { tags.push_back(ctx.new_tag()); }
+
+  srand(41);
+  for(int round = 0; round < 4; round++) {
+    // mostly forward edges, with some back edges making cycles of all sizes
+    ctx.mark_dirty();
+    for(int i = 0; i < n * (round + 1) / 2; i++) {
+      int from = rand() % n, to = rand() % n;
+      if(rand() % 8 && from > to) std::swap(from, to);
+      if(rand() % 4) tags[from]->imply(tags[to]);
+      else           tags[from]->unimply(tags[to]);
+    }
+
+    ctx.set_rebuild_threads(1);
+    ctx.make_clean();
+    MetagraphShape serial(ctx);
+
+    ctx.set_rebuild_threads(4, 0);
+    ctx.mark_dirty();
+    ctx.make_clean();
+    ASSERT_TRUE(in_topological_order(ctx)) << "round " << round;
+    ASSERT_TRUE(serial == MetagraphShape(ctx)) << "round " << round;
+  }
+
+  // kept up to date incrementally from the parallel rebuild
+  for(int i = 0; i < 200; i++) {
+    auto t1 = tags[rand() % n], t2 = tags[rand() % n];
+    if(rand() % 2) t1->imply(t2);
+    else           t1->unimply(t2);
+  }
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_TRUE(in_topological_order(ctx));
+  MetagraphShape incremental(ctx);
+  ctx.mark_dirty();
+  ctx.make_clean();
+  ASSERT_TRUE(incremental == MetagraphShape(ctx));
+}
+
+TEST(SimpleTagImplicationTest, ImplyManyMatchesOneByOne) {
+  Context bulk, single;
+  const int n = 2000;
+  std::vector<Tag*> bulk_tags, single_tags;
+  for(int i = 0; i < n; i++) {
+    bulk_tags.push_back(bulk.new_tag());
+    single_tags.push_back(single.new_tag());
+  }
+
+  srand(42);
+  // a big batch rebuilds the metagraph, then smaller ones update it
+  for(int batch_size : {4 * n, n / 100, 3, n}) {
+    for(bool add : {true, false, true}) {
+      std::vector<Context::imply_edge> edges;
+      size_t changed = 0;
+      for(int i = 0; i < batch_size; i++) {
+        int from = rand() % n, to = rand() % n;
+        if(rand() % 16 && from > to) std::swap(from, to);
+        edges.push_back(std::make_pair(bulk_tags[from], bulk_tags[to]));
+        changed += add ?
+          single_tags[from]->imply(single_tags[to]) :
+          single_tags[from]->unimply(single_tags[to]);
+      }
+
+      ASSERT_EQ(changed, add ? bulk.imply_many(edges) : bulk.unimply_many(edges));
+      ASSERT_FALSE(bulk.is_dirty());
+      ASSERT_TRUE(in_topological_order(bulk));
+      ASSERT_TRUE(MetagraphShape(single) == MetagraphShape(bulk)) << batch_size;
+    }
+  }
+
+  // a dirty context is left for make_clean
+  bulk_tags[1]->unimply(bulk_tags[0]);
+  bulk.mark_dirty();
+  ASSERT_EQ(1, bulk.imply_many({{bulk_tags[1], bulk_tags[0]}, {bulk_tags[0], bulk_tags[0]}}));
+  ASSERT_TRUE(bulk.is_dirty());
+  ASSERT_TRUE(bulk_tags[1]->implies.count(bulk_tags[0]));
+}
+
+// what a metanode reaches, found by following every edge
+static std::set<const SCCMetaNode*> reachable_from(const SCCMetaNode *node) {
+  std::set<const SCCMetaNode*> seen = {node};
+  std::vector<const SCCMetaNode*> stack = {node};
+  while(stack.size()) {
+    auto top = stack.back();
+    stack.pop_back();
+    for(auto child : top->children) {
+      if(seen.insert(child).second) stack.push_back(child);
+    }
+  }
+  return seen;
+}
+
+TEST(SimpleTagImplicationTest, ReachabilityMatchesSearch) {
+  Context ctx;
+  std::vector<Tag*> tags;
+  for(int i = 0; i < 40; i++) { tags.push_back(ctx.new_tag()); }
+
+  srand(43);
+  for(int i = 0; i < 600; i++) {
+    // mostly edges that keep to the order, which keep the labels
+    int from = rand() % tags.size(), to = rand() % tags.size();
+    if(rand() % 10 && from > to) std::swap(from, to);
+    if(rand() % 3) tags[from]->imply(tags[to]);
+    else           tags[from]->unimply(tags[to]);
+    if(i % 50 == 0) {
+      ctx.mark_dirty();
+      ctx.make_clean();
+    }
+
+    for(auto node : ctx.meta_nodes) {
+      auto expected = reachable_from(node);
+      for(auto other : ctx.meta_nodes) {
+        ASSERT_EQ(expected.count(other) == 1, ctx.reaches(node, other)) << "after op " << i;
+      }
+
+      std::vector<SCCMetaNode*> found;
+      ctx.descendants(node, found);
+      ASSERT_EQ(expected.size(), found.size());
+      ASSERT_EQ(expected, std::set<const SCCMetaNode*>(found.begin(), found.end()));
+    }
+  }
+
+  // between tags, including those outside of the metagraph
+  auto lone = ctx.new_tag();
+  ASSERT_TRUE(ctx.implies(lone, lone));
+  ASSERT_FALSE(ctx.implies(lone, tags[0]));
+  tags[0]->imply(tags[1]);
+  tags[1]->imply(tags[2]);
+  ASSERT_TRUE(ctx.implies(tags[0], tags[2]));
+}
+
+// every pair of metanodes (by their lowest tag id) where one reaches the other
+static std::set<std::pair<id_type, id_type>> reachable_pairs(const Context& ctx) {
+  std::set<std::pair<id_type, id_type>> pairs;
+  for(auto node : ctx.meta_nodes) {
+    for(auto reached : reachable_from(node)) {
+      pairs.insert(std::make_pair(MetagraphShape::key(node), MetagraphShape::key(reached)));
+    }
+  }
+  return pairs;
+}
+
+// no edge leads to a metanode another of its parent's children reaches
+static bool transitively_reduced(const Context& ctx) {
+  for(auto node : ctx.meta_nodes) {
+    for(auto child : node->children) {
+      for(auto other : node->children) {
+        if(other != child && reachable_from(other).count(child)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+TEST(SimpleTagImplicationTest, TransitiveReduction) {
+  // a -> b -> c, and a -> c
+  Context ctx;
+  auto a = ctx.new_tag(), b = ctx.new_tag(), c = ctx.new_tag(), d = ctx.new_tag();
+  a->imply(b);
+  b->imply(c);
+  a->imply(c);
+  ASSERT_EQ(2, a->meta_node()->children.size());
+
+  ctx.set_transitive_reduction(true);
+  ASSERT_EQ(SET(SCCMetaNode*, {b->meta_node()}), a->meta_node()->children);
+
+  // the implication is still there, so a still implies c without b
+  b->unimply(c);
+  ASSERT_EQ(SET(SCCMetaNode*, {b->meta_node(), c->meta_node()}), a->meta_node()->children);
+  ASSERT_TRUE(ctx.implies(a, c));
+
+  // an implication already implied isn't added
+  d->imply(a);
+  d->imply(c);
+  ASSERT_EQ(SET(SCCMetaNode*, {a->meta_node()}), d->meta_node()->children);
+
+  // and turning it off brings every edge back
+  ctx.set_transitive_reduction(false);
+  ASSERT_EQ(SET(SCCMetaNode*, {a->meta_node(), c->meta_node()}), d->meta_node()->children);
+}
+
+TEST(SimpleTagImplicationTest, ReducedMatchesFull) {
+  Context full, reduced;
+  reduced.set_transitive_reduction(true);
+  std::vector<Tag*> full_tags, reduced_tags;
+  for(int i = 0; i < 25; i++) {
+    full_tags.push_back(full.new_tag());
+    reduced_tags.push_back(reduced.new_tag());
+  }
+
+  srand(44);
+  for(int i = 0; i < 1500; i++) {
+    int from = rand() % full_tags.size(), to = rand() % full_tags.size();
+    if(rand() % 8 && from > to) std::swap(from, to);
+    if(rand() % 5 < 3) {
+      full_tags[from]->imply(full_tags[to]);
+      reduced_tags[from]->imply(reduced_tags[to]);
+    }
+    else {
+      full_tags[from]->unimply(full_tags[to]);
+      reduced_tags[from]->unimply(reduced_tags[to]);
+    }
+    if(i % 100 == 0) {
+      reduced.mark_dirty();
+      reduced.make_clean();
+    }
+    if(i % 3 == 0) {
+      // use the labels some of the time
+      for(auto node : reduced.meta_nodes) reduced.reaches(node, node);
+    }
+
+    MetagraphShape full_shape(full), reduced_shape(reduced);
+    ASSERT_EQ(full_shape.nodes, reduced_shape.nodes) << "after op " << i;
+    ASSERT_EQ(full_shape.sinks, reduced_shape.sinks) << "after op " << i;
+    ASSERT_EQ(reachable_pairs(full), reachable_pairs(reduced)) << "after op " << i;
+    ASSERT_TRUE(transitively_reduced(reduced)) << "after op " << i;
+    ASSERT_TRUE(in_topological_order(reduced)) << "after op " << i;
+  }
+}
+
+// the entities with a tag implying 'tag', found the long way round
+static Tag::entity_set implied_entities(Context& ctx, Tag *tag, const std::vector<Tag*>& entities) {
+  Tag::entity_set matched;
+  for(auto entity : entities) {
+    for(auto tagging : entity->tags) {
+      if(ctx.implies(tagging.first, tag)) {
+        matched.insert(entity);
+        break;
+      }
+    }
+  }
+  return matched;
+}
+
+TEST(SimpleTagImplicationTest, ClosureSetsMatchSearch) {
+  Context ctx;
+  ctx.set_closure_sets(true, 2);
+  std::vector<Tag*> tags, entities;
+  for(int i = 0; i < 20; i++) tags.push_back(ctx.new_tag());
+  for(int i = 0; i < 60; i++) entities.push_back(ctx.new_tag());
+
+  srand(45);
+  for(int i = 0; i < 2000; i++) {
+    auto tag = tags[rand() % tags.size()], other = tags[rand() % tags.size()];
+    auto entity = entities[rand() % entities.size()];
+    switch(rand() % 4) {
+    case 0: tag->imply(other); break;
+    case 1: tag->unimply(other); break;
+    case 2: entity->add_tag(tag); break;
+    case 3: entity->remove_tag(tag); break;
+    }
+    if(i % 150 == 0) {
+      ctx.mark_dirty();
+      ctx.make_clean();
+    }
+
+    for(auto t : tags) {
+      if(!t->meta_node()) continue;
+      auto closure = ctx.closure_set(t->meta_node());
+      if(!closure) {
+        ASSERT_LT(ctx.ancestors(t->meta_node()).size(), 2) << "after op " << i;
+        continue;
+      }
+      ASSERT_EQ(implied_entities(ctx, t, entities), *closure) << "after op " << i;
+
+      auto lit = dynamic_cast<QueryClauseMetaSet*>(build_lit(t));
+      ASSERT_NE(nullptr, lit);
+      ASSERT_EQ(closure, lit->closure);
+      ASSERT_EQ((int) closure->size(), lit->entity_count());
+      delete lit;
+    }
+  }
+
+  // turning them off drops them. the random implications above may have
+  // collapsed every tag into one metanode, so a tag implied by two others
+  // is set up for this
+  auto implied = ctx.new_tag(), first = ctx.new_tag(), second = ctx.new_tag();
+  first->imply(implied);
+  second->imply(implied);
+  auto node = implied->meta_node();
+  ASSERT_NE(nullptr, node);
+  ASSERT_NE(nullptr, ctx.closure_set(node));
+  ctx.set_closure_sets(false);
+  ASSERT_EQ(nullptr, ctx.closure_set(node));
+}
+
+TEST(SimpleTagImplicationTest, QueriesDuringBackgroundRebuild) {
+  Context ctx;
+  auto animal = ctx.new_tag(), dog = ctx.new_tag(), cat = ctx.new_tag();
+  dog->imply(animal);
+  auto rex = ctx.new_tag(), tom = ctx.new_tag();
+  rex->add_tag(dog);
+  tom->add_tag(cat);
+
+  auto plan = plan_query(ctx, build_lit(animal));
+  std::unordered_set<Tag*> matched;
+  auto run = [&]() {
+    matched.clear();
+    return ctx.query(plan, [&](Tag *e) { matched.insert(e); });
+  };
+  ASSERT_LE(0, run());
+  ASSERT_EQ(std::unordered_set<Tag*>({rex}), matched);
+
+  // a clause from build_lit holds on to the metanodes too
+  auto clause = build_lit(animal);
+  auto run_clause = [&]() {
+    matched.clear();
+    return ctx.query(clause, [&](Tag *e) { matched.insert(e); });
+  };
+
+  // while dirty and rebuilding, queries see the last metagraph
+  ctx.mark_dirty();
+  cat->imply(animal);
+  ASSERT_TRUE(ctx.start_rebuild());
+  ASSERT_FALSE(ctx.start_rebuild());
+  ASSERT_LE(0, run());
+  ASSERT_EQ(std::unordered_set<Tag*>({rex}), matched);
+  ASSERT_LE(0, run_clause());
+  ASSERT_EQ(std::unordered_set<Tag*>({rex}), matched);
+  while(!ctx.rebuild_ready()) std::this_thread::yield();
+  ASSERT_TRUE(ctx.is_dirty());
+  ASSERT_LE(0, run());
+
+  // and plans against it are stale once the new one is published
+  ASSERT_TRUE(ctx.finish_rebuild());
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_FALSE(ctx.is_current(plan));
+  ASSERT_EQ(ERR_PLAN_STALE, run());
+  delete plan;
+
+  // which were freed, so the clause is refused rather than run, and
+  // can't be planned either
+  ASSERT_FALSE(ctx.is_current(clause));
+  ASSERT_EQ(ERR_PLAN_STALE, run_clause());
+  plan = plan_query(ctx, clause);
+  ASSERT_FALSE(ctx.is_current(plan));
+  ASSERT_EQ(ERR_PLAN_STALE, run());
+  delete plan;
+
+  plan = plan_query(ctx, build_lit(animal));
+  ASSERT_LE(0, run());
+  ASSERT_EQ(std::unordered_set<Tag*>({rex, tom}), matched);
+  delete plan;
+}
+
+TEST(SimpleTagImplicationTest, BackgroundRebuildMatchesRebuild) {
+  Context ctx, expected;
+  std::vector<Tag*> tags, expected_tags;
+  for(int i = 0; i < 40; i++) {
+    tags.push_back(ctx.new_tag());
+    expected_tags.push_back(expected.new_tag());
+  }
+
+  srand(46);
+  for(int round = 0; round < 30; round++) {
+    ctx.mark_dirty();
+    for(int i = 0; i < 20; i++) {
+      int from = rand() % tags.size(), to = rand() % tags.size();
+      tags[from]->imply(tags[to]);
+      expected_tags[from]->imply(expected_tags[to]);
+    }
+    ASSERT_TRUE(ctx.start_rebuild());
+
+    // implications changed after the copy leave the context dirty
+    const bool edit = round % 3 == 0;
+    if(edit) {
+      auto from = std::find_if(tags.begin(), tags.end(), [](Tag *t) { return t->implies.size(); });
+      auto to = *(*from)->implies.begin();
+      ASSERT_TRUE((*from)->unimply(to));
+      expected.tag_by_id((*from)->id)->unimply(expected.tag_by_id(to->id));
+    }
+    // destroying a tag in the copy publishes it first
+    if(round % 5 == 1) {
+      auto id = tags.back()->id;
+      ctx.destroy_tag(tags.back());
+      expected.destroy_tag(expected_tags.back());
+      tags.back() = ctx.new_tag(id);
+      expected_tags.back() = expected.new_tag(id);
+    }
+
+    ctx.finish_rebuild();
+    ASSERT_EQ(edit, ctx.is_dirty()) << "in round " << round;
+    ctx.make_clean();
+    ASSERT_FALSE(ctx.is_dirty());
+    ASSERT_TRUE(MetagraphShape(expected) == MetagraphShape(ctx)) << "in round " << round;
+    ASSERT_TRUE(in_topological_order(ctx)) << "in round " << round;
+  }
+}
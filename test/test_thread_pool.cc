@@ -0,0 +1,78 @@
+#include "test_helper.h"
+
+#include <atomic>
+#include <vector>
+
+// sums [begin, end) into 'sum' by splitting it in halves, each a task of
+// its own
+static void split_sum(TaskGroup& group, long begin, long end, std::atomic<long>& sum) {
+  if(end - begin <= 16) {
+    long s = 0;
+    for(long i = begin; i < end; i++) { s += i; }
+    sum += s;
+    return;
+  }
+  const long mid = (begin + end) / 2;
+  group.run([&group, mid, end, &sum]() {
+    split_sum(group, mid, end, sum);
+  });
+  split_sum(group, begin, mid, sum);
+}
+
+TEST(ThreadPoolTest, NestedGroups) {
+  // a pool with no threads of its own is run by those waiting on it
+  for(unsigned threads : {0u, 1u, 3u}) {
+    ThreadPool pool(threads);
+    std::atomic<long> sum(0);
+    {
+      TaskGroup group(&pool);
+      split_sum(group, 0, 100000, sum);
+      group.wait();
+    }
+    ASSERT_EQ(100000L * 99999 / 2, sum.load()) << threads;
+
+    // groups waited on from inside tasks of another
+    std::atomic<long> inner(0);
+    TaskGroup outer(&pool);
+    for(int t = 0; t < 8; t++) {
+      outer.run([&pool, &inner]() {
+        TaskGroup group(&pool);
+        for(int i = 0; i < 8; i++) {
+          group.run([&inner]() { inner++; });
+        }
+        group.wait();
+      });
+    }
+    outer.wait();
+    ASSERT_EQ(64, inner.load()) << threads;
+  }
+}
+
+TEST(ThreadPoolTest, MorselsCoverRange) {
+  ThreadPool pool(2);
+  for(size_t n : {0, 1, 999, 1000, 1001, 12345}) {
+    std::vector<std::atomic<int>> seen(n);
+    for(auto& s : seen) { s = 0; }
+    std::atomic<size_t> morsels(0);
+    parallel_morsels(&pool, n, 100, [&](size_t morsel, size_t begin, size_t end) {
+      ASSERT_EQ(morsel * 100, begin);
+      ASSERT_LE(end - begin, 100u);
+      for(size_t i = begin; i < end; i++) { seen[i]++; }
+      morsels++;
+    });
+    ASSERT_EQ((n + 99) / 100, morsels.load());
+    for(auto& s : seen) { ASSERT_EQ(1, s.load()); }
+  }
+}
+
+TEST(ThreadPoolTest, OneWorkerRunsInOrder) {
+  std::vector<int> order;
+  {
+    ThreadPool pool(1);
+    for(int i = 0; i < 1000; i++) {
+      pool.submit([&order, i]() { order.push_back(i); });
+    }
+  }
+  ASSERT_EQ(1000, order.size());
+  for(int i = 0; i < 1000; i++) { ASSERT_EQ(i, order[i]); }
+}